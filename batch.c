@@ -0,0 +1,481 @@
+
+/* Batch runner, running the jobs of a manifest on a pool of worker threads */
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "batch.h"
+#include "elf.h"
+#include "jvm.h"
+
+typedef struct batch_job_t
+{
+	// from the manifest, input_name and expected_name are NULL if not given
+	char * binary;
+	char * input_name;
+	char * expected_name;
+	int argc;
+	char ** argv;
+
+	// results
+	bool loaded;
+	bool passed;
+	int exit_status;
+	uint64_t instruction_count;
+	double wall_time;
+	char * message; // the reason the job failed, if any
+} batch_job_t;
+
+/* Work stealing
+ * Every worker owns a contiguous range of job indexes and runs them from the front
+ * Once its range is empty, it takes over the back half of the range of another worker
+ * A stolen range is removed from its victim before the thief publishes it, so finding every range empty does not mean
+ * that no jobs are left, workers only leave once the count of jobs not yet taken reaches zero
+ */
+typedef struct batch_worker_t
+{
+	struct batch_t * batch;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	size_t next;
+	size_t end;
+} batch_worker_t;
+
+typedef struct batch_t
+{
+	batch_job_t * jobs;
+	size_t job_count;
+	batch_worker_t * workers;
+	unsigned worker_count;
+	size_t untaken_count; // jobs not yet taken by a worker, accessed atomically
+
+	// shared by all jobs
+	const environment_t * defaults;
+	arm_part_number_t part_number;
+	bool jit;
+	uint64_t instruction_limit; // 0 for no limit
+	unsigned repeat_count; // number of times each job is run, restarting from a snapshot taken after loading it
+	char ** envp;
+} batch_t;
+
+static double batch_elapsed(const struct timespec * start, const struct timespec * end)
+{
+	return (end->tv_sec - start->tv_sec) + (end->tv_nsec - start->tv_nsec) * 1e-9;
+}
+
+static bool batch_read_manifest(batch_t * batch, const char * manifest_name)
+{
+	FILE * manifest_file = fopen(manifest_name, "r");
+	if(manifest_file == NULL)
+	{
+		fprintf(stderr, "Fatal error: unable to open manifest %s, leaving\n", manifest_name);
+		return false;
+	}
+
+	char * line = NULL;
+	size_t line_size = 0;
+	ssize_t length;
+	size_t line_number = 0;
+	while((length = getline(&line, &line_size, manifest_file)) >= 0)
+	{
+		line_number++;
+		while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r'))
+			line[--length] = '\0';
+		if(length == 0 || line[0] == '#')
+			continue;
+
+		batch_job_t job;
+		memset(&job, 0, sizeof job);
+
+		char * fields = line;
+		job.binary = strdup(strsep(&fields, "\t"));
+		char * input_name = fields != NULL ? strsep(&fields, "\t") : "-";
+		char * expected_name = fields != NULL ? strsep(&fields, "\t") : "-";
+		if(job.binary[0] == '\0')
+		{
+			fprintf(stderr, "Fatal error: no binary given in line %zu of manifest %s, leaving\n", line_number, manifest_name);
+			exit(1);
+		}
+		job.input_name = strcmp(input_name, "-") == 0 ? NULL : strdup(input_name);
+		job.expected_name = strcmp(expected_name, "-") == 0 ? NULL : strdup(expected_name);
+
+		// the binary is argv[0], followed by the remaining fields
+		job.argv = malloc(sizeof(char *) * 2);
+		job.argv[job.argc++] = job.binary;
+		while(fields != NULL)
+		{
+			job.argv = realloc(job.argv, sizeof(char *) * (job.argc + 2));
+			job.argv[job.argc++] = strdup(strsep(&fields, "\t"));
+		}
+		job.argv[job.argc] = NULL;
+
+		batch->jobs = realloc(batch->jobs, sizeof(batch_job_t) * (batch->job_count + 1));
+		batch->jobs[batch->job_count++] = job;
+	}
+
+	free(line);
+	fclose(manifest_file);
+	return true;
+}
+
+static bool batch_compare_output(FILE * output_file, const char * expected_name)
+{
+	FILE * expected_file = fopen(expected_name, "rb");
+	if(expected_file == NULL)
+		return false;
+
+	rewind(output_file);
+
+	bool equal = true;
+	char output[4096];
+	char expected[4096];
+	for(;;)
+	{
+		size_t output_count = fread(output, 1, sizeof output, output_file);
+		size_t expected_count = fread(expected, 1, sizeof expected, expected_file);
+		if(output_count != expected_count || memcmp(output, expected, output_count) != 0)
+		{
+			equal = false;
+			break;
+		}
+		if(output_count == 0)
+			break;
+	}
+
+	fclose(expected_file);
+	return equal;
+}
+
+// the messages of the emulator are collected on a single line
+static char * batch_format_message(char * message, size_t size)
+{
+	while(size > 0 && message[size - 1] == '\n')
+		message[--size] = '\0';
+	for(size_t i = 0; i < size; i++)
+	{
+		if(message[i] == '\n' || message[i] == '\t')
+			message[i] = ' ';
+	}
+	return message;
+}
+
+// only returns through the exit point of the job
+static _Noreturn void batch_run_cpu(batch_t * batch, arm_state_t * cpu, environment_t * env)
+{
+	for(;;)
+	{
+		uint64_t max_instructions = UINT64_MAX;
+		if(batch->instruction_limit != 0)
+		{
+			if(cpu->instruction_count >= batch->instruction_limit)
+			{
+				fprintf(env->message_file, "Stopped after the limit of %"PRIu64" instructions\n", batch->instruction_limit);
+				exit_emulation(env, 1);
+			}
+			max_instructions = batch->instruction_limit - cpu->instruction_count;
+		}
+		handle_result(cpu, env, arm_run(cpu, max_instructions, NULL));
+	}
+}
+
+static void batch_run_job(batch_t * batch, batch_job_t * job)
+{
+	environment_t env[1];
+	*env = *batch->defaults;
+	env->purpose = PURPOSE_LOAD;
+	env->memory = memory_init();
+	env->memory_interface = memory_get_interface(env->memory);
+
+	char * message = NULL;
+	size_t message_size = 0;
+	env->message_file = open_memstream(&message, &message_size);
+
+	int input_fd = open(job->input_name != NULL ? job->input_name : "/dev/null", O_RDONLY);
+	FILE * output_file = tmpfile();
+	arm_state_t * cpu = malloc(sizeof(arm_state_t));
+	FILE * volatile binary_file = NULL;
+
+	arm_snapshot_t * volatile snapshot = NULL;
+	jmp_buf exit_point;
+	env->exit_point = &exit_point;
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if(setjmp(exit_point) == 0)
+	{
+		if(input_fd == -1)
+		{
+			fprintf(env->message_file, "Unable to open input file %s\n", job->input_name);
+			exit_emulation(env, 1);
+		}
+
+		if(output_file == NULL)
+		{
+			fprintf(env->message_file, "Unable to create output file\n");
+			exit_emulation(env, 1);
+		}
+
+		env->std_fds[0] = input_fd;
+		env->std_fds[1] = fileno(output_file);
+
+		binary_file = fopen(job->binary, "rb");
+		if(binary_file == NULL)
+		{
+			fprintf(env->message_file, "Unable to open file %s\n", job->binary);
+			exit_emulation(env, 1);
+		}
+
+		char signature[4];
+		if(fread(signature, 4, 1, binary_file) != 1)
+			memset(signature, 0, 4);
+
+		if(memcmp(signature, "\x7F" "ELF", 4) == 0)
+		{
+			read_elf_file(binary_file, env);
+		}
+		else if(memcmp(signature, "\xCA\xFE\xBA\xBE", 4) == 0)
+		{
+			read_class_file(binary_file, env);
+		}
+		else
+		{
+			fprintf(env->message_file, "Not an ELF or Java class file\n");
+			exit_emulation(env, 1);
+		}
+
+		fclose(binary_file);
+		binary_file = NULL;
+
+		setup_cpu(cpu, env, batch->part_number, true);
+		job->loaded = true;
+		setup_initial_state(cpu, env, job->argc, job->argv, batch->envp);
+		cpu->capture_breaks = true;
+
+		if(batch->jit)
+			arm_jit_enable(cpu);
+
+		if(batch->repeat_count > 1)
+			snapshot = arm_snapshot_take(cpu);
+
+		batch_run_cpu(batch, cpu, env);
+	}
+
+	// every further run starts from the state right after loading, with the input rewound and the output discarded
+	for(unsigned run = 1; snapshot != NULL && run < batch->repeat_count; run++)
+	{
+		fflush(env->message_file);
+		if(message_size != 0 || env->exit_status != 0)
+			break;
+
+		job->instruction_count += cpu->instruction_count;
+		arm_snapshot_restore(snapshot, cpu);
+		// the exit of the previous run counted as the end of its last thread
+		env->thread_count = 0;
+		lseek(input_fd, 0, SEEK_SET);
+		if(ftruncate(fileno(output_file), 0) != 0)
+		{
+			fprintf(env->message_file, "Unable to discard the output of the previous run\n");
+			break;
+		}
+		lseek(fileno(output_file), 0, SEEK_SET);
+
+		if(setjmp(exit_point) == 0)
+			batch_run_cpu(batch, cpu, env);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	job->wall_time = batch_elapsed(&start, &end);
+	job->exit_status = env->exit_status;
+
+	if(snapshot != NULL)
+		arm_snapshot_free(snapshot);
+
+	if(job->loaded)
+	{
+		job->instruction_count += cpu->instruction_count;
+		arm_emu_free(cpu);
+	}
+	free(cpu);
+
+	if(binary_file != NULL)
+		fclose(binary_file);
+
+	fclose(env->message_file);
+	if(message_size != 0)
+	{
+		// the program stopped on an exception or could not be loaded
+		job->message = batch_format_message(message, message_size);
+	}
+	else
+	{
+		free(message);
+		if(!job->loaded)
+			job->message = strdup("Unable to load file");
+		else if(job->exit_status != 0)
+		{
+			job->message = malloc(32);
+			snprintf(job->message, 32, "Exited with status %d", job->exit_status);
+		}
+		else if(job->expected_name != NULL && !batch_compare_output(output_file, job->expected_name))
+			job->message = strdup("Output differs from the expected output");
+	}
+	job->passed = job->message == NULL;
+
+	if(output_file != NULL)
+		fclose(output_file);
+	if(input_fd != -1)
+		close(input_fd);
+
+	free_class_file(env);
+	memory_free(env->memory);
+}
+
+static bool batch_take_job(batch_worker_t * worker, size_t * index)
+{
+	pthread_mutex_lock(&worker->lock);
+	bool found = worker->next < worker->end;
+	if(found)
+		*index = worker->next++;
+	pthread_mutex_unlock(&worker->lock);
+	if(found)
+		__atomic_sub_fetch(&worker->batch->untaken_count, 1, __ATOMIC_SEQ_CST);
+	return found;
+}
+
+static bool batch_steal_jobs(batch_worker_t * worker)
+{
+	batch_t * batch = worker->batch;
+	unsigned self = worker - batch->workers;
+	for(unsigned offset = 1; offset < batch->worker_count; offset++)
+	{
+		batch_worker_t * victim = &batch->workers[(self + offset) % batch->worker_count];
+
+		pthread_mutex_lock(&victim->lock);
+		size_t remaining = victim->end - victim->next;
+		size_t middle = victim->end - (remaining + 1) / 2;
+		size_t end = victim->end;
+		victim->end = middle;
+		pthread_mutex_unlock(&victim->lock);
+
+		if(remaining == 0)
+			continue;
+
+		pthread_mutex_lock(&worker->lock);
+		worker->next = middle;
+		worker->end = end;
+		pthread_mutex_unlock(&worker->lock);
+		return true;
+	}
+	return false;
+}
+
+static void * batch_run_worker(void * data)
+{
+	batch_worker_t * worker = data;
+	for(;;)
+	{
+		size_t index;
+		if(batch_take_job(worker, &index))
+		{
+			batch_run_job(worker->batch, &worker->batch->jobs[index]);
+		}
+		else if(!batch_steal_jobs(worker))
+		{
+			if(__atomic_load_n(&worker->batch->untaken_count, __ATOMIC_SEQ_CST) == 0)
+				break;
+			// another worker is still publishing the range it stole
+			sched_yield();
+		}
+	}
+	return NULL;
+}
+
+int run_batch(const char * manifest_name, unsigned thread_count, const environment_t * defaults, arm_part_number_t part_number, bool jit, uint64_t instruction_limit, unsigned repeat_count, char ** envp)
+{
+	batch_t batch[1];
+	memset(batch, 0, sizeof(batch_t));
+	batch->defaults = defaults;
+	batch->part_number = part_number;
+	batch->jit = jit;
+	batch->instruction_limit = instruction_limit;
+	batch->repeat_count = repeat_count;
+	batch->envp = envp;
+
+	if(!batch_read_manifest(batch, manifest_name))
+		return 1;
+	batch->untaken_count = batch->job_count;
+
+	batch->worker_count = batch->job_count < thread_count ? batch->job_count : thread_count;
+	if(batch->worker_count == 0)
+		batch->worker_count = 1;
+	batch->workers = malloc(sizeof(batch_worker_t) * batch->worker_count);
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for(unsigned i = 0; i < batch->worker_count; i++)
+	{
+		batch_worker_t * worker = &batch->workers[i];
+		worker->batch = batch;
+		pthread_mutex_init(&worker->lock, NULL);
+		worker->next = batch->job_count * i / batch->worker_count;
+		worker->end = batch->job_count * (i + 1) / batch->worker_count;
+	}
+
+	for(unsigned i = 0; i < batch->worker_count; i++)
+	{
+		if(pthread_create(&batch->workers[i].thread, NULL, batch_run_worker, &batch->workers[i]) != 0)
+		{
+			fprintf(stderr, "Fatal error: unable to start worker thread %u, leaving\n", i);
+			exit(1);
+		}
+	}
+
+	for(unsigned i = 0; i < batch->worker_count; i++)
+	{
+		pthread_join(batch->workers[i].thread, NULL);
+		pthread_mutex_destroy(&batch->workers[i].lock);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	size_t passed_count = 0;
+	uint64_t instruction_count = 0;
+	double job_time = 0;
+
+	printf("# result\tstatus\tinstructions\tseconds\tbinary\tmessage\n");
+	for(size_t i = 0; i < batch->job_count; i++)
+	{
+		batch_job_t * job = &batch->jobs[i];
+		printf("%s\t%d\t%"PRIu64"\t%.6f\t%s\t%s\n",
+			job->passed ? "PASS" : "FAIL", job->exit_status, job->instruction_count, job->wall_time, job->binary, job->message != NULL ? job->message : "");
+
+		if(job->passed)
+			passed_count++;
+		instruction_count += job->instruction_count;
+		job_time += job->wall_time;
+
+		for(int j = 0; j < job->argc; j++)
+			free(job->argv[j]);
+		free(job->argv);
+		free(job->input_name);
+		free(job->expected_name);
+		free(job->message);
+	}
+
+	printf("# jobs: %zu, passed: %zu, failed: %zu, instructions: %"PRIu64", wall time: %.6f s, time in jobs: %.6f s, threads: %u\n",
+		batch->job_count, passed_count, batch->job_count - passed_count, instruction_count, batch_elapsed(&start, &end), job_time, batch->worker_count);
+
+	free(batch->jobs);
+	free(batch->workers);
+
+	return passed_count == batch->job_count ? 0 : 1;
+}
+
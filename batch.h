@@ -0,0 +1,20 @@
+#ifndef _BATCH_H
+#define _BATCH_H
+
+/* Running many programs in a single emulator process */
+
+#include <stdbool.h>
+#include "emu.h"
+#include "main.h"
+
+/* Runs every job listed in the manifest on a pool of worker threads and prints a summary
+ * Each line of the manifest describes a job as tab separated fields:
+ * binary, file for the standard input, file with the expected standard output, then the arguments after argv[0]
+ * A - in place of a file name means no input or no checking of the output, empty lines and lines starting with # are ignored
+ * A job fails if it stops on an exception, exits with a nonzero status, its output differs or it executes more than instruction_limit instructions (unless 0)
+ * Each job is run repeat_count times, every run after the first restores a snapshot taken after loading, only the output of the last run is checked
+ * The defaults are copied into the environment of every job, returns the exit status of the emulator
+ */
+extern int run_batch(const char * manifest_name, unsigned thread_count, const environment_t * defaults, arm_part_number_t part_number, bool jit, uint64_t instruction_limit, unsigned repeat_count, char ** envp);
+
+#endif // _BATCH_H
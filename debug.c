@@ -73,6 +73,8 @@ static inline uint32_t j32_get_stack_value(arm_state_t * cpu, uint8_t index)
 
 void arm_get_debug_state(arm_debug_state_t * debug_state, arm_state_t * cpu)
 {
+	arm_evaluate_flags(cpu);
+
 	switch(cpu->pstate.rw)
 	{
 	case PSTATE_RW_26:
@@ -339,23 +341,23 @@ static void a32_debug(FILE * file, arm_state_t * cpu, arm_debug_change_t * chang
 	{
 		if((cpu->pstate.it & 0xF) != 0)
 		{
-			printf(", IT: ");
+			fprintf(file, ", IT: ");
 			int cond = (cpu->pstate.it & 0xF0) >> 4;
 			int mask = cpu->pstate.it & 0x0F;
 			if(change && change->pstate.it)
 				fprintf(file, "%s", ANSI_BOLD);
-			printf("%s", a32_condition[cond]);
+			fprintf(file, "%s", a32_condition[cond]);
 			while((mask & 0x7) != 0)
 			{
 				cond = (cond & ~1) | (mask >> 3);
 				mask = (mask << 1) & 0x0F;
-				printf(", %s", a32_condition[cond]);
+				fprintf(file, ", %s", a32_condition[cond]);
 			}
 			if(change && change->pstate.it)
 				fprintf(file, "%s", ANSI_RESET);
 		}
 	}
-	printf("\n");
+	fprintf(file, "\n");
 }
 
 static inline bool j32_stack_value_changed(arm_state_t * cpu, uint8_t index, arm_debug_change_t * change)
@@ -547,6 +549,8 @@ void debug(FILE * file, arm_state_t * cpu, arm_debug_state_t * old_state)
 	arm_debug_change_t change;
 	arm_debug_state_t new_state[1];
 
+	arm_evaluate_flags(cpu);
+
 	if(old_state)
 	{
 		arm_get_debug_state(new_state, cpu);
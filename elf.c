@@ -2,22 +2,25 @@
 /* Handling ELF binaries and emulating a very simple Linux environment */
 
 #include <assert.h>
+#include <byteswap.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <semaphore.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
 #include "elf.h"
 #include "emu.h"
 #include "dis.h"
 #include "jazelle.h"
 #include "jvm.h"
 
-enum ei_class_t ei_class;
-enum ei_data_t ei_data;
-
-uint16_t fread16(FILE * file)
+uint16_t fread16(const environment_t * env, FILE * file)
 {
-	switch(ei_data)
+	switch(env->elf_data)
 	{
 	case ELFDATA2LSB:
 		return fread16le(file);
@@ -28,9 +31,9 @@ uint16_t fread16(FILE * file)
 	}
 }
 
-uint32_t fread32(FILE * file)
+uint32_t fread32(const environment_t * env, FILE * file)
 {
-	switch(ei_data)
+	switch(env->elf_data)
 	{
 	case ELFDATA2LSB:
 		return fread32le(file);
@@ -41,9 +44,9 @@ uint32_t fread32(FILE * file)
 	}
 }
 
-uint64_t fread64(FILE * file)
+uint64_t fread64(const environment_t * env, FILE * file)
 {
-	switch(ei_data)
+	switch(env->elf_data)
 	{
 	case ELFDATA2LSB:
 		return fread64le(file);
@@ -54,14 +57,14 @@ uint64_t fread64(FILE * file)
 	}
 }
 
-uint64_t freadword(FILE * file)
+uint64_t freadword(const environment_t * env, FILE * file)
 {
-	switch(ei_class)
+	switch(env->elf_class)
 	{
 	case ELFCLASS32:
-		return fread32(file);
+		return fread32(env, file);
 	case ELFCLASS64:
-		return fread64(file);
+		return fread64(env, file);
 	default:
 		assert(false);
 	}
@@ -275,9 +278,9 @@ void setup_initial_state(arm_state_t * cpu, environment_t * env, int argc, char
 
 void read_elf_file(FILE * input_file, environment_t * env)
 {
-	ei_class = fgetc(input_file);
+	env->elf_class = fgetc(input_file);
 
-	switch(ei_class)
+	switch(env->elf_class)
 	{
 	case ELFCLASS32:
 		// 32-bit
@@ -287,12 +290,12 @@ void read_elf_file(FILE * input_file, environment_t * env)
 		break;
 	default:
 		fprintf(stderr, "Invalid ELF class\n");
-		exit(1);
+		exit_emulation(env, 1);
 	}
 
-	ei_data = fgetc(input_file);
+	env->elf_data = fgetc(input_file);
 
-	switch(ei_data)
+	switch(env->elf_data)
 	{
 	case ELFDATA2LSB:
 		// little endian
@@ -302,26 +305,26 @@ void read_elf_file(FILE * input_file, environment_t * env)
 		break;
 	default:
 		fprintf(stderr, "Invalid ELF data format\n");
-		exit(1);
+		exit_emulation(env, 1);
 	}
 
 	if(fgetc(input_file) != EV_CURRENT)
 	{
 		fprintf(stderr, "Invalid ELF header version\n");
-		exit(1);
+		exit_emulation(env, 1);
 	}
 
 	fseek(input_file, 0x10L, SEEK_SET);
 
-	uint16_t type = fread16(input_file);
+	uint16_t type = fread16(env, input_file);
 
 	if(type != 2)
 	{
 		fprintf(stderr, "Not executable\n");
-		exit(1);
+		exit_emulation(env, 1);
 	}
 
-	enum e_machine_t e_machine = fread16(input_file);
+	enum e_machine_t e_machine = fread16(env, input_file);
 	bool force32bit = false;
 
 	switch(e_machine)
@@ -339,26 +342,26 @@ void read_elf_file(FILE * input_file, environment_t * env)
 		break;
 	default:
 		fprintf(stderr, "Invalid machine type\n");
-		exit(1);
+		exit_emulation(env, 1);
 	}
 
-	if(fread32(input_file) != EV_CURRENT)
+	if(fread32(env, input_file) != EV_CURRENT)
 	{
 		fprintf(stderr, "Invalid object version\n");
-		exit(1);
+		exit_emulation(env, 1);
 	}
 
-	env->entry = freadword(input_file);
-	env->stack = ei_class == ELFCLASS32 ? 0x40800000 : 0x000040000080000;
+	env->entry = freadword(env, input_file);
+	env->stack = env->elf_class == ELFCLASS32 ? 0x40800000 : 0x000040000080000;
 
-	uint64_t phoff = freadword(input_file);
-	uint64_t shoff = freadword(input_file);
+	uint64_t phoff = freadword(env, input_file);
+	uint64_t shoff = freadword(env, input_file);
 
-	uint32_t flags = fread32(input_file);
+	uint32_t flags = fread32(env, input_file);
 
 	if(env->isa == ISA_UNKNOWN)
 	{
-		if(ei_class == ELFCLASS64)
+		if(env->elf_class == ELFCLASS64)
 		{
 			env->isa = ISA_AARCH64;
 		}
@@ -396,7 +399,7 @@ void read_elf_file(FILE * input_file, environment_t * env)
 	}
 
 	// for big endian 32-bit executables, we have to check the flags to make sure what type the executable is
-	if(ei_data == ELFDATA2MSB)
+	if(env->elf_data == ELFDATA2MSB)
 	{
 		if(e_machine == EM_ARM && (flags & EF_ARM_BE8) == 0)
 		{
@@ -426,10 +429,10 @@ void read_elf_file(FILE * input_file, environment_t * env)
 
 	fseek(input_file, 2L, SEEK_CUR);
 
-	uint16_t phentsize = fread16(input_file);
-	uint16_t phnum = fread16(input_file);
-	uint16_t shentsize = fread16(input_file);
-	uint16_t shnum = fread16(input_file);
+	uint16_t phentsize = fread16(env, input_file);
+	uint16_t phnum = fread16(env, input_file);
+	uint16_t shentsize = fread16(env, input_file);
+	uint16_t shnum = fread16(env, input_file);
 
 	// if the instruction set is unknown/changes throughout the code (32-bit and not specified at launch time), we need to collect them
 	bool follow_mapping_symbols = env->isa == ISA_UNKNOWN;
@@ -446,12 +449,12 @@ void read_elf_file(FILE * input_file, environment_t * env)
 	for(uint16_t i = 0; i < shnum; i++)
 	{
 		fseek(input_file, shoff + i * shentsize + 4, SEEK_SET);
-		uint32_t type = fread32(input_file);
+		uint32_t type = fread32(env, input_file);
 		if(type == SHT_ARM_ATTRIBUTES)
 		{
-			fseek(input_file, ei_class == ELFCLASS32 ? 8 : 16, SEEK_CUR);
-			uint64_t section_offset = freadword(input_file);
-			uint64_t section_end = section_offset + freadword(input_file);
+			fseek(input_file, env->elf_class == ELFCLASS32 ? 8 : 16, SEEK_CUR);
+			uint64_t section_offset = freadword(env, input_file);
+			uint64_t section_end = section_offset + freadword(env, input_file);
 			fseek(input_file, section_offset, SEEK_SET);
 
 			if(fgetc(input_file) != 'A')
@@ -460,7 +463,7 @@ void read_elf_file(FILE * input_file, environment_t * env)
 			while(ftell(input_file) < section_end)
 			{
 				uint64_t section_start = ftell(input_file);
-				uint32_t section_length = fread32(input_file);
+				uint32_t section_length = fread32(env, input_file);
 				if(
 					fgetc(input_file) == 'a'
 					&& fgetc(input_file) == 'e'
@@ -473,7 +476,7 @@ void read_elf_file(FILE * input_file, environment_t * env)
 					{
 						uint64_t tag_start = ftell(input_file);
 						uint8_t tag_type = fgetc(input_file);
-						uint32_t tag_size = fread32(input_file);
+						uint32_t tag_size = fread32(env, input_file);
 						switch(tag_type)
 						{
 						case 1:
@@ -1358,23 +1361,23 @@ void read_elf_file(FILE * input_file, environment_t * env)
 		for(uint16_t i = 0; i < shnum; i++)
 		{
 			fseek(input_file, shoff + i * shentsize + 4, SEEK_SET);
-			uint32_t type = fread32(input_file);
+			uint32_t type = fread32(env, input_file);
 			if(type == SHT_SYMTAB)
 			{
-				fseek(input_file, ei_class == ELFCLASS32 ? 8 : 16, SEEK_CUR);
-				uint64_t offset = freadword(input_file);
-				uint64_t size = freadword(input_file);
-				uint32_t link = fread32(input_file);
-				fseek(input_file, ei_class == ELFCLASS32 ? 8 : 12, SEEK_CUR);
-				uint64_t entsize = freadword(input_file);
+				fseek(input_file, env->elf_class == ELFCLASS32 ? 8 : 16, SEEK_CUR);
+				uint64_t offset = freadword(env, input_file);
+				uint64_t size = freadword(env, input_file);
+				uint32_t link = fread32(env, input_file);
+				fseek(input_file, env->elf_class == ELFCLASS32 ? 8 : 12, SEEK_CUR);
+				uint64_t entsize = freadword(env, input_file);
 
-				fseek(input_file, shoff + link * shentsize + (ei_class == ELFCLASS32 ? 16 : 24), SEEK_SET);
-				uint64_t strtab_offset = freadword(input_file);
+				fseek(input_file, shoff + link * shentsize + (env->elf_class == ELFCLASS32 ? 16 : 24), SEEK_SET);
+				uint64_t strtab_offset = freadword(env, input_file);
 
 				for(uint64_t stoff = 0; stoff < size; stoff += entsize)
 				{
 					fseek(input_file, offset + stoff, SEEK_SET);
-					uint32_t name = fread32(input_file);
+					uint32_t name = fread32(env, input_file);
 					fseek(input_file, strtab_offset + name, SEEK_SET);
 					if(fgetc(input_file) == '$')
 					{
@@ -1409,26 +1412,26 @@ void read_elf_file(FILE * input_file, environment_t * env)
 		for(uint16_t i = 0; i < shnum; i++)
 		{
 			fseek(input_file, shoff + i * shentsize + 4, SEEK_SET);
-			uint32_t type = fread32(input_file);
+			uint32_t type = fread32(env, input_file);
 			if(type == SHT_SYMTAB)
 			{
-				fseek(input_file, ei_class == ELFCLASS32 ? 8 : 16, SEEK_CUR);
-				uint64_t offset = freadword(input_file);
-				uint64_t size = freadword(input_file);
-				uint32_t link = fread32(input_file);
-				fseek(input_file, ei_class == ELFCLASS32 ? 8 : 12, SEEK_CUR);
-				uint64_t entsize = freadword(input_file);
+				fseek(input_file, env->elf_class == ELFCLASS32 ? 8 : 16, SEEK_CUR);
+				uint64_t offset = freadword(env, input_file);
+				uint64_t size = freadword(env, input_file);
+				uint32_t link = fread32(env, input_file);
+				fseek(input_file, env->elf_class == ELFCLASS32 ? 8 : 12, SEEK_CUR);
+				uint64_t entsize = freadword(env, input_file);
 
-				fseek(input_file, shoff + link * shentsize + (ei_class == ELFCLASS32 ? 16 : 24), SEEK_SET);
-				uint64_t strtab_offset = freadword(input_file);
+				fseek(input_file, shoff + link * shentsize + (env->elf_class == ELFCLASS32 ? 16 : 24), SEEK_SET);
+				uint64_t strtab_offset = freadword(env, input_file);
 
 				for(uint64_t stoff = 0; stoff < size; stoff += entsize)
 				{
 					fseek(input_file, offset + stoff, SEEK_SET);
-					uint32_t name = fread32(input_file);
-					if(ei_class == ELFCLASS64)
+					uint32_t name = fread32(env, input_file);
+					if(env->elf_class == ELFCLASS64)
 						fseek(input_file, 4, SEEK_CUR);
-					uint64_t address = freadword(input_file);
+					uint64_t address = freadword(env, input_file);
 					fseek(input_file, strtab_offset + name, SEEK_SET);
 					if(fgetc(input_file) == '$')
 					{
@@ -1491,18 +1494,19 @@ void read_elf_file(FILE * input_file, environment_t * env)
 	for(uint16_t i = 0; i < phnum; i++)
 	{
 		fseek(input_file, phoff + i * phentsize, SEEK_SET);
-		uint32_t type = fread32(input_file);
+		uint32_t type = fread32(env, input_file);
 		if(type == PT_LOAD)
 		{
-			if(ei_class == ELFCLASS64)
+			if(env->elf_class == ELFCLASS64)
 				fseek(input_file, 4, SEEK_CUR); // skip flags
 
-			uint64_t offset = freadword(input_file);
-			uint64_t v_address = freadword(input_file);
+			uint64_t offset = freadword(env, input_file);
+			uint64_t v_address = freadword(env, input_file);
 
-			fseek(input_file, ei_class == ELFCLASS32 ? 4 : 8, SEEK_CUR); // skip p_address
+			fseek(input_file, env->elf_class == ELFCLASS32 ? 4 : 8, SEEK_CUR); // skip p_address
 
-			uint64_t filesize = freadword(input_file);
+			uint64_t filesize = freadword(env, input_file);
+			uint64_t memsize = freadword(env, input_file);
 
 			fseek(input_file, offset, SEEK_SET);
 
@@ -1553,166 +1557,479 @@ void read_elf_file(FILE * input_file, environment_t * env)
 			}
 			else
 			{
-				// load binary into memory
+				// load binary into memory, the rest of the segment is zero filled
 
-				uint64_t offset;
+				memory_load_file(env->memory, input_file, v_address, filesize, env->endian == ARM_ENDIAN_SWAPPED);
+				if(memsize > filesize)
+					memory_load_file(env->memory, NULL, v_address + filesize, memsize - filesize, env->endian == ARM_ENDIAN_SWAPPED);
+			}
+		}
+	}
+}
 
-				for(offset = 0; offset < filesize; offset++)
-				{
-					uint64_t address = v_address + offset;
+#define LINUX_IOVEC_MAX 64
 
-					char c = fgetc(input_file);
+// the standard streams of the program can be redirected to other host files
+static inline int linux_host_fd(environment_t * env, int fd)
+{
+	return fd >= 0 && fd < 3 ? env->std_fds[fd] : fd;
+}
 
-					arm_memory_write8(env->memory_interface, address, c, env->endian == ARM_ENDIAN_SWAPPED ? ARM_ENDIAN_SWAPPED : ARM_ENDIAN_LITTLE);
-				}
-			}
-		}
+// reads from a file directly into guest memory, if possible without an intermediate buffer
+static ssize_t linux_read(arm_state_t * cpu, environment_t * env, int fd, uint64_t address, size_t count, bool swapped)
+{
+	memory_t * memory = cpu->memory->data;
+	ssize_t result;
+	struct iovec iov[LINUX_IOVEC_MAX];
+	int iovcnt;
+
+	fd = linux_host_fd(env, fd);
+
+	if(!swapped && (iovcnt = memory_acquire_iovec(memory, address, count, true, iov, LINUX_IOVEC_MAX)) != 0)
+	{
+		result = readv(fd, iov, iovcnt);
+		memory_synchronize_iovec(memory, address, count);
 	}
+	else if(!swapped)
+	{
+		void * buffer = memory_acquire_block(memory, address, count);
+		result = read(fd, buffer, count);
+		memory_synchronize_block(memory, address, count, buffer);
+		memory_release_block(memory, address, count, buffer);
+	}
+	else
+	{
+		void * buffer = memory_acquire_block_reversed(memory, address, count);
+		result = read(fd, buffer, count);
+		memory_synchronize_block_reversed(memory, address, count, buffer);
+		memory_release_block_reversed(memory, address, count, buffer);
+	}
+	arm_decode_cache_invalidate(cpu, address, count);
+	return result;
 }
 
-bool a32_linux_oabi_syscall(arm_state_t * cpu, uint32_t swi_number)
+// writes guest memory to a file, if possible without an intermediate buffer
+static ssize_t linux_write(arm_state_t * cpu, environment_t * env, int fd, uint64_t address, size_t count, bool swapped)
 {
-	switch(swi_number)
+	memory_t * memory = cpu->memory->data;
+	ssize_t result;
+	struct iovec iov[LINUX_IOVEC_MAX];
+	int iovcnt;
+
+	fd = linux_host_fd(env, fd);
+
+	if(!swapped && (iovcnt = memory_acquire_iovec(memory, address, count, false, iov, LINUX_IOVEC_MAX)) != 0)
 	{
-	case A32_OABI_SYS_BASE + A32_SYS_EXIT:
-		exit(cpu->r[0]);
-		return true;
-	case A32_OABI_SYS_BASE + A32_SYS_READ:
+		result = writev(fd, iov, iovcnt);
+	}
+	else if(!swapped)
+	{
+		void * buffer = memory_acquire_block(memory, address, count);
+		result = write(fd, buffer, count);
+		memory_release_block(memory, address, count, buffer);
+	}
+	else
+	{
+		void * buffer = memory_acquire_block_reversed(memory, address, count);
+		result = write(fd, buffer, count);
+		memory_release_block_reversed(memory, address, count, buffer);
+	}
+	return result;
+}
+
+/* Threads
+ * Each guest thread created by clone gets its own CPU, running on its own host thread, and guest thread IDs are the host ones
+ * Only the thread flavour of clone is supported, new processes cannot be created
+ */
+
+#ifndef CLONE_VM
+# define CLONE_VM             0x00000100
+# define CLONE_THREAD         0x00010000
+# define CLONE_SETTLS         0x00080000
+# define CLONE_PARENT_SETTID  0x00100000
+# define CLONE_CHILD_CLEARTID 0x00200000
+# define CLONE_CHILD_SETTID   0x01000000
+#endif
+
+// state of the guest thread running on the current host thread
+static __thread struct
+{
+	// cleared and woken up when the thread exits, set by set_tid_address and CLONE_CHILD_CLEARTID
+	uint64_t clear_child_tid;
+	// the CPU was allocated by clone and must be released on exit
+	bool cloned;
+} linux_thread;
+
+typedef struct linux_clone_t
+{
+	uint64_t flags;
+	uint64_t parent_tid;
+	uint64_t child_tid;
+	pid_t tid;
+	sem_t started;
+} linux_clone_t;
+
+static pid_t linux_gettid(void)
+{
+	return syscall(SYS_gettid);
+}
+
+// returns the host address of a guest word, so that host futexes can wait on it
+static uint32_t * linux_futex_word(arm_state_t * cpu, uint64_t address)
+{
+	struct iovec iov[1];
+	// the page must be allocated, otherwise the waiter could end up on a shared zero page
+	if((address & 3) != 0 || memory_acquire_iovec(cpu->memory->data, address, 4, true, iov, 1) != 1)
+		return NULL;
+	return iov[0].iov_base;
+}
+
+// the host compares and modifies futex words in host byte order, these are stored in the byte order of the guest
+static uint32_t linux_futex_value(arm_state_t * cpu, uint32_t value)
+{
+	arm_endianness_t endian = arm_get_current_instruction_set(cpu) == ISA_AARCH64 ? a64_get_data_endianness(cpu) : a32_get_data_endianness(cpu);
+	return endian == ARM_ENDIAN_BIG ? bswap_32(value) : value;
+}
+
+// FUTEX_WAKE_OP, the host would operate on the second word in host byte order, so the emulator does it and then wakes up the threads
+static int64_t linux_futex_wake_op(arm_state_t * cpu, uint64_t address2, uint32_t * word, uint32_t * word2, int flags, uint32_t count, uint32_t count2, uint32_t encoded_op)
+{
+	int operation = (encoded_op >> 28) & 7;
+	int comparison = (encoded_op >> 24) & 15;
+	int32_t operand = (int32_t)(encoded_op << 8) >> 20;
+	int32_t compared = (int32_t)(encoded_op << 20) >> 20;
+	if(((encoded_op >> 28) & FUTEX_OP_OPARG_SHIFT) != 0)
+		operand = (int32_t)1 << (operand & 31);
+	if(operation > FUTEX_OP_XOR || comparison > FUTEX_OP_CMP_GE)
+		return -ENOSYS;
+
+	uint32_t current = __atomic_load_n(word2, __ATOMIC_SEQ_CST);
+	int32_t old_value, new_value;
+	do
+	{
+		old_value = linux_futex_value(cpu, current);
+		switch(operation)
 		{
-			uint64_t address = cpu->r[1];
-			uint64_t count = cpu->r[2];
-			void * buffer;
+		case FUTEX_OP_SET:
+			new_value = operand;
+			break;
+		case FUTEX_OP_ADD:
+			new_value = (uint32_t)old_value + (uint32_t)operand;
+			break;
+		case FUTEX_OP_OR:
+			new_value = old_value | operand;
+			break;
+		case FUTEX_OP_ANDN:
+			new_value = old_value & ~operand;
+			break;
+		case FUTEX_OP_XOR:
+		default:
+			new_value = old_value ^ operand;
+			break;
+		}
+	} while(!__atomic_compare_exchange_n(word2, &current, linux_futex_value(cpu, new_value), false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+	memory_synchronize_iovec(cpu->memory->data, address2, 4);
+	arm_decode_cache_invalidate(cpu, address2, 4);
 
-			if(a32_get_data_endianness(cpu) != ARM_ENDIAN_SWAPPED)
-				buffer = memory_acquire_block(address, count);
-			else
-				buffer = memory_acquire_block_reversed(address, count);
+	bool wake2;
+	switch(comparison)
+	{
+	case FUTEX_OP_CMP_EQ:
+		wake2 = old_value == compared;
+		break;
+	case FUTEX_OP_CMP_NE:
+		wake2 = old_value != compared;
+		break;
+	case FUTEX_OP_CMP_LT:
+		wake2 = old_value < compared;
+		break;
+	case FUTEX_OP_CMP_LE:
+		wake2 = old_value <= compared;
+		break;
+	case FUTEX_OP_CMP_GT:
+		wake2 = old_value > compared;
+		break;
+	case FUTEX_OP_CMP_GE:
+	default:
+		wake2 = old_value >= compared;
+		break;
+	}
 
-			cpu->r[0] = read(cpu->r[0], buffer, count);
+	long result = syscall(SYS_futex, word, FUTEX_WAKE | flags, count, NULL, NULL, 0);
+	if(result >= 0 && wake2)
+	{
+		long result2 = syscall(SYS_futex, word2, FUTEX_WAKE | flags, count2, NULL, NULL, 0);
+		result = result2 < 0 ? result2 : result + result2;
+	}
+	return result < 0 ? -errno : result;
+}
 
-			if(a32_get_data_endianness(cpu) != ARM_ENDIAN_SWAPPED)
+// waits on or wakes up threads waiting on a guest word, timeout_size is the size of the fields of the guest timespec
+// the requeue operations and FUTEX_WAKE_OP take a second count in place of the timeout, and a second word
+static int64_t linux_futex(arm_state_t * cpu, uint64_t address, int op, uint32_t value, uint64_t timeout, size_t timeout_size, uint64_t address2, uint32_t value3)
+{
+	uint32_t * word = linux_futex_word(cpu, address);
+	if(word == NULL)
+		return -EINVAL;
+
+	struct timespec host_timeout;
+	struct timespec * host_timeout_pointer = NULL;
+	uint32_t * word2 = NULL;
+	switch(op & FUTEX_CMD_MASK)
+	{
+	case FUTEX_WAIT:
+	case FUTEX_WAIT_BITSET:
+		value = linux_futex_value(cpu, value);
+		if(timeout != 0)
+		{
+			if(timeout_size == 8)
 			{
-				memory_synchronize_block(address, count, buffer);
-				memory_release_block(address, count, buffer);
+				host_timeout.tv_sec = arm_memory_read64_data(cpu, timeout);
+				host_timeout.tv_nsec = arm_memory_read64_data(cpu, timeout + 8);
 			}
 			else
 			{
-				memory_synchronize_block_reversed(address, count, buffer);
-				memory_release_block_reversed(address, count, buffer);
+				host_timeout.tv_sec = (int32_t)arm_memory_read32_data(cpu, timeout);
+				host_timeout.tv_nsec = (int32_t)arm_memory_read32_data(cpu, timeout + 4);
 			}
+			host_timeout_pointer = &host_timeout;
 		}
-	case A32_OABI_SYS_BASE + A32_SYS_WRITE:
-		{
-			uint64_t address = cpu->r[1];
-			uint64_t count = cpu->r[2];
-			void * buffer;
+		break;
+	case FUTEX_WAKE:
+	case FUTEX_WAKE_BITSET:
+		break;
+	case FUTEX_CMP_REQUEUE:
+		value3 = linux_futex_value(cpu, value3);
+		// fall through
+	case FUTEX_REQUEUE:
+		word2 = linux_futex_word(cpu, address2);
+		if(word2 == NULL)
+			return -EINVAL;
+		host_timeout_pointer = (struct timespec *)(uintptr_t)(uint32_t)timeout;
+		break;
+	case FUTEX_WAKE_OP:
+		word2 = linux_futex_word(cpu, address2);
+		if(word2 == NULL)
+			return -EINVAL;
+		return linux_futex_wake_op(cpu, address2, word, word2, op & FUTEX_PRIVATE_FLAG, value, timeout, value3);
+	default:
+		return -ENOSYS;
+	}
 
-			if(a32_get_data_endianness(cpu) != ARM_ENDIAN_SWAPPED)
-				buffer = memory_acquire_block(address, count);
-			else
-				buffer = memory_acquire_block_reversed(address, count);
+	long result = syscall(SYS_futex, word, op, value, host_timeout_pointer, word2, value3);
+	return result < 0 ? -errno : result;
+}
 
-			cpu->r[0] = write(cpu->r[0], buffer, count);
+// called on the new host thread, before the guest code of the thread starts
+static void linux_clone_init(arm_state_t * cpu, void * data)
+{
+	linux_clone_t * clone = data;
+	clone->tid = linux_gettid();
+	linux_thread.cloned = true;
+	linux_thread.clear_child_tid = (clone->flags & CLONE_CHILD_CLEARTID) != 0 ? clone->child_tid : 0;
+	if((clone->flags & CLONE_PARENT_SETTID) != 0)
+		arm_memory_write32_data(cpu, clone->parent_tid, clone->tid);
+	if((clone->flags & CLONE_CHILD_SETTID) != 0)
+		arm_memory_write32_data(cpu, clone->child_tid, clone->tid);
+	sem_post(&clone->started);
+}
 
-			if(a32_get_data_endianness(cpu) != ARM_ENDIAN_SWAPPED)
-				memory_release_block(address, count, buffer);
-			else
-				memory_release_block_reversed(address, count, buffer);
-		}
+static int64_t linux_clone(arm_state_t * cpu, environment_t * env, uint64_t flags, uint64_t stack, uint64_t parent_tid, uint64_t tls, uint64_t child_tid)
+{
+	if((flags & (CLONE_VM | CLONE_THREAD)) != (CLONE_VM | CLONE_THREAD))
+		return -ENOSYS;
+
+	// the batch runner expects the program to end on the thread it started on
+	if(env->exit_point != NULL)
+		return -EAGAIN;
+
+	setup_multiprocessor(cpu, env);
+
+	arm_state_t * thread = malloc(sizeof(arm_state_t));
+	if(thread == NULL)
+		return -ENOMEM;
+	arm_emu_clone(thread, cpu);
+
+	// the new thread returns 0 from the system call
+	thread->r[0] = 0;
+	if(arm_get_current_instruction_set(cpu) == ISA_AARCH64)
+	{
+		if(stack != 0)
+			thread->r[A64_SP] = stack;
+		if((flags & CLONE_SETTLS) != 0)
+			thread->tpidr_el0 = tls;
+	}
+	else
+	{
+		if(stack != 0)
+			thread->r[A32_SP] = stack;
+		if((flags & CLONE_SETTLS) != 0)
+			thread->tpidrro_el0 = tls;
+	}
+
+	linux_clone_t clone;
+	clone.flags = flags;
+	clone.parent_tid = parent_tid;
+	clone.child_tid = child_tid;
+	sem_init(&clone.started, 0, 0);
+
+	__atomic_add_fetch(&env->thread_count, 1, __ATOMIC_SEQ_CST);
+	if(!start_cpu_thread(thread, env, linux_clone_init, &clone))
+	{
+		__atomic_sub_fetch(&env->thread_count, 1, __ATOMIC_SEQ_CST);
+		arm_emu_free(thread);
+		free(thread);
+		sem_destroy(&clone.started);
+		return -EAGAIN;
+	}
+
+	// the thread ID must be stored before either thread continues
+	while(sem_wait(&clone.started) != 0)
+		;
+	sem_destroy(&clone.started);
+	return clone.tid;
+}
+
+// terminates the current thread, or the process if it is the last one
+static _Noreturn void linux_exit(arm_state_t * cpu, environment_t * env, int status)
+{
+	if(__atomic_fetch_sub(&env->thread_count, 1, __ATOMIC_SEQ_CST) == 0)
+		exit_emulation(env, status);
+
+	if(linux_thread.clear_child_tid != 0)
+	{
+		arm_memory_write32_data(cpu, linux_thread.clear_child_tid, 0);
+		uint32_t * word = linux_futex_word(cpu, linux_thread.clear_child_tid);
+		if(word != NULL)
+			syscall(SYS_futex, word, FUTEX_WAKE, 1, NULL, NULL, 0);
+	}
+
+	if(!linux_thread.cloned)
+	{
+		// the first processor is reported on when the last thread exits, so it must stay allocated until then
+		for(;;)
+			pause();
+	}
+
+	arm_emu_free(cpu);
+	free(cpu);
+	pthread_exit(NULL);
+}
+
+bool a32_linux_oabi_syscall(arm_state_t * cpu, environment_t * env, uint32_t swi_number)
+{
+	switch(swi_number)
+	{
+	case A32_OABI_SYS_BASE + A32_SYS_EXIT:
+		linux_exit(cpu, env, cpu->r[0]);
+	case A32_OABI_SYS_BASE + A32_SYS_EXIT_GROUP:
+		exit_emulation(env, cpu->r[0]);
+		return true;
+	case A32_OABI_SYS_BASE + A32_SYS_READ:
+		cpu->r[0] = linux_read(cpu, env, cpu->r[0], cpu->r[1], cpu->r[2], a32_get_data_endianness(cpu) == ARM_ENDIAN_SWAPPED);
+		return true;
+	case A32_OABI_SYS_BASE + A32_SYS_WRITE:
+		cpu->r[0] = linux_write(cpu, env, cpu->r[0], cpu->r[1], cpu->r[2], a32_get_data_endianness(cpu) == ARM_ENDIAN_SWAPPED);
+		return true;
+	case A32_OABI_SYS_BASE + A32_SYS_CLONE:
+		cpu->r[0] = linux_clone(cpu, env, cpu->r[0], cpu->r[1], cpu->r[2], cpu->r[3], cpu->r[4]);
+		return true;
+	case A32_OABI_SYS_BASE + A32_SYS_GETTID:
+		cpu->r[0] = linux_gettid();
+		return true;
+	case A32_OABI_SYS_BASE + A32_SYS_FUTEX:
+		cpu->r[0] = linux_futex(cpu, cpu->r[0], cpu->r[1], cpu->r[2], cpu->r[3], 4, cpu->r[4], cpu->r[5]);
+		return true;
+	case A32_OABI_SYS_BASE + A32_SYS_SET_TID_ADDRESS:
+		linux_thread.clear_child_tid = cpu->r[0];
+		cpu->r[0] = linux_gettid();
+		return true;
+	case A32_OABI_SYS_BASE + A32_SYS_FUTEX_TIME64:
+		cpu->r[0] = linux_futex(cpu, cpu->r[0], cpu->r[1], cpu->r[2], cpu->r[3], 8, cpu->r[4], cpu->r[5]);
+		return true;
+	case A32_OABI_SYS_BASE + A32_SYS_SET_TLS:
+		cpu->tpidrro_el0 = cpu->r[0];
+		cpu->r[0] = 0;
 		return true;
 	default:
 		return false;
 	}
 }
 
-bool a32_linux_eabi_syscall(arm_state_t * cpu)
+bool a32_linux_eabi_syscall(arm_state_t * cpu, environment_t * env)
 {
 	switch(cpu->r[7])
 	{
 	case A32_SYS_EXIT:
-		exit(cpu->r[0]);
+		linux_exit(cpu, env, cpu->r[0]);
+	case A32_SYS_EXIT_GROUP:
+		exit_emulation(env, cpu->r[0]);
 		return true;
 	case A32_SYS_READ:
-		{
-			uint64_t address = cpu->r[1];
-			uint64_t count = cpu->r[2];
-			void * buffer;
-
-			if(a32_get_data_endianness(cpu) != ARM_ENDIAN_SWAPPED)
-				buffer = memory_acquire_block(address, count);
-			else
-				buffer = memory_acquire_block_reversed(address, count);
-
-			cpu->r[0] = read(cpu->r[0], buffer, count);
-
-			if(a32_get_data_endianness(cpu) != ARM_ENDIAN_SWAPPED)
-			{
-				memory_synchronize_block(address, count, buffer);
-				memory_release_block(address, count, buffer);
-			}
-			else
-			{
-				memory_synchronize_block_reversed(address, count, buffer);
-				memory_release_block_reversed(address, count, buffer);
-			}
-		}
+		cpu->r[0] = linux_read(cpu, env, cpu->r[0], cpu->r[1], cpu->r[2], a32_get_data_endianness(cpu) == ARM_ENDIAN_SWAPPED);
 		return true;
 	case A32_SYS_WRITE:
-		{
-			uint64_t address = cpu->r[1];
-			uint64_t count = cpu->r[2];
-			void * buffer;
-
-			if(a32_get_data_endianness(cpu) != ARM_ENDIAN_SWAPPED)
-				buffer = memory_acquire_block(address, count);
-			else
-				buffer = memory_acquire_block_reversed(address, count);
-
-			cpu->r[0] = write(cpu->r[0], buffer, count);
-
-			if(a32_get_data_endianness(cpu) != ARM_ENDIAN_SWAPPED)
-				memory_release_block(address, count, buffer);
-			else
-				memory_release_block_reversed(address, count, buffer);
-		}
+		cpu->r[0] = linux_write(cpu, env, cpu->r[0], cpu->r[1], cpu->r[2], a32_get_data_endianness(cpu) == ARM_ENDIAN_SWAPPED);
+		return true;
+	case A32_SYS_CLONE:
+		cpu->r[0] = linux_clone(cpu, env, cpu->r[0], cpu->r[1], cpu->r[2], cpu->r[3], cpu->r[4]);
+		return true;
+	case A32_SYS_GETTID:
+		cpu->r[0] = linux_gettid();
+		return true;
+	case A32_SYS_FUTEX:
+		cpu->r[0] = linux_futex(cpu, cpu->r[0], cpu->r[1], cpu->r[2], cpu->r[3], 4, cpu->r[4], cpu->r[5]);
+		return true;
+	case A32_SYS_SET_TID_ADDRESS:
+		linux_thread.clear_child_tid = cpu->r[0];
+		cpu->r[0] = linux_gettid();
+		return true;
+	case A32_SYS_FUTEX_TIME64:
+		cpu->r[0] = linux_futex(cpu, cpu->r[0], cpu->r[1], cpu->r[2], cpu->r[3], 8, cpu->r[4], cpu->r[5]);
+		return true;
+	case A32_SYS_SET_TLS:
+		cpu->tpidrro_el0 = cpu->r[0];
+		cpu->r[0] = 0;
 		return true;
 	default:
 		return false;
 	}
 }
 
-bool a64_linux_syscall(arm_state_t * cpu)
+bool a64_linux_syscall(arm_state_t * cpu, environment_t * env)
 {
 	switch(cpu->r[8])
 	{
 	case A64_SYS_EXIT:
-		exit(cpu->r[0]);
+		linux_exit(cpu, env, cpu->r[0]);
+	case A64_SYS_EXIT_GROUP:
+		exit_emulation(env, cpu->r[0]);
 		return true;
 	case A64_SYS_READ:
-		{
-			uint64_t address = cpu->r[1];
-			uint64_t count = cpu->r[2];
-			void * buffer = memory_acquire_block(address, count);
-			cpu->r[0] = read(cpu->r[0], buffer, count);
-			memory_synchronize_block(address, count, buffer);
-			memory_release_block(address, count, buffer);
-		}
+		cpu->r[0] = linux_read(cpu, env, cpu->r[0], cpu->r[1], cpu->r[2], false);
 		return true;
 	case A64_SYS_WRITE:
-		{
-			uint64_t address = cpu->r[1];
-			uint64_t count = cpu->r[2];
-			void * buffer = memory_acquire_block(address, count);
-			cpu->r[0] = write(cpu->r[0], buffer, count);
-			memory_release_block(address, count, buffer);
-		}
+		cpu->r[0] = linux_write(cpu, env, cpu->r[0], cpu->r[1], cpu->r[2], false);
+		return true;
+	case A64_SYS_CLONE:
+		cpu->r[0] = linux_clone(cpu, env, cpu->r[0], cpu->r[1], cpu->r[2], cpu->r[3], cpu->r[4]);
+		return true;
+	case A64_SYS_GETTID:
+		cpu->r[0] = linux_gettid();
+		return true;
+	case A64_SYS_FUTEX:
+		cpu->r[0] = linux_futex(cpu, cpu->r[0], cpu->r[1], cpu->r[2], cpu->r[3], 8, cpu->r[4], cpu->r[5]);
+		return true;
+	case A64_SYS_SET_TID_ADDRESS:
+		linux_thread.clear_child_tid = cpu->r[0];
+		cpu->r[0] = linux_gettid();
 		return true;
 	default:
 		return false;
 	}
 }
 
-bool j32_linux_syscall(arm_state_t * cpu, uint32_t syscall_number)
+bool j32_linux_syscall(arm_state_t * cpu, environment_t * env, uint32_t syscall_number)
 {
 	bool picojava_syscall = syscall_number == (uint32_t)-1;
 	if(picojava_syscall)
@@ -1725,7 +2042,21 @@ bool j32_linux_syscall(arm_state_t * cpu, uint32_t syscall_number)
 			if(picojava_syscall)
 				j32_pop_word(cpu);
 			int32_t status = j32_pop_word(cpu);
-			exit(status);
+			linux_exit(cpu, env, status);
+		}
+	case A32_SYS_EXIT_GROUP:
+		{
+			if(picojava_syscall)
+				j32_pop_word(cpu);
+			int32_t status = j32_pop_word(cpu);
+			exit_emulation(env, status);
+		}
+		return true;
+	case A32_SYS_GETTID:
+		{
+			if(picojava_syscall)
+				j32_pop_word(cpu);
+			j32_push_word(cpu, linux_gettid());
 		}
 		return true;
 	case A32_SYS_READ:
@@ -1737,27 +2068,10 @@ bool j32_linux_syscall(arm_state_t * cpu, uint32_t syscall_number)
 			uint32_t address = j32_pop_word(cpu);
 			address += picojava_syscall ? 0 : (int32_t)j32_pop_word(cpu);
 			int32_t fd = j32_pop_word(cpu);
-			void * buffer;
-
-			if(a32_get_data_endianness(cpu) != ARM_ENDIAN_SWAPPED)
-				buffer = memory_acquire_block(address, count);
-			else
-				buffer = memory_acquire_block_reversed(address, count);
 
-			uint32_t result = read(fd, buffer, count);
+			uint32_t result = linux_read(cpu, env, fd, address, count, a32_get_data_endianness(cpu) == ARM_ENDIAN_SWAPPED);
 
 			j32_push_word(cpu, result);
-
-			if(a32_get_data_endianness(cpu) != ARM_ENDIAN_SWAPPED)
-			{
-				memory_synchronize_block(address, count, buffer);
-				memory_release_block(address, count, buffer);
-			}
-			else
-			{
-				memory_synchronize_block_reversed(address, count, buffer);
-				memory_release_block_reversed(address, count, buffer);
-			}
 		}
 		return true;
 	case A32_SYS_WRITE:
@@ -1769,21 +2083,10 @@ bool j32_linux_syscall(arm_state_t * cpu, uint32_t syscall_number)
 			uint32_t address = j32_pop_word(cpu);
 			address += picojava_syscall ? 0 : (int32_t)j32_pop_word(cpu);
 			int32_t fd = j32_pop_word(cpu);
-			void * buffer;
-
-			if(a32_get_data_endianness(cpu) != ARM_ENDIAN_SWAPPED)
-				buffer = memory_acquire_block(address, count);
-			else
-				buffer = memory_acquire_block_reversed(address, count);
 
-			uint32_t result = write(fd, buffer, count);
+			uint32_t result = linux_write(cpu, env, fd, address, count, a32_get_data_endianness(cpu) == ARM_ENDIAN_SWAPPED);
 
 			j32_push_word(cpu, result);
-
-			if(a32_get_data_endianness(cpu) != ARM_ENDIAN_SWAPPED)
-				memory_release_block(address, count, buffer);
-			else
-				memory_release_block_reversed(address, count, buffer);
 		}
 		return true;
 	default:
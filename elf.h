@@ -19,7 +19,6 @@ enum ei_class_t
 	ELFCLASS32,
 	ELFCLASS64,
 };
-extern enum ei_class_t ei_class;
 
 enum ei_data_t
 {
@@ -27,7 +26,6 @@ enum ei_data_t
 	ELFDATA2LSB,
 	ELFDATA2MSB,
 };
-extern enum ei_data_t ei_data;
 
 enum e_machine_t
 {
@@ -132,6 +130,13 @@ enum
 	A32_SYS_LSEEK = 19,
 	A32_SYS_TIMES = 43,
 	A32_SYS_BRK = 45,
+	A32_SYS_CLONE = 120,
+	A32_SYS_GETTID = 224,
+	A32_SYS_FUTEX = 240,
+	A32_SYS_EXIT_GROUP = 248,
+	A32_SYS_SET_TID_ADDRESS = 256,
+	A32_SYS_FUTEX_TIME64 = 422,
+	A32_SYS_SET_TLS = 0xF0005, // ARM specific
 
 	J32_SYS_GETBYTES = 0x10000000,
 
@@ -146,6 +151,11 @@ enum
 	A64_SYS_LLSEEK = 62,
 	A64_SYS_TIMES = 153,
 	A64_SYS_BRK = 214,
+	A64_SYS_EXIT_GROUP = 94,
+	A64_SYS_SET_TID_ADDRESS = 96,
+	A64_SYS_FUTEX = 98,
+	A64_SYS_GETTID = 178,
+	A64_SYS_CLONE = 220,
 };
 
 // returns new stack
@@ -154,11 +164,11 @@ extern void setup_initial_state(arm_state_t * cpu, environment_t * env, int argc
 
 extern void read_elf_file(FILE * input_file, environment_t * env);
 
-extern bool a32_linux_oabi_syscall(arm_state_t * cpu, uint32_t swi_number);
-extern bool a32_linux_eabi_syscall(arm_state_t * cpu);
-extern bool a64_linux_syscall(arm_state_t * cpu);
+extern bool a32_linux_oabi_syscall(arm_state_t * cpu, environment_t * env, uint32_t swi_number);
+extern bool a32_linux_eabi_syscall(arm_state_t * cpu, environment_t * env);
+extern bool a64_linux_syscall(arm_state_t * cpu, environment_t * env);
 
 // simulates a Linux syscall from Jazelle mode; if syscall_number == 0xFFFFFFFF, then load syscall number from Java stack
-extern bool j32_linux_syscall(arm_state_t * cpu, uint32_t syscall_number);
+extern bool j32_linux_syscall(arm_state_t * cpu, environment_t * env, uint32_t syscall_number);
 
 #endif // _ELF_H
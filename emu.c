@@ -9,6 +9,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <setjmp.h>
 #include "emu.h"
@@ -159,8 +160,65 @@ static inline bool a32_is_data26(arm_state_t * cpu)
 		return cpu->config.version < ARMV8 && !(cpu->sctlr_el1 & SCTLR_D);
 }
 
+// computes the current flags without storing them, in the order N, Z, C, V from bit 3 to bit 0
+static inline uint8_t arm_get_nzcv(arm_state_t * cpu)
+{
+	uint64_t res = cpu->lazy_flags.result;
+	uint64_t op1 = cpu->lazy_flags.operand1;
+	uint64_t op2 = cpu->lazy_flags.operand2;
+	switch(cpu->lazy_flags.kind)
+	{
+	case ARM_FLAGS_NZ32:
+		return (((res >> 31) & 1) << 3) | (((uint32_t)res == 0) << 2) | (cpu->pstate.c << 1) | cpu->pstate.v;
+	case ARM_FLAGS_NZ64:
+		return (((res >> 63) & 1) << 3) | ((res == 0) << 2) | (cpu->pstate.c << 1) | cpu->pstate.v;
+	case ARM_FLAGS_NZCV32:
+		return (((res >> 31) & 1) << 3) | (((uint32_t)res == 0) << 2)
+			| ((((op1 & op2) | (op1 & ~res) | (op2 & ~res)) >> 31) & 1) << 1
+			| ((((op1 & op2 & ~res) | (~op1 & ~op2 & res)) >> 31) & 1);
+	case ARM_FLAGS_NZCV64:
+		return (((res >> 63) & 1) << 3) | ((res == 0) << 2)
+			| ((((op1 & op2) | (op1 & ~res) | (op2 & ~res)) >> 63) & 1) << 1
+			| ((((op1 & op2 & ~res) | (~op1 & ~op2 & res)) >> 63) & 1);
+	default:
+		return (cpu->pstate.n << 3) | (cpu->pstate.z << 2) | (cpu->pstate.c << 1) | cpu->pstate.v;
+	}
+}
+
+void arm_evaluate_flags(arm_state_t * cpu)
+{
+	if(cpu->lazy_flags.kind == ARM_FLAGS_EVALUATED)
+		return;
+	uint8_t nzcv = arm_get_nzcv(cpu);
+	cpu->pstate.n = (nzcv >> 3) & 1;
+	cpu->pstate.z = (nzcv >> 2) & 1;
+	cpu->pstate.c = (nzcv >> 1) & 1;
+	cpu->pstate.v = nzcv & 1;
+	cpu->lazy_flags.kind = ARM_FLAGS_EVALUATED;
+}
+
+// instructions that only modify some of the flags must not lose the pending values of the others
+static inline void arm_evaluate_carry_and_overflow(arm_state_t * cpu)
+{
+	if(cpu->lazy_flags.kind == ARM_FLAGS_NZCV32 || cpu->lazy_flags.kind == ARM_FLAGS_NZCV64)
+		arm_evaluate_flags(cpu);
+}
+
+static inline bool arm_get_carry(arm_state_t * cpu)
+{
+	arm_evaluate_carry_and_overflow(cpu);
+	return cpu->pstate.c;
+}
+
+static inline void arm_set_carry(arm_state_t * cpu, bool carry)
+{
+	arm_evaluate_carry_and_overflow(cpu);
+	cpu->pstate.c = carry;
+}
+
 uint32_t a32_get_cpsr(arm_state_t * cpu)
 {
+	arm_evaluate_flags(cpu);
 	uint32_t cpsr = cpu->pstate.mode | (cpu->pstate.rw & 1 ? CPSR_M4 : 0) | (cpu->pstate.f ? CPSR_F : 0) | (cpu->pstate.i ? CPSR_I : 0)
 		| (cpu->pstate.v ? CPSR_V : 0) | (cpu->pstate.c ? CPSR_C : 0) | (cpu->pstate.z ? CPSR_Z : 0) | (cpu->pstate.n ? CPSR_N : 0);
 	if((cpu->config.features & (1 << FEATURE_THUMB)))
@@ -197,6 +255,8 @@ void a32_set_cpsr(arm_state_t * cpu, uint32_t mask, uint32_t cpsr)
 		cpu->pstate.f = cpsr & CPSR_F ? 1 : 0;
 	if((mask & CPSR_I))
 		cpu->pstate.i = cpsr & CPSR_I ? 1 : 0;
+	if((mask & (CPSR_N | CPSR_Z | CPSR_C | CPSR_V)))
+		arm_evaluate_flags(cpu);
 	if((mask & CPSR_N))
 		cpu->pstate.n = cpsr & CPSR_N ? 1 : 0;
 	if((mask & CPSR_C))
@@ -250,6 +310,7 @@ void a32_set_cpsr(arm_state_t * cpu, uint32_t mask, uint32_t cpsr)
 
 uint32_t a64_get_cpsr(arm_state_t * cpu)
 {
+	arm_evaluate_flags(cpu);
 	uint32_t cpsr = cpu->pstate.sp | (cpu->pstate.el << CPSR_EL_SHIFT) | (cpu->pstate.rw & 1 ? CPSR_M4 : 0) | (cpu->pstate.f ? CPSR_F : 0) | (cpu->pstate.i ? CPSR_I : 0) | (cpu->pstate.a ? CPSR_A : 0) | (cpu->pstate.d ? CPSR_D : 0)
 		| (cpu->pstate.v ? CPSR_V : 0) | (cpu->pstate.c ? CPSR_C : 0) | (cpu->pstate.z ? CPSR_Z : 0) | (cpu->pstate.n ? CPSR_N : 0);
 	if((cpu->config.version >= ARMV81))
@@ -321,7 +382,7 @@ arm_endianness_t a32_get_data_endianness(arm_state_t * cpu)
 		return ARM_ENDIAN_LITTLE;
 }
 
-static inline arm_endianness_t a64_get_data_endianness(arm_state_t * cpu)
+arm_endianness_t a64_get_data_endianness(arm_state_t * cpu)
 {
 	switch(cpu->pstate.el)
 	{
@@ -504,6 +565,7 @@ static inline uint32_t a32_get_spsr(arm_state_t * cpu)
 
 static inline uint32_t a26_get_pc(arm_state_t * cpu)
 {
+	arm_evaluate_flags(cpu);
 	return (cpu->r[PC] & 0x03FFFFFC)
 		| (cpu->pstate.mode & 3) | (cpu->pstate.f ? CPSR_A26_F : 0) | (cpu->pstate.i ? CPSR_A26_I : 0)
 		| (cpu->pstate.v ? CPSR_V : 0) | (cpu->pstate.c ? CPSR_C : 0) | (cpu->pstate.z ? CPSR_Z : 0) | (cpu->pstate.n ? CPSR_N : 0);
@@ -511,6 +573,7 @@ static inline uint32_t a26_get_pc(arm_state_t * cpu)
 
 static inline void a32_set_cpsr_nzcv(arm_state_t * cpu, uint32_t value)
 {
+	cpu->lazy_flags.kind = ARM_FLAGS_EVALUATED; // all of them get overwritten
 	cpu->pstate.v = value & CPSR_V ? 1 : 0;
 	cpu->pstate.c = value & CPSR_C ? 1 : 0;
 	cpu->pstate.z = value & CPSR_Z ? 1 : 0;
@@ -862,6 +925,27 @@ uint32_t arm_get_midr(arm_state_t * cpu)
 	return value;
 }
 
+uint32_t arm_get_mpidr(arm_state_t * cpu)
+{
+	if(!(cpu->config.features & (1 << FEATURE_MULTIPROC)))
+	{
+		// not implemented, reads as MIDR
+		return arm_get_midr(cpu);
+	}
+	else if(cpu->config.version == ARMV6)
+	{
+		// ARM11 MPCore CPU ID register
+		return cpu->processor_id & 0xF;
+	}
+	else
+	{
+		uint32_t value = 0x80000000 | cpu->processor_id;
+		if(cpu->global_monitor == NULL)
+			value |= 0x40000000; // uniprocessor system
+		return value;
+	}
+}
+
 uint32_t arm_get_id_pfr0(arm_state_t * cpu)
 {
 	uint32_t value = 0;
@@ -900,21 +984,21 @@ static inline bool memory_read_bytes16(const memory_interface_t * memory, arm_st
 {
 	if(endian != ARM_ENDIAN_SWAPPED)
 	{
-		return memory->read(cpu, address, buffer, 2, privileged_mode);
+		return memory->read(memory->data, cpu, address, buffer, 2, privileged_mode);
 	}
 	else
 	{
 		if((address & 3) != 3)
 		{
 			// return in the reversed order as to the actual read
-			return memory->read(cpu, (address ^ 3) - 1, buffer, 2, privileged_mode);
+			return memory->read(memory->data, cpu, (address ^ 3) - 1, buffer, 2, privileged_mode);
 		}
 		else
 		{
 			// replicate reversed order
 			return
-				memory->read(cpu, address & ~3, &((char *)buffer)[1], 1, privileged_mode)
-				&& memory->read(cpu, address + 4, &((char *)buffer)[0], 1, privileged_mode);
+				memory->read(memory->data, cpu, address & ~3, &((char *)buffer)[1], 1, privileged_mode)
+				&& memory->read(memory->data, cpu, address + 4, &((char *)buffer)[0], 1, privileged_mode);
 		}
 	}
 }
@@ -923,21 +1007,21 @@ static inline bool memory_write_bytes16(const memory_interface_t * memory, arm_s
 {
 	if(endian != ARM_ENDIAN_SWAPPED)
 	{
-		return memory->write(cpu, address, buffer, 2, privileged_mode);
+		return memory->write(memory->data, cpu, address, buffer, 2, privileged_mode);
 	}
 	else
 	{
 		if((address & 3) != 3)
 		{
 			// return in the reversed order as to the actual write
-			return memory->write(cpu, (address ^ 3) - 1, buffer, 2, privileged_mode);
+			return memory->write(memory->data, cpu, (address ^ 3) - 1, buffer, 2, privileged_mode);
 		}
 		else
 		{
 			// replicate reversed order
 			return
-				memory->write(cpu, address & ~3, &((char *)buffer)[1], 1, privileged_mode) &&
-				memory->write(cpu, address + 4,  &((char *)buffer)[0], 1, privileged_mode);
+				memory->write(memory->data, cpu, address & ~3, &((char *)buffer)[1], 1, privileged_mode) &&
+				memory->write(memory->data, cpu, address + 4,  &((char *)buffer)[0], 1, privileged_mode);
 		}
 	}
 }
@@ -946,21 +1030,21 @@ static inline bool memory_read_bytes32(const memory_interface_t * memory, arm_st
 {
 	if(endian != ARM_ENDIAN_SWAPPED)
 	{
-		return memory->read(cpu, address, buffer, 4, privileged_mode);
+		return memory->read(memory->data, cpu, address, buffer, 4, privileged_mode);
 	}
 	else
 	{
 		if((address & 3) == 0)
 		{
 			// return in the reversed order as to the actual read
-			return memory->read(cpu, address, buffer, 4, privileged_mode);
+			return memory->read(memory->data, cpu, address, buffer, 4, privileged_mode);
 		}
 		else
 		{
 			// replicate reversed order
 			return
-				memory->read(cpu, address & ~3,                       &((char *)buffer)[address & 3], 4 - (address & 3), privileged_mode) &&
-				memory->read(cpu, address + 8 - ((address & 3) << 1), &((char *)buffer)[0],           address & 3,       privileged_mode);
+				memory->read(memory->data, cpu, address & ~3,                       &((char *)buffer)[address & 3], 4 - (address & 3), privileged_mode) &&
+				memory->read(memory->data, cpu, address + 8 - ((address & 3) << 1), &((char *)buffer)[0],           address & 3,       privileged_mode);
 		}
 	}
 }
@@ -969,21 +1053,21 @@ static inline bool memory_write_bytes32(const memory_interface_t * memory, arm_s
 {
 	if(endian != ARM_ENDIAN_SWAPPED)
 	{
-		return memory->write(cpu, address, buffer, 4, privileged_mode);
+		return memory->write(memory->data, cpu, address, buffer, 4, privileged_mode);
 	}
 	else
 	{
 		if((address & 3) == 0)
 		{
 			// return in the reversed order as to the actual write
-			return memory->write(cpu, address, buffer, 4, privileged_mode);
+			return memory->write(memory->data, cpu, address, buffer, 4, privileged_mode);
 		}
 		else
 		{
 			// replicate reversed order
 			return
-				memory->write(cpu, address & ~3,                       &((char *)buffer)[address & 3], 4 - (address & 3), privileged_mode) &&
-				memory->write(cpu, address + 8 - ((address & 3) << 1), &((char *)buffer)[0],           address & 3,       privileged_mode);
+				memory->write(memory->data, cpu, address & ~3,                       &((char *)buffer)[address & 3], 4 - (address & 3), privileged_mode) &&
+				memory->write(memory->data, cpu, address + 8 - ((address & 3) << 1), &((char *)buffer)[0],           address & 3,       privileged_mode);
 		}
 	}
 }
@@ -992,7 +1076,7 @@ static inline bool memory_read_bytes64(const memory_interface_t * memory, arm_st
 {
 	if(endian != ARM_ENDIAN_SWAPPED)
 	{
-		return memory->read(cpu, address, buffer, 8, privileged_mode);
+		return memory->read(memory->data, cpu, address, buffer, 8, privileged_mode);
 	}
 	else
 	{
@@ -1000,15 +1084,15 @@ static inline bool memory_read_bytes64(const memory_interface_t * memory, arm_st
 		if((address & 3) == 0)
 		{
 			return
-				memory->read(cpu, address,     &((char *)buffer)[4], 4, privileged_mode) &&
-				memory->read(cpu, address + 4, &((char *)buffer)[0], 4, privileged_mode);
+				memory->read(memory->data, cpu, address,     &((char *)buffer)[4], 4, privileged_mode) &&
+				memory->read(memory->data, cpu, address + 4, &((char *)buffer)[0], 4, privileged_mode);
 		}
 		else
 		{
 			return
-				memory->read(cpu, address & ~3,                        &((char *)buffer)[4 + (address & 3)], 4 - (address & 3), privileged_mode) &&
-				memory->read(cpu, (address & ~3) + 4,                  &((char *)buffer)[address & 3],       4,                 privileged_mode) &&
-				memory->read(cpu, address + 12 - ((address & 3) << 1), &((char *)buffer)[0],                 address & 3,       privileged_mode);
+				memory->read(memory->data, cpu, address & ~3,                        &((char *)buffer)[4 + (address & 3)], 4 - (address & 3), privileged_mode) &&
+				memory->read(memory->data, cpu, (address & ~3) + 4,                  &((char *)buffer)[address & 3],       4,                 privileged_mode) &&
+				memory->read(memory->data, cpu, address + 12 - ((address & 3) << 1), &((char *)buffer)[0],                 address & 3,       privileged_mode);
 		}
 	}
 }
@@ -1017,7 +1101,7 @@ static inline bool memory_write_bytes64(const memory_interface_t * memory, arm_s
 {
 	if(endian != ARM_ENDIAN_SWAPPED)
 	{
-		return memory->write(cpu, address, buffer, 8, privileged_mode);
+		return memory->write(memory->data, cpu, address, buffer, 8, privileged_mode);
 	}
 	else
 	{
@@ -1025,15 +1109,15 @@ static inline bool memory_write_bytes64(const memory_interface_t * memory, arm_s
 		if((address & 3) == 0)
 		{
 			return
-				memory->write(cpu, address,     &((char *)buffer)[4], 4, privileged_mode) &&
-				memory->write(cpu, address + 4, &((char *)buffer)[0], 4, privileged_mode);
+				memory->write(memory->data, cpu, address,     &((char *)buffer)[4], 4, privileged_mode) &&
+				memory->write(memory->data, cpu, address + 4, &((char *)buffer)[0], 4, privileged_mode);
 		}
 		else
 		{
 			return
-				memory->write(cpu, address & ~3,                        &((char *)buffer)[4 + (address & 3)], 4 - (address & 3), privileged_mode) &&
-				memory->write(cpu, (address & ~3) + 4,                  &((char *)buffer)[address & 3],       4,                 privileged_mode) &&
-				memory->write(cpu, address + 12 - ((address & 3) << 1), &((char *)buffer)[0],                 address & 3,       privileged_mode);
+				memory->write(memory->data, cpu, address & ~3,                        &((char *)buffer)[4 + (address & 3)], 4 - (address & 3), privileged_mode) &&
+				memory->write(memory->data, cpu, (address & ~3) + 4,                  &((char *)buffer)[address & 3],       4,                 privileged_mode) &&
+				memory->write(memory->data, cpu, address + 12 - ((address & 3) << 1), &((char *)buffer)[0],                 address & 3,       privileged_mode);
 		}
 	}
 }
@@ -1055,9 +1139,183 @@ bool arm_is_privileged_mode(arm_state_t * cpu)
 _Noreturn void arm_prefetch_abort(arm_state_t * cpu);
 _Noreturn void arm_data_abort(arm_state_t * cpu);
 
+/* Exclusive monitors
+ * A load exclusive marks the range it read in the local monitor of the CPU, along with the values read
+ * The store exclusive replaces the values with a host compare-and-swap (see memory_compare_exchange), so stores by other CPUs
+ * make it fail without having to check the monitors on every store, but like on other emulators, storing back the same value goes unnoticed
+ */
+
+// a store exclusive only succeeds if the load exclusive marked exactly the same range
+static inline bool arm_exclusive_is_marked(arm_state_t * cpu, uint64_t base, size_t size)
+{
+	return cpu->exclusive_start == base && cpu->exclusive_end == base + size - 1;
+}
+
+static inline void arm_exclusive_unmark(arm_state_t * cpu)
+{
+	cpu->exclusive_start = UINT64_MAX;
+	cpu->exclusive_end = 0;
+}
+
+void arm_global_monitor_init(arm_global_monitor_t * monitor)
+{
+	pthread_mutex_init(&monitor->lock, NULL);
+	pthread_mutex_init(&monitor->cpu_lock, NULL);
+	monitor->cpu_count = 0;
+	monitor->cpu_capacity = 0;
+	monitor->cpus = NULL;
+	memset(monitor->code_lines, 0, sizeof monitor->code_lines);
+}
+
+void arm_global_monitor_attach(arm_global_monitor_t * monitor, arm_state_t * cpu)
+{
+	pthread_mutex_lock(&monitor->cpu_lock);
+	if(monitor->cpu_count == monitor->cpu_capacity)
+	{
+		monitor->cpu_capacity = monitor->cpu_capacity == 0 ? 8 : 2 * monitor->cpu_capacity;
+		monitor->cpus = realloc(monitor->cpus, monitor->cpu_capacity * sizeof(arm_state_t *));
+	}
+	monitor->cpus[monitor->cpu_count++] = cpu;
+	cpu->global_monitor = monitor;
+	cpu->invalidation_pending = false;
+	cpu->pending_invalidation_count = 0;
+	pthread_mutex_unlock(&monitor->cpu_lock);
+}
+
+void arm_global_monitor_detach(arm_global_monitor_t * monitor, arm_state_t * cpu)
+{
+	pthread_mutex_lock(&monitor->cpu_lock);
+	for(size_t index = 0; index < monitor->cpu_count; index++)
+	{
+		if(monitor->cpus[index] == cpu)
+		{
+			monitor->cpus[index] = monitor->cpus[--monitor->cpu_count];
+			break;
+		}
+	}
+	cpu->global_monitor = NULL;
+	cpu->invalidation_pending = false;
+	pthread_mutex_unlock(&monitor->cpu_lock);
+}
+
+/* Shared code
+ * Every CPU has its own decoded instructions and translated blocks, but they all access the same memory
+ * Before a CPU decodes an instruction, it marks its line in the global monitor, and a write to a marked line is queued for all the other CPUs,
+ * which discard their copies before they continue with their next block
+ * As on hardware, an instruction that is modified while another processor fetches it might still be executed in either form by that processor
+ */
+
+static inline size_t arm_shared_code_line(uint64_t address)
+{
+	return (address / ARM_SHARED_CODE_LINE_SIZE) & (ARM_SHARED_CODE_LINE_COUNT - 1);
+}
+
+static inline void arm_shared_code_mark(arm_state_t * cpu, uint64_t address, uint64_t size)
+{
+	if(cpu->global_monitor == NULL)
+		return;
+	for(uint64_t line = address / ARM_SHARED_CODE_LINE_SIZE; line <= (address + size - 1) / ARM_SHARED_CODE_LINE_SIZE; line++)
+	{
+		size_t index = arm_shared_code_line(line * ARM_SHARED_CODE_LINE_SIZE);
+		uint64_t bit = (uint64_t)1 << (index & 63);
+		if(!(__atomic_load_n(&cpu->global_monitor->code_lines[index >> 6], __ATOMIC_RELAXED) & bit))
+			__atomic_fetch_or(&cpu->global_monitor->code_lines[index >> 6], bit, __ATOMIC_SEQ_CST);
+	}
+}
+
+static inline bool arm_shared_code_test(arm_global_monitor_t * monitor, uint64_t address, uint64_t size)
+{
+	uint64_t first = address / ARM_SHARED_CODE_LINE_SIZE;
+	uint64_t last = (address + size - 1) / ARM_SHARED_CODE_LINE_SIZE;
+	if(last - first >= ARM_SHARED_CODE_LINE_COUNT)
+		return true;
+	for(uint64_t line = first; line <= last; line++)
+	{
+		size_t index = arm_shared_code_line(line * ARM_SHARED_CODE_LINE_SIZE);
+		if((__atomic_load_n(&monitor->code_lines[index >> 6], __ATOMIC_RELAXED) & ((uint64_t)1 << (index & 63))))
+			return true;
+	}
+	return false;
+}
+
+static void arm_shared_code_invalidate(arm_state_t * cpu, uint64_t address, uint64_t size)
+{
+	arm_global_monitor_t * monitor = cpu->global_monitor;
+	pthread_mutex_lock(&monitor->cpu_lock);
+	for(size_t index = 0; index < monitor->cpu_count; index++)
+	{
+		arm_state_t * other = monitor->cpus[index];
+		if(other == cpu)
+			continue;
+		if(other->pending_invalidation_count < ARM_PENDING_INVALIDATION_COUNT)
+		{
+			other->pending_invalidations[other->pending_invalidation_count].address = address;
+			other->pending_invalidations[other->pending_invalidation_count].size = size;
+			other->pending_invalidation_count ++;
+		}
+		else
+		{
+			// too many, discard everything
+			other->pending_invalidation_count = ARM_PENDING_INVALIDATION_COUNT + 1;
+		}
+		__atomic_store_n(&other->invalidation_pending, true, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&monitor->cpu_lock);
+}
+
+/* Host memory fast path
+ * If the memory interface can map guest pages into host memory, naturally aligned accesses are performed directly on the host memory
+ * Unaligned accesses (which might cross a page) go through the read/write callbacks instead
+ * BE32 memory is stored word invariant (words in little endian order), so aligned word accesses need no conversion,
+ * while bytes and halfwords only need their address adjusted
+ */
+
+void arm_memory_map_flush(arm_state_t * cpu)
+{
+	memset(cpu->memory_map, 0, sizeof cpu->memory_map);
+}
+
+// returns NULL if the access must go through the memory interface
+static inline uint8_t * arm_memory_map(const memory_interface_t * memory, arm_state_t * cpu, uint64_t address, bool write)
+{
+	if(cpu == NULL || memory->map == NULL)
+		return NULL;
+
+	arm_memory_map_entry_t * entry = &cpu->memory_map[write][(address / ARM_MEMORY_MAP_PAGE_SIZE) & (ARM_MEMORY_MAP_SIZE - 1)];
+	uint64_t page = address & ~(uint64_t)(ARM_MEMORY_MAP_PAGE_SIZE - 1);
+	if(entry->host == NULL || entry->address != page)
+	{
+		entry->address = page;
+		entry->host = memory->map(memory->data, cpu, page, write);
+		if(entry->host == NULL)
+			return NULL;
+	}
+	return &entry->host[address & (ARM_MEMORY_MAP_PAGE_SIZE - 1)];
+}
+
+// doublewords in BE32 memory are stored as two words, most significant word first
+static inline void memory_copy_bytes64(void * destination, const void * source, arm_endianness_t endian)
+{
+	if(endian != ARM_ENDIAN_SWAPPED)
+	{
+		memcpy(destination, source, 8);
+	}
+	else
+	{
+		memcpy(destination, (const char *)source + 4, 4);
+		memcpy((char *)destination + 4, source, 4);
+	}
+}
+
 static bool memory_read8(const memory_interface_t * memory, arm_state_t * cpu, uint64_t address, uint8_t * result, arm_endianness_t endian, bool privileged_mode)
 {
-	return memory->read(cpu, address ^ (endian == ARM_ENDIAN_SWAPPED ? 3 : 0), result, 1, privileged_mode);
+	uint8_t * host = arm_memory_map(memory, cpu, address ^ (endian == ARM_ENDIAN_SWAPPED ? 3 : 0), false);
+	if(host != NULL)
+	{
+		*result = *host;
+		return true;
+	}
+	return memory->read(memory->data, cpu, address ^ (endian == ARM_ENDIAN_SWAPPED ? 3 : 0), result, 1, privileged_mode);
 }
 
 uint8_t a64_read8(arm_state_t * cpu, uint64_t address)
@@ -1109,7 +1367,10 @@ uint8_t arm_memory_read8_data(arm_state_t * cpu, uint64_t address)
 
 bool memory_read16(const memory_interface_t * memory, arm_state_t * cpu, uint64_t address, uint16_t * result, arm_endianness_t endian, bool privileged_mode)
 {
-	if(!memory_read_bytes16(memory, cpu, address, result, endian, privileged_mode))
+	uint8_t * host;
+	if((address & 1) == 0 && (host = arm_memory_map(memory, cpu, (uint32_t)address ^ (endian == ARM_ENDIAN_SWAPPED ? 2 : 0), false)) != NULL)
+		memcpy(result, host, 2);
+	else if(!memory_read_bytes16(memory, cpu, address, result, endian, privileged_mode))
 		return false;
 
 	switch(endian)
@@ -1175,7 +1436,10 @@ uint16_t arm_memory_read16_data(arm_state_t * cpu, uint64_t address)
 
 bool memory_read32(const memory_interface_t * memory, arm_state_t * cpu, uint64_t address, uint32_t * result, arm_endianness_t endian, bool privileged_mode)
 {
-	if(!memory_read_bytes32(memory, cpu, address, result, endian, privileged_mode))
+	uint8_t * host;
+	if((address & 3) == 0 && (host = arm_memory_map(memory, cpu, (uint32_t)address, false)) != NULL)
+		memcpy(result, host, 4);
+	else if(!memory_read_bytes32(memory, cpu, address, result, endian, privileged_mode))
 		return false;
 
 	switch(endian)
@@ -1241,7 +1505,10 @@ uint32_t arm_memory_read32_data(arm_state_t * cpu, uint64_t address)
 
 bool memory_read64(const memory_interface_t * memory, arm_state_t * cpu, uint64_t address, uint64_t * result, arm_endianness_t endian, bool privileged_mode)
 {
-	if(!memory_read_bytes64(memory, cpu, address, result, endian, privileged_mode))
+	uint8_t * host;
+	if((address & 7) == 0 && (host = arm_memory_map(memory, cpu, (uint32_t)address, false)) != NULL)
+		memory_copy_bytes64(result, host, endian);
+	else if(!memory_read_bytes64(memory, cpu, address, result, endian, privileged_mode))
 		return false;
 
 	switch(endian)
@@ -1307,7 +1574,21 @@ uint64_t arm_memory_read64_data(arm_state_t * cpu, uint64_t address)
 
 bool memory_write8(const memory_interface_t * memory, arm_state_t * cpu, uint64_t address, uint8_t value, arm_endianness_t endian, bool privileged_mode)
 {
-	return memory->write(cpu, address ^ (endian == ARM_ENDIAN_SWAPPED ? 3 : 0), &value, 1, privileged_mode);
+	bool success;
+	uint8_t * host = arm_memory_map(memory, cpu, address ^ (endian == ARM_ENDIAN_SWAPPED ? 3 : 0), true);
+	if(host != NULL)
+	{
+		*host = value;
+		success = true;
+	}
+	else
+	{
+		success = memory->write(memory->data, cpu, address ^ (endian == ARM_ENDIAN_SWAPPED ? 3 : 0), &value, 1, privileged_mode);
+	}
+	// only after the write, so that other processors cannot decode the previous contents again
+	if(cpu != NULL)
+		arm_decode_cache_invalidate(cpu, address, 1);
+	return success;
 }
 
 void a64_write8(arm_state_t * cpu, uint64_t address, uint8_t value)
@@ -1344,6 +1625,7 @@ void arm_memory_write8(const memory_interface_t * memory, uint64_t address, uint
 void arm_memory_write8_data(arm_state_t * cpu, uint64_t address, uint8_t value)
 {
 	memory_write8(cpu->memory, NULL, address, value, a32_get_data_endianness(cpu), arm_is_privileged_mode(cpu));
+	arm_decode_cache_invalidate(cpu, address, 1);
 }
 
 bool memory_write16(const memory_interface_t * memory, arm_state_t * cpu, uint64_t address, uint16_t value, arm_endianness_t endian, bool privileged_mode)
@@ -1359,7 +1641,21 @@ bool memory_write16(const memory_interface_t * memory, arm_state_t * cpu, uint64
 		value = htobe16(value);
 		break;
 	}
-	return memory_write_bytes16(memory, cpu, address, &value, endian, privileged_mode);
+
+	bool success;
+	uint8_t * host;
+	if((address & 1) == 0 && (host = arm_memory_map(memory, cpu, (uint32_t)address ^ (endian == ARM_ENDIAN_SWAPPED ? 2 : 0), true)) != NULL)
+	{
+		memcpy(host, &value, 2);
+		success = true;
+	}
+	else
+	{
+		success = memory_write_bytes16(memory, cpu, address, &value, endian, privileged_mode);
+	}
+	if(cpu != NULL)
+		arm_decode_cache_invalidate(cpu, address, 2);
+	return success;
 }
 
 void a64_write16(arm_state_t * cpu, uint64_t address, uint16_t value)
@@ -1396,6 +1692,7 @@ void arm_memory_write16(const memory_interface_t * memory, uint64_t address, uin
 void arm_memory_write16_data(arm_state_t * cpu, uint64_t address, uint16_t value)
 {
 	memory_write16(cpu->memory, NULL, address, value, a32_get_data_endianness(cpu), arm_is_privileged_mode(cpu));
+	arm_decode_cache_invalidate(cpu, address, 2);
 }
 
 bool memory_write32(const memory_interface_t * memory, arm_state_t * cpu, uint64_t address, uint32_t value, arm_endianness_t endian, bool privileged_mode)
@@ -1411,7 +1708,21 @@ bool memory_write32(const memory_interface_t * memory, arm_state_t * cpu, uint64
 		value = htobe32(value);
 		break;
 	}
-	return memory_write_bytes32(memory, cpu, address, &value, endian, privileged_mode);
+
+	bool success;
+	uint8_t * host;
+	if((address & 3) == 0 && (host = arm_memory_map(memory, cpu, (uint32_t)address, true)) != NULL)
+	{
+		memcpy(host, &value, 4);
+		success = true;
+	}
+	else
+	{
+		success = memory_write_bytes32(memory, cpu, address, &value, endian, privileged_mode);
+	}
+	if(cpu != NULL)
+		arm_decode_cache_invalidate(cpu, address, 4);
+	return success;
 }
 
 void a64_write32(arm_state_t * cpu, uint64_t address, uint32_t value)
@@ -1448,6 +1759,7 @@ void arm_memory_write32(const memory_interface_t * memory, uint64_t address, uin
 void arm_memory_write32_data(arm_state_t * cpu, uint64_t address, uint32_t value)
 {
 	memory_write32(cpu->memory, NULL, address, value, a32_get_data_endianness(cpu), arm_is_privileged_mode(cpu));
+	arm_decode_cache_invalidate(cpu, address, 4);
 }
 
 bool memory_write64(const memory_interface_t * memory, arm_state_t * cpu, uint64_t address, uint64_t value, arm_endianness_t endian, bool privileged_mode)
@@ -1463,7 +1775,21 @@ bool memory_write64(const memory_interface_t * memory, arm_state_t * cpu, uint64
 		value = htobe64(value);
 		break;
 	}
-	return memory_write_bytes64(memory, cpu, address, &value, endian, privileged_mode);
+
+	bool success;
+	uint8_t * host;
+	if((address & 7) == 0 && (host = arm_memory_map(memory, cpu, (uint32_t)address, true)) != NULL)
+	{
+		memory_copy_bytes64(host, &value, endian);
+		success = true;
+	}
+	else
+	{
+		success = memory_write_bytes64(memory, cpu, address, &value, endian, privileged_mode);
+	}
+	if(cpu != NULL)
+		arm_decode_cache_invalidate(cpu, address, 8);
+	return success;
 }
 
 void a64_write64(arm_state_t * cpu, uint64_t address, uint64_t value)
@@ -1500,6 +1826,279 @@ void arm_memory_write64(const memory_interface_t * memory, uint64_t address, uin
 void arm_memory_write64_data(arm_state_t * cpu, uint64_t address, uint64_t value)
 {
 	memory_write64(cpu->memory, NULL, address, value, a32_get_data_endianness(cpu), arm_is_privileged_mode(cpu));
+	arm_decode_cache_invalidate(cpu, address, 8);
+}
+
+/* Atomic accesses
+ * Naturally aligned values are compared and swapped directly in host memory with host atomic instructions
+ * Where the page cannot be mapped for writing, for example while writes are tracked, the memory interface provides the host address for each access
+ * Only interfaces without host addresses go through read and write while holding the lock of the global monitor
+ */
+
+// converts between a value and its representation in host memory, in either direction
+static inline uint64_t memory_host_order(uint64_t value, size_t size, arm_endianness_t endian)
+{
+	switch(size)
+	{
+	case 1:
+	default:
+		return value;
+	case 2:
+		return endian == ARM_ENDIAN_BIG ? htobe16(value) : htole16(value);
+	case 4:
+		return endian == ARM_ENDIAN_BIG ? htobe32(value) : htole32(value);
+	case 8:
+		// see memory_copy_bytes64
+		if(endian == ARM_ENDIAN_SWAPPED)
+			value = (value >> 32) | (value << 32);
+		return endian == ARM_ENDIAN_BIG ? htobe64(value) : htole64(value);
+	}
+}
+
+// the doubleword formed by two consecutive words, as read by memory_read64
+static inline uint64_t arm_pack_words(uint32_t first, uint32_t second, arm_endianness_t endian)
+{
+	if(endian == ARM_ENDIAN_LITTLE)
+		return first | ((uint64_t)second << 32);
+	else
+		return ((uint64_t)first << 32) | second;
+}
+
+static inline uint32_t arm_unpack_first_word(uint64_t value, arm_endianness_t endian)
+{
+	return endian == ARM_ENDIAN_LITTLE ? value : value >> 32;
+}
+
+static inline uint32_t arm_unpack_second_word(uint64_t value, arm_endianness_t endian)
+{
+	return endian == ARM_ENDIAN_LITTLE ? value >> 32 : value;
+}
+
+static bool memory_read_sized(arm_state_t * cpu, uint64_t address, size_t size, uint64_t * result, arm_endianness_t endian)
+{
+	bool privileged_mode = arm_is_privileged_mode(cpu);
+	bool success;
+	switch(size)
+	{
+	case 1:
+	default:
+		{
+			uint8_t value;
+			success = memory_read8(cpu->memory, cpu, address, &value, endian, privileged_mode);
+			*result = value;
+		}
+		break;
+	case 2:
+		{
+			uint16_t value;
+			success = memory_read16(cpu->memory, cpu, address, &value, endian, privileged_mode);
+			*result = value;
+		}
+		break;
+	case 4:
+		{
+			uint32_t value;
+			success = memory_read32(cpu->memory, cpu, address, &value, endian, privileged_mode);
+			*result = value;
+		}
+		break;
+	case 8:
+		success = memory_read64(cpu->memory, cpu, address, result, endian, privileged_mode);
+		break;
+	}
+	return success;
+}
+
+static bool memory_write_sized(arm_state_t * cpu, uint64_t address, size_t size, uint64_t value, arm_endianness_t endian)
+{
+	bool privileged_mode = arm_is_privileged_mode(cpu);
+	switch(size)
+	{
+	case 1:
+	default:
+		return memory_write8(cpu->memory, cpu, address, value, endian, privileged_mode);
+	case 2:
+		return memory_write16(cpu->memory, cpu, address, value, endian, privileged_mode);
+	case 4:
+		return memory_write32(cpu->memory, cpu, address, value, endian, privileged_mode);
+	case 8:
+		return memory_write64(cpu->memory, cpu, address, value, endian, privileged_mode);
+	}
+}
+
+// returns NULL if the atomic access must go through the memory interface
+static inline uint8_t * arm_memory_map_atomic(arm_state_t * cpu, uint64_t address, size_t size)
+{
+	uint8_t * host = arm_memory_map(cpu->memory, cpu, address, true);
+	if(host == NULL && cpu->memory->map_atomic != NULL)
+		host = cpu->memory->map_atomic(cpu->memory->data, cpu, address, size);
+	return host;
+}
+
+static inline void arm_global_monitor_lock(arm_state_t * cpu)
+{
+	if(cpu->global_monitor != NULL)
+		pthread_mutex_lock(&cpu->global_monitor->lock);
+}
+
+static inline void arm_global_monitor_unlock(arm_state_t * cpu)
+{
+	if(cpu->global_monitor != NULL)
+		pthread_mutex_unlock(&cpu->global_monitor->lock);
+}
+
+// stores desired at the naturally aligned address if it holds *expected, otherwise places the value found into *expected and returns false
+static bool memory_compare_exchange(arm_state_t * cpu, uint64_t address, size_t size, uint64_t * expected, uint64_t desired, arm_endianness_t endian)
+{
+	uint8_t * host = arm_memory_map_atomic(cpu, endian == ARM_ENDIAN_SWAPPED && size < 4 ? address ^ (4 - size) : address, size);
+	if(host != NULL)
+	{
+		uint64_t current = memory_host_order(*expected, size, endian);
+		desired = memory_host_order(desired, size, endian);
+		bool success;
+		switch(size)
+		{
+		case 1:
+		default:
+			{
+				uint8_t value = current;
+				success = __atomic_compare_exchange_n(host, &value, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+				current = value;
+			}
+			break;
+		case 2:
+			{
+				uint16_t value = current;
+				success = __atomic_compare_exchange_n((uint16_t *)host, &value, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+				current = value;
+			}
+			break;
+		case 4:
+			{
+				uint32_t value = current;
+				success = __atomic_compare_exchange_n((uint32_t *)host, &value, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+				current = value;
+			}
+			break;
+		case 8:
+			success = __atomic_compare_exchange_n((uint64_t *)host, &current, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+			break;
+		}
+		if(success)
+			arm_decode_cache_invalidate(cpu, address, size);
+		*expected = memory_host_order(current, size, endian);
+		return success;
+	}
+
+	uint64_t current;
+	arm_global_monitor_lock(cpu);
+	bool accessible = memory_read_sized(cpu, address, size, &current, endian);
+	bool success = accessible && current == *expected;
+	if(success)
+		accessible = memory_write_sized(cpu, address, size, desired, endian);
+	arm_global_monitor_unlock(cpu);
+	if(!accessible)
+		arm_data_abort(cpu);
+	*expected = current;
+	return success;
+}
+
+// same for a pair of doublewords, if the host cannot exchange them at once, these are only atomic with respect to other pairs
+static bool memory_compare_exchange_pair(arm_state_t * cpu, uint64_t address, uint64_t expected[2], const uint64_t desired[2], arm_endianness_t endian)
+{
+#ifdef __SIZEOF_INT128__
+	uint8_t * host = (address & 15) == 0 ? arm_memory_map_atomic(cpu, address, 16) : NULL;
+	if(host != NULL && ((uintptr_t)host & 15) == 0)
+	{
+		// the doublewords are placed in memory order, so the layout does not depend on the byte order of the host
+		uint64_t words[2] = { memory_host_order(expected[0], 8, endian), memory_host_order(expected[1], 8, endian) };
+		unsigned __int128 current_pair, desired_pair;
+		memcpy(&current_pair, words, 16);
+		words[0] = memory_host_order(desired[0], 8, endian);
+		words[1] = memory_host_order(desired[1], 8, endian);
+		memcpy(&desired_pair, words, 16);
+		bool success = __atomic_compare_exchange((unsigned __int128 *)host, &current_pair, &desired_pair, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+		if(success)
+			arm_decode_cache_invalidate(cpu, address, 16);
+		memcpy(words, &current_pair, 16);
+		expected[0] = memory_host_order(words[0], 8, endian);
+		expected[1] = memory_host_order(words[1], 8, endian);
+		return success;
+	}
+#endif
+
+	uint64_t current[2];
+	arm_global_monitor_lock(cpu);
+	bool accessible = memory_read_sized(cpu, address, 8, &current[0], endian) && memory_read_sized(cpu, address + 8, 8, &current[1], endian);
+	bool success = accessible && current[0] == expected[0] && current[1] == expected[1];
+	if(success)
+		accessible = memory_write_sized(cpu, address, 8, desired[0], endian) && memory_write_sized(cpu, address + 8, 8, desired[1], endian);
+	arm_global_monitor_unlock(cpu);
+	if(!accessible)
+		arm_data_abort(cpu);
+	expected[0] = current[0];
+	expected[1] = current[1];
+	return success;
+}
+
+// the order follows the opc field of the A64 atomic memory operations
+typedef enum arm_atomic_operation_t
+{
+	ARM_ATOMIC_ADD,
+	ARM_ATOMIC_CLEAR,
+	ARM_ATOMIC_XOR,
+	ARM_ATOMIC_SET,
+	ARM_ATOMIC_SMAX,
+	ARM_ATOMIC_SMIN,
+	ARM_ATOMIC_UMAX,
+	ARM_ATOMIC_UMIN,
+	ARM_ATOMIC_SWAP,
+} arm_atomic_operation_t;
+
+// atomically combines the value at the naturally aligned address with operand, returns the previous value
+static uint64_t memory_atomic(arm_state_t * cpu, uint64_t address, size_t size, arm_atomic_operation_t operation, uint64_t operand, arm_endianness_t endian)
+{
+	uint64_t mask = size == 8 ? (uint64_t)-1 : ((uint64_t)1 << (8 * size)) - 1;
+	size_t bits = 8 * size;
+	// the first attempt only fetches the current value, unless it happens to be 0
+	uint64_t current = 0;
+	for(;;)
+	{
+		uint64_t value;
+		switch(operation)
+		{
+		case ARM_ATOMIC_ADD:
+			value = current + operand;
+			break;
+		case ARM_ATOMIC_CLEAR:
+			value = current & ~operand;
+			break;
+		case ARM_ATOMIC_XOR:
+			value = current ^ operand;
+			break;
+		case ARM_ATOMIC_SET:
+			value = current | operand;
+			break;
+		case ARM_ATOMIC_SMAX:
+			value = sign_extend64(bits, current) > sign_extend64(bits, operand) ? current : operand;
+			break;
+		case ARM_ATOMIC_SMIN:
+			value = sign_extend64(bits, current) < sign_extend64(bits, operand) ? current : operand;
+			break;
+		case ARM_ATOMIC_UMAX:
+			value = (current & mask) > (operand & mask) ? current : operand;
+			break;
+		case ARM_ATOMIC_UMIN:
+			value = (current & mask) < (operand & mask) ? current : operand;
+			break;
+		case ARM_ATOMIC_SWAP:
+		default:
+			value = operand;
+			break;
+		}
+		if(memory_compare_exchange(cpu, address, size, &current, value & mask, endian))
+			return current;
+	}
 }
 
 static inline void j32_break(arm_state_t * cpu, uint32_t index);
@@ -1508,7 +2107,7 @@ static inline void j32_break(arm_state_t * cpu, uint32_t index);
 static inline uint32_t a32_fetch32(arm_state_t * cpu)
 {
 	uint32_t value;
-	if(!memory_read32(cpu->memory, cpu, cpu->r[PC] & ~3, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu)))
+	if(!memory_read32(&cpu->fetch_memory, cpu, cpu->r[PC] & ~3, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu)))
 		arm_prefetch_abort(cpu);
 	cpu->r[PC] += 4;
 	if(cpu->pstate.rw == PSTATE_RW_26)
@@ -1523,7 +2122,7 @@ static inline int32_t a64_fetch32(arm_state_t * cpu)
 	if((cpu->r[PC] & 3) != 0)
 		arm_unaligned_pc(cpu);
 	uint32_t value;
-	if(!memory_read32(cpu->memory, cpu, cpu->r[PC], &value, ARM_ENDIAN_LITTLE, arm_is_privileged_mode(cpu)))
+	if(!memory_read32(&cpu->fetch_memory, cpu, cpu->r[PC], &value, ARM_ENDIAN_LITTLE, arm_is_privileged_mode(cpu)))
 		arm_prefetch_abort(cpu);
 	cpu->r[PC] += 4;
 	return value;
@@ -1533,7 +2132,7 @@ static inline int32_t a64_fetch32(arm_state_t * cpu)
 static inline uint16_t a32_fetch16(arm_state_t * cpu)
 {
 	uint16_t value;
-	if(!memory_read16(cpu->memory, cpu, cpu->r[PC] & ~1, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu)))
+	if(!memory_read16(&cpu->fetch_memory, cpu, cpu->r[PC] & ~1, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu)))
 		arm_prefetch_abort(cpu);
 	cpu->r[PC] += 2;
 	return value;
@@ -1544,7 +2143,7 @@ static inline int8_t j32_fetch8(arm_state_t * cpu)
 {
 	uint64_t pc = cpu->r[PC];
 	uint8_t value;
-	if(!memory_read8(cpu->memory, cpu, pc, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu)))
+	if(!memory_read8(&cpu->fetch_memory, cpu, pc, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu)))
 		j32_break(cpu, J32_EXCEPTION_PREFETCH_ABORT);
 	cpu->r[PC] = pc + 1;
 	return value;
@@ -1554,7 +2153,7 @@ static inline int16_t j32_fetch16(arm_state_t * cpu)
 {
 	uint64_t pc = cpu->r[PC];
 	uint16_t value;
-	if(!memory_read16(cpu->memory, cpu, pc, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu)))
+	if(!memory_read16(&cpu->fetch_memory, cpu, pc, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu)))
 		j32_break(cpu, J32_EXCEPTION_PREFETCH_ABORT);
 	cpu->r[PC] = pc + 2;
 	if(a32_get_instruction_endianness(cpu) == ARM_ENDIAN_LITTLE)
@@ -1568,7 +2167,7 @@ static inline int32_t j32_fetch32(arm_state_t * cpu)
 {
 	uint64_t pc = cpu->r[PC];
 	uint32_t value;
-	if(!memory_read32(cpu->memory, cpu, pc, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu)))
+	if(!memory_read32(&cpu->fetch_memory, cpu, pc, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu)))
 		j32_break(cpu, J32_EXCEPTION_PREFETCH_ABORT);
 	cpu->r[PC] = pc + 4;
 	if(a32_get_instruction_endianness(cpu) == ARM_ENDIAN_LITTLE)
@@ -1580,7 +2179,7 @@ static inline int32_t j32_fetch32(arm_state_t * cpu)
 static inline int32_t j32_fetch32_from(arm_state_t * cpu, uint32_t offset)
 {
 	uint32_t value;
-	if(!memory_read32(cpu->memory, cpu, offset, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu)))
+	if(!memory_read32(&cpu->fetch_memory, cpu, offset, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu)))
 		j32_break(cpu, J32_EXCEPTION_PREFETCH_ABORT);
 	if(a32_get_instruction_endianness(cpu) == ARM_ENDIAN_LITTLE)
 		return bswap_16(value);
@@ -1592,21 +2191,21 @@ static inline int32_t j32_fetch32_from(arm_state_t * cpu, uint32_t offset)
 uint8_t arm_fetch8(arm_state_t * cpu, uint64_t address)
 {
 	uint8_t value;
-	memory_read8(cpu->memory, cpu, address, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu));
+	memory_read8(&cpu->fetch_memory, cpu, address, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu));
 	return value;
 }
 
 uint16_t arm_fetch16(arm_state_t * cpu, uint64_t address)
 {
 	uint16_t value;
-	memory_read16(cpu->memory, cpu, address, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu));
+	memory_read16(&cpu->fetch_memory, cpu, address, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu));
 	return value;
 }
 
 uint16_t arm_fetch16be(arm_state_t * cpu, uint64_t address)
 {
 	uint16_t value;
-	memory_read16(cpu->memory, cpu, address, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu));
+	memory_read16(&cpu->fetch_memory, cpu, address, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu));
 	if(a32_get_instruction_endianness(cpu) == ARM_ENDIAN_LITTLE)
 		return bswap_16(value);
 	else
@@ -1617,14 +2216,14 @@ uint16_t arm_fetch16be(arm_state_t * cpu, uint64_t address)
 uint32_t arm_fetch32(arm_state_t * cpu, uint64_t address)
 {
 	uint32_t value;
-	memory_read32(cpu->memory, cpu, address, &value, arm_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu));
+	memory_read32(&cpu->fetch_memory, cpu, address, &value, arm_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu));
 	return value;
 }
 
 int32_t arm_fetch32be(arm_state_t * cpu, uint32_t offset)
 {
 	uint32_t value;
-	memory_read32(cpu->memory, cpu, offset, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu));
+	memory_read32(&cpu->fetch_memory, cpu, offset, &value, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu));
 	if(a32_get_instruction_endianness(cpu) == ARM_ENDIAN_LITTLE)
 		return bswap_16(value);
 	else
@@ -2138,50 +2737,59 @@ uint32_t a64_ubfm32(uint32_t op, uint8_t immr, uint8_t imms)
 
 static inline bool a32_check_condition(arm_state_t * cpu, int code)
 {
+	if((code & 0xF) == 0xE)
+		return true; // al, most instructions
+
+	// the flags are not stored, they are likely to be overwritten before the next check
+	uint8_t nzcv = arm_get_nzcv(cpu);
+	bool n = (nzcv >> 3) & 1;
+	bool z = (nzcv >> 2) & 1;
+	bool c = (nzcv >> 1) & 1;
+	bool v = nzcv & 1;
 	switch(code & 0xF)
 	{
 	case 0x0:
 		/* eq */
-		return cpu->pstate.z != 0;
+		return z != 0;
 	case 0x1:
 		/* ne */
-		return cpu->pstate.z == 0;
+		return z == 0;
 	case 0x2:
 		/* cs */
-		return cpu->pstate.c != 0;
+		return c != 0;
 	case 0x3:
 		/* cc */
-		return cpu->pstate.c == 0;
+		return c == 0;
 	case 0x4:
 		/* mi */
-		return cpu->pstate.n != 0;
+		return n != 0;
 	case 0x5:
 		/* pl */
-		return cpu->pstate.n == 0;
+		return n == 0;
 	case 0x6:
 		/* vs */
-		return cpu->pstate.v != 0;
+		return v != 0;
 	case 0x7:
 		/* vc */
-		return cpu->pstate.v == 0;
+		return v == 0;
 	case 0x8:
 		/* hi */
-		return cpu->pstate.c != 0 && cpu->pstate.z == 0;
+		return c != 0 && z == 0;
 	case 0x9:
 		/* ls */
-		return cpu->pstate.c == 0 || cpu->pstate.z != 0;
+		return c == 0 || z != 0;
 	case 0xA:
 		/* ge */
-		return (cpu->pstate.n == 0) == (cpu->pstate.v == 0);
+		return (n == 0) == (v == 0);
 	case 0xB:
 		/* lt */
-		return (cpu->pstate.n == 0) != (cpu->pstate.v == 0);
+		return (n == 0) != (v == 0);
 	case 0xC:
 		/* gt */
-		return ((cpu->pstate.n == 0) == (cpu->pstate.v == 0)) && cpu->pstate.z != 0;
+		return ((n == 0) == (v == 0)) && z != 0;
 	case 0xD:
 		/* le */
-		return ((cpu->pstate.n == 0) != (cpu->pstate.v == 0)) || cpu->pstate.z == 0;
+		return ((n == 0) != (v == 0)) || z == 0;
 	case 0xE:
 		/* al */
 		return true;
@@ -2218,40 +2826,580 @@ static inline bool t32_in_it_block(arm_state_t * cpu)
 	return (itstate & 0xF) != 0;
 }
 
-static inline bool t32_last_in_it_block(arm_state_t * cpu)
-{
-	uint8_t itstate = t32_get_it_state(cpu);
-	return (itstate & 0xF) == 0x8;
-}
+static inline bool t32_last_in_it_block(arm_state_t * cpu)
+{
+	uint8_t itstate = t32_get_it_state(cpu);
+	return (itstate & 0xF) == 0x8;
+}
+
+static inline void t32_advance_it(arm_state_t * cpu)
+{
+	if(!t32_in_it_block(cpu))
+		return;
+
+	uint8_t itstate = t32_get_it_state(cpu);
+
+	if((itstate & 0x07) == 0)
+		itstate = 0;
+	else
+		itstate = (itstate & 0xE0) | ((itstate << 1) & 0x1F);
+
+	t32_set_it_state(cpu, itstate);
+}
+
+static inline bool t32_check_condition(arm_state_t * cpu)
+{
+	if(!t32_in_it_block(cpu))
+		return true;
+
+	uint8_t itstate = t32_get_it_state(cpu);
+
+	bool condition = a32_check_condition(cpu, (itstate & 0xE0) >> 4);
+
+	if((itstate & 0x10))
+		condition = !condition;
+
+	return condition;
+}
+
+/*
+ * Decoded instruction cache
+ *
+ * Each instruction is fetched and decoded once, later executions at the same address only look up the opcode and the index returned by the decoder
+ * Apart from the configuration (which does not change), the decoders depend on the instruction set, the instruction byte order and the IT block state,
+ * so these are stored in the tag of the entry
+ * Entries are invalidated when memory overlapping them is written
+ */
+
+enum
+{
+	ARM_DECODE_CACHE_EMPTY = 0,
+	ARM_DECODE_CACHE_A26,
+	ARM_DECODE_CACHE_A32,
+	ARM_DECODE_CACHE_T32,
+	ARM_DECODE_CACHE_T32EE,
+	ARM_DECODE_CACHE_A64,
+	ARM_DECODE_CACHE_ISA_MASK = 0x07,
+
+	ARM_DECODE_CACHE_SWAPPED = 0x08, // BE32 instruction fetch
+	ARM_DECODE_CACHE_IN_IT_BLOCK = 0x10,
+	ARM_DECODE_CACHE_LAST_IN_IT_BLOCK = 0x20,
+};
+
+static inline arm_decode_cache_entry_t * arm_decode_cache_get_entry(arm_state_t * cpu, uint64_t pc)
+{
+	return &cpu->decode_cache[(pc >> 1) & (ARM_DECODE_CACHE_SIZE - 1)];
+}
+
+static inline bool arm_decode_cache_lookup(arm_state_t * cpu, arm_decode_cache_entry_t * entry, uint64_t pc, uint8_t tag)
+{
+	if(entry->tag == tag && entry->pc == pc)
+	{
+		cpu->decode_cache_hits ++;
+		return true;
+	}
+	else
+	{
+		cpu->decode_cache_misses ++;
+		return false;
+	}
+}
+
+void arm_decode_cache_flush(arm_state_t * cpu)
+{
+	for(size_t index = 0; index < ARM_DECODE_CACHE_SIZE; index++)
+		cpu->decode_cache[index].tag = ARM_DECODE_CACHE_EMPTY;
+	memset(cpu->decoded_pages, 0, sizeof cpu->decoded_pages);
+	arm_block_cache_flush(cpu);
+}
+
+// marks the pages of a newly decoded instruction
+static inline void arm_decoded_page_mark(arm_state_t * cpu, uint64_t pc, uint64_t length)
+{
+	for(uint64_t page = pc / ARM_CODE_PAGE_SIZE; page <= (pc + length - 1) / ARM_CODE_PAGE_SIZE; page++)
+	{
+		size_t index = page & (ARM_DECODED_PAGE_COUNT - 1);
+		cpu->decoded_pages[index >> 6] |= (uint64_t)1 << (index & 63);
+	}
+}
+
+// the range might wrap around the end of the address space
+static inline bool arm_decoded_page_test(arm_state_t * cpu, uint64_t start, uint64_t end)
+{
+	uint64_t first = start / ARM_CODE_PAGE_SIZE;
+	uint64_t count = (((end - 1) / ARM_CODE_PAGE_SIZE - first) & (UINT64_MAX / ARM_CODE_PAGE_SIZE)) + 1;
+	if(count >= ARM_DECODED_PAGE_COUNT)
+		return true;
+	for(uint64_t page = first; page != first + count; page++)
+	{
+		size_t index = page & (ARM_DECODED_PAGE_COUNT - 1);
+		if((cpu->decoded_pages[index >> 6] & ((uint64_t)1 << (index & 63))))
+			return true;
+	}
+	return false;
+}
+
+void arm_block_cache_flush(arm_state_t * cpu)
+{
+	for(size_t index = 0; index < ARM_BLOCK_CACHE_SIZE; index++)
+		cpu->block_cache[index].tag = ARM_DECODE_CACHE_EMPTY;
+	memset(cpu->code_pages, 0, sizeof cpu->code_pages);
+	// native code is only reachable through the blocks, so the buffer can be reused
+	cpu->jit.used = 0;
+}
+
+/*
+ * Code pages
+ *
+ * Every translated block lies within a single page, and the words it was decoded from are marked in the entry for the page
+ * A write only has to look up the entry for its page, and blocks are only discarded if it overlaps a marked word
+ * Marks are only cleared when the blocks of a page are searched, so they might still cover blocks that have since been replaced
+ */
+
+#define ARM_CODE_PAGE_MASK ((uint64_t)ARM_CODE_PAGE_SIZE - 1)
+
+static inline arm_code_page_t * arm_code_page_get_entry(arm_state_t * cpu, uint64_t address)
+{
+	return &cpu->code_pages[(address / ARM_CODE_PAGE_SIZE) & (ARM_CODE_PAGE_COUNT - 1)];
+}
+
+// the range must be within the page
+static inline void arm_code_page_mark(arm_code_page_t * page, uint64_t address, uint64_t size)
+{
+	for(uint64_t word = (address & ARM_CODE_PAGE_MASK) >> 2; word <= ((address + size - 1) & ARM_CODE_PAGE_MASK) >> 2; word++)
+		page->words[word >> 5] |= (uint32_t)1 << (word & 31);
+}
+
+// the range must be within the page
+static inline bool arm_code_page_test(arm_code_page_t * page, uint64_t address, uint64_t size)
+{
+	for(uint64_t word = (address & ARM_CODE_PAGE_MASK) >> 2; word <= ((address + size - 1) & ARM_CODE_PAGE_MASK) >> 2; word++)
+	{
+		if((page->words[word >> 5] & ((uint32_t)1 << (word & 31))))
+			return true;
+	}
+	return false;
+}
+
+static void arm_block_invalidate(arm_state_t * cpu, arm_block_t * block)
+{
+	arm_code_page_t * page = arm_code_page_get_entry(cpu, block->pc);
+	if(--page->block_count == 0)
+		memset(page->words, 0, sizeof page->words);
+	block->tag = ARM_DECODE_CACHE_EMPTY;
+}
+
+// discards the blocks of the page that overlap the range (which must be within the page), then marks the words of the remaining ones again
+static void arm_code_page_invalidate(arm_state_t * cpu, arm_code_page_t * page, uint64_t start, uint64_t end)
+{
+	memset(page->words, 0, sizeof page->words);
+	for(size_t index = 0; index < ARM_BLOCK_CACHE_SIZE && page->block_count != 0; index++)
+	{
+		arm_block_t * block = &cpu->block_cache[index];
+		if(block->tag == ARM_DECODE_CACHE_EMPTY || (block->pc & ~ARM_CODE_PAGE_MASK) != page->address)
+			continue;
+		if(block->pc < end && block->pc + block->length > start)
+			arm_block_invalidate(cpu, block);
+		else
+			arm_code_page_mark(page, block->pc, block->length);
+	}
+}
+
+// the range is rounded to full words, since BE32 swaps bytes within a word
+static void arm_block_cache_invalidate(arm_state_t * cpu, uint64_t address, uint64_t size)
+{
+	uint64_t start = address & ~(uint64_t)3;
+	uint64_t end = (address + size + 3) & ~(uint64_t)3;
+	if(end - start <= ARM_CODE_PAGE_SIZE)
+	{
+		// at most two pages
+		for(uint64_t page_address = start & ~ARM_CODE_PAGE_MASK; page_address < end; page_address += ARM_CODE_PAGE_SIZE)
+		{
+			uint64_t page_start = MAX(start, page_address);
+			uint64_t page_end = MIN(end, page_address + ARM_CODE_PAGE_SIZE);
+			arm_code_page_t * page = arm_code_page_get_entry(cpu, page_address);
+			if(page->block_count != 0 && page->address == page_address && arm_code_page_test(page, page_start, page_end - page_start))
+				arm_code_page_invalidate(cpu, page, page_start, page_end);
+		}
+	}
+	else
+	{
+		for(size_t index = 0; index < ARM_CODE_PAGE_COUNT; index++)
+		{
+			arm_code_page_t * page = &cpu->code_pages[index];
+			if(page->block_count != 0 && page->address < end && page->address + ARM_CODE_PAGE_SIZE > start)
+				arm_code_page_invalidate(cpu, page, MAX(start, page->address), MIN(end, page->address + ARM_CODE_PAGE_SIZE));
+		}
+	}
+}
+
+static void arm_decode_cache_invalidate_local(arm_state_t * cpu, uint64_t address, uint64_t size)
+{
+	arm_block_cache_invalidate(cpu, address, size);
+
+	if(size >= 2 * ARM_DECODE_CACHE_SIZE)
+	{
+		arm_decode_cache_flush(cpu);
+		return;
+	}
+
+	// instructions are at most 4 bytes long and 2 byte aligned, the range is extended to full words since BE32 swaps bytes within a word
+	uint64_t start = (address & ~(uint64_t)3) - 2;
+	uint64_t end = (address + size + 3) & ~(uint64_t)3;
+	// ordinary data writes end here
+	if(!arm_decoded_page_test(cpu, start, end))
+		return;
+
+	for(uint64_t pc = start; pc != end; pc += 2)
+	{
+		arm_decode_cache_entry_t * entry = arm_decode_cache_get_entry(cpu, pc);
+		if(entry->pc == pc)
+			entry->tag = ARM_DECODE_CACHE_EMPTY;
+	}
+}
+
+void arm_decode_cache_invalidate(arm_state_t * cpu, uint64_t address, uint64_t size)
+{
+	if(size == 0)
+		return;
+	arm_decode_cache_invalidate_local(cpu, address, size);
+	if(cpu->global_monitor != NULL && arm_shared_code_test(cpu->global_monitor, address, size))
+		arm_shared_code_invalidate(cpu, address, size);
+}
+
+// discards the instructions written by other CPUs since the last call
+static inline void arm_process_pending_invalidations(arm_state_t * cpu)
+{
+	if(!__atomic_load_n(&cpu->invalidation_pending, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&cpu->global_monitor->cpu_lock);
+	if(cpu->pending_invalidation_count > ARM_PENDING_INVALIDATION_COUNT)
+	{
+		arm_decode_cache_flush(cpu);
+	}
+	else
+	{
+		for(int index = 0; index < cpu->pending_invalidation_count; index++)
+			arm_decode_cache_invalidate_local(cpu, cpu->pending_invalidations[index].address, cpu->pending_invalidations[index].size);
+	}
+	cpu->pending_invalidation_count = 0;
+	cpu->invalidation_pending = false;
+	pthread_mutex_unlock(&cpu->global_monitor->cpu_lock);
+}
+
+// ARM26, ARM32
+static inline uint16_t a32_fetch_decoded(arm_state_t * cpu, uint32_t * opcode)
+{
+	uint64_t pc = cpu->r[PC] & ~3;
+	uint8_t tag = cpu->pstate.rw == PSTATE_RW_26 ? ARM_DECODE_CACHE_A26 : ARM_DECODE_CACHE_A32;
+	if((cpu->sctlr_el1 & SCTLR_B))
+		tag |= ARM_DECODE_CACHE_SWAPPED;
+
+	arm_decode_cache_entry_t * entry = arm_decode_cache_get_entry(cpu, pc);
+	if(arm_decode_cache_lookup(cpu, entry, pc, tag))
+	{
+		cpu->r[PC] += 4;
+		if(cpu->pstate.rw == PSTATE_RW_26)
+			cpu->r[PC] &= 0x03FFFFFF;
+		*opcode = entry->opcode;
+		return entry->index;
+	}
+
+	arm_shared_code_mark(cpu, pc, 4);
+	*opcode = a32_fetch32(cpu);
+	entry->pc = pc;
+	entry->opcode = *opcode;
+	entry->index = cpu->a32_decode(cpu, *opcode);
+	entry->tag = tag;
+	entry->length = 4;
+	arm_decoded_page_mark(cpu, pc, 4);
+	return entry->index;
+}
+
+// ARM64
+static inline uint16_t a64_fetch_decoded(arm_state_t * cpu, uint32_t * opcode)
+{
+	uint64_t pc = cpu->r[PC];
+	uint8_t tag = ARM_DECODE_CACHE_A64;
+
+	arm_decode_cache_entry_t * entry = arm_decode_cache_get_entry(cpu, pc);
+	if(arm_decode_cache_lookup(cpu, entry, pc, tag))
+	{
+		cpu->r[PC] += 4;
+		*opcode = entry->opcode;
+		return entry->index;
+	}
+
+	arm_shared_code_mark(cpu, pc, 4);
+	*opcode = a64_fetch32(cpu);
+	entry->pc = pc;
+	entry->opcode = *opcode;
+	entry->index = cpu->a64_decode(cpu, *opcode);
+	entry->tag = tag;
+	entry->length = 4;
+	arm_decoded_page_mark(cpu, pc, 4);
+	return entry->index;
+}
+
+static inline bool t32_is_32bit_instruction(arm_state_t * cpu, uint16_t opcode1)
+{
+	return ((cpu->config.features & (1 << FEATURE_THUMB2)) || ((cpu->config.features & FEATURE_PROFILE_MASK) == ARM_PROFILE_M))
+		&& ((opcode1 & 0xF800) == 0xE800 || (opcode1 & 0xF800) == 0xF000 || (opcode1 & 0xF800) == 0xF800);
+}
+
+// for Thumb and ThumbEE, returns true for 32-bit instructions
+static inline bool t32_fetch_decoded(arm_state_t * cpu, uint16_t * opcode1, uint16_t * opcode2, uint16_t * index)
+{
+	uint64_t pc = cpu->r[PC] & ~1;
+	uint8_t tag = t32_is_thumbee(cpu) ? ARM_DECODE_CACHE_T32EE : ARM_DECODE_CACHE_T32;
+	if((cpu->sctlr_el1 & SCTLR_B))
+		tag |= ARM_DECODE_CACHE_SWAPPED;
+	if(t32_in_it_block(cpu))
+		tag |= ARM_DECODE_CACHE_IN_IT_BLOCK;
+	if(t32_last_in_it_block(cpu))
+		tag |= ARM_DECODE_CACHE_LAST_IN_IT_BLOCK;
+
+	arm_decode_cache_entry_t * entry = arm_decode_cache_get_entry(cpu, pc);
+	if(arm_decode_cache_lookup(cpu, entry, pc, tag))
+	{
+		cpu->r[PC] += entry->length;
+		*opcode1 = entry->opcode >> 16;
+		*opcode2 = entry->opcode;
+		*index = entry->index;
+		return entry->length == 4;
+	}
+
+	arm_shared_code_mark(cpu, pc, 4);
+	*opcode1 = a32_fetch16(cpu);
+	if(t32_is_32bit_instruction(cpu, *opcode1))
+	{
+		*opcode2 = a32_fetch16(cpu);
+		*index = cpu->t32_decode(cpu, *opcode1, *opcode2);
+		entry->length = 4;
+	}
+	else
+	{
+		*opcode2 = 0;
+		*index = cpu->t16_decode(cpu, *opcode1);
+		entry->length = 2;
+	}
+	entry->pc = pc;
+	entry->opcode = ((uint32_t)*opcode1 << 16) | *opcode2;
+	entry->index = *index;
+	entry->tag = tag;
+	arm_decoded_page_mark(cpu, pc, entry->length);
+	return entry->length == 4;
+}
+
+/*
+ * Translated blocks
+ *
+ * A block holds the decoded instructions following its first address, up to ARM_BLOCK_MAX_LENGTH, the end of the page, the first one that cannot be fetched
+ * or the first one that might branch away
+ * Blocks are still left whenever an instruction does not continue at the next one (untaken branches, exceptions, change of state)
+ * Since a block is decoded in the state it was entered in, it can only be executed in the same state, which is checked before each instruction
+ */
+
+// the tag for the current state, or ARM_DECODE_CACHE_EMPTY if it cannot be executed in a block (Jazelle)
+static inline uint8_t arm_block_get_tag(arm_state_t * cpu)
+{
+	uint8_t tag;
+	switch(cpu->pstate.rw)
+	{
+	case PSTATE_RW_26:
+		tag = ARM_DECODE_CACHE_A26;
+		break;
+	case PSTATE_RW_32:
+		switch(cpu->pstate.jt)
+		{
+		case PSTATE_JT_ARM:
+			tag = ARM_DECODE_CACHE_A32;
+			break;
+		case PSTATE_JT_THUMB:
+		case PSTATE_JT_THUMBEE:
+			tag = t32_is_thumbee(cpu) ? ARM_DECODE_CACHE_T32EE : ARM_DECODE_CACHE_T32;
+			if(t32_in_it_block(cpu))
+				tag |= ARM_DECODE_CACHE_IN_IT_BLOCK;
+			if(t32_last_in_it_block(cpu))
+				tag |= ARM_DECODE_CACHE_LAST_IN_IT_BLOCK;
+			break;
+		default:
+			return ARM_DECODE_CACHE_EMPTY;
+		}
+		break;
+	case PSTATE_RW_64:
+		return ARM_DECODE_CACHE_A64;
+	default:
+		return ARM_DECODE_CACHE_EMPTY;
+	}
+	if((cpu->sctlr_el1 & SCTLR_B))
+		tag |= ARM_DECODE_CACHE_SWAPPED;
+	return tag;
+}
+
+static inline arm_block_t * arm_block_cache_get_entry(arm_state_t * cpu, uint64_t pc)
+{
+	return &cpu->block_cache[(pc >> 1) & (ARM_BLOCK_CACHE_SIZE - 1)];
+}
+
+// whether the instruction might write the PC, the block ends with it since the following ones are often not reached (false positives only make blocks shorter)
+static inline bool arm_block_is_last_instruction(uint8_t tag, uint32_t opcode, uint8_t length)
+{
+	switch(tag & ARM_DECODE_CACHE_ISA_MASK)
+	{
+	case ARM_DECODE_CACHE_A26:
+	case ARM_DECODE_CACHE_A32:
+		return (opcode & 0x0E000000) == 0x0A000000 // b, bl, blx (immediate)
+			|| (opcode & 0x0F000000) == 0x0F000000 // svc
+			|| (opcode & 0x0FFFFFC0) == 0x012FFF00 // bx, bxj, blx (register)
+			|| (opcode & 0x0E108000) == 0x08108000 // ldm including R15
+			|| (opcode & 0x0000F000) == 0x0000F000; // R15 as destination (or source for stores)
+	case ARM_DECODE_CACHE_T32:
+	case ARM_DECODE_CACHE_T32EE:
+		if(length == 2)
+		{
+			uint16_t opcode1 = opcode >> 16;
+			return (opcode1 & 0xF000) == 0xD000 // b{cond}, svc, udf
+				|| (opcode1 & 0xF800) == 0xE000 // b
+				|| (opcode1 & 0xFF00) == 0x4700 // bx, blx
+				|| (opcode1 & 0xFC87) == 0x4487 // add, cmp, mov with R15
+				|| (opcode1 & 0xFF00) == 0xBD00 // pop including R15
+				|| (opcode1 & 0xF500) == 0xB100 // cbz, cbnz
+				|| ((opcode1 & 0xFF00) == 0xBF00 && (opcode1 & 0x000F) != 0); // it, changes the state the following instructions are decoded in
+		}
+		else
+		{
+			return (opcode & 0xF8008000) == 0xF0008000 // branches and miscellaneous control
+				|| (opcode & 0xFE50A000) == 0xE810A000 // ldm including R15
+				|| (opcode & 0xFFF0FFE0) == 0xE8D0F000 // tbb, tbh
+				|| (opcode & 0xFE00F000) == 0xF800F000; // loads to R15
+		}
+	case ARM_DECODE_CACHE_A64:
+		return (opcode & 0x1C000000) == 0x14000000; // branches, exception generating and system instructions
+	default:
+		return true;
+	}
+}
+
+static arm_block_t * arm_block_translate(arm_state_t * cpu, arm_block_t * block, uint64_t pc, uint8_t tag)
+{
+	if(block->tag != ARM_DECODE_CACHE_EMPTY)
+		arm_block_invalidate(cpu, block);
+
+	uint64_t address = pc;
+	block->count = 0;
+	block->executions = 0;
+	block->native = NULL;
+	while(block->count < ARM_BLOCK_MAX_LENGTH)
+	{
+		uint32_t opcode;
+		uint16_t index;
+		uint8_t length;
+		arm_shared_code_mark(cpu, address, 4);
+		switch(tag & ARM_DECODE_CACHE_ISA_MASK)
+		{
+		case ARM_DECODE_CACHE_A26:
+		case ARM_DECODE_CACHE_A32:
+			if(!memory_read32(&cpu->fetch_memory, cpu, address, &opcode, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu)))
+				goto end_of_block;
+			index = cpu->a32_decode(cpu, opcode);
+			length = 4;
+			break;
+		case ARM_DECODE_CACHE_T32:
+		case ARM_DECODE_CACHE_T32EE:
+			{
+				uint16_t opcode1;
+				uint16_t opcode2 = 0;
+				if(!memory_read16(&cpu->fetch_memory, cpu, address, &opcode1, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu)))
+					goto end_of_block;
+				if(t32_is_32bit_instruction(cpu, opcode1))
+				{
+					// the second halfword must be in the same page
+					if(((address + 2) & ARM_CODE_PAGE_MASK) == 0
+					|| !memory_read16(&cpu->fetch_memory, cpu, address + 2, &opcode2, a32_get_instruction_endianness(cpu), arm_is_privileged_mode(cpu)))
+						goto end_of_block;
+					index = cpu->t32_decode(cpu, opcode1, opcode2);
+					length = 4;
+				}
+				else
+				{
+					index = cpu->t16_decode(cpu, opcode1);
+					length = 2;
+				}
+				opcode = ((uint32_t)opcode1 << 16) | opcode2;
+			}
+			break;
+		case ARM_DECODE_CACHE_A64:
+			if(!memory_read32(&cpu->fetch_memory, cpu, address, &opcode, ARM_ENDIAN_LITTLE, arm_is_privileged_mode(cpu)))
+				goto end_of_block;
+			index = cpu->a64_decode(cpu, opcode);
+			length = 4;
+			break;
+		default:
+			goto end_of_block;
+		}
+
+		block->instructions[block->count].opcode = opcode;
+		block->instructions[block->count].index = index;
+		block->instructions[block->count].length = length;
+		block->count ++;
+		address += length;
 
-static inline void t32_advance_it(arm_state_t * cpu)
-{
-	if(!t32_in_it_block(cpu))
-		return;
+		if(arm_block_is_last_instruction(tag, opcode, length) || (address & ARM_CODE_PAGE_MASK) == 0)
+			break;
+		if((tag & ARM_DECODE_CACHE_ISA_MASK) == ARM_DECODE_CACHE_A26 && address >= 0x04000000)
+			break;
+	}
+end_of_block:
 
-	uint8_t itstate = t32_get_it_state(cpu);
+	if(block->count == 0)
+		return NULL;
 
-	if((itstate & 0x07) == 0)
-		itstate = 0;
-	else
-		itstate = (itstate & 0xE0) | ((itstate << 1) & 0x1F);
+	arm_code_page_t * page = arm_code_page_get_entry(cpu, pc);
+	if(page->block_count != 0 && page->address != (pc & ~ARM_CODE_PAGE_MASK))
+	{
+		// the entry is taken by another page, its blocks can no longer be tracked
+		arm_code_page_invalidate(cpu, page, page->address, page->address + ARM_CODE_PAGE_SIZE);
+	}
+	page->address = pc & ~ARM_CODE_PAGE_MASK;
+	page->block_count ++;
 
-	t32_set_it_state(cpu, itstate);
+	block->pc = pc;
+	block->length = address - pc;
+	block->tag = tag;
+	arm_code_page_mark(page, pc, block->length);
+	return block;
 }
 
-static inline bool t32_check_condition(arm_state_t * cpu)
+// returns the block starting at the current instruction, or NULL if the instruction has to be stepped individually
+static inline arm_block_t * arm_block_fetch(arm_state_t * cpu, uint8_t tag)
 {
-	if(!t32_in_it_block(cpu))
-		return true;
-
-	uint8_t itstate = t32_get_it_state(cpu);
-
-	bool condition = a32_check_condition(cpu, (itstate & 0xE0) >> 4);
+	uint64_t pc = cpu->r[PC];
+	switch(tag & ARM_DECODE_CACHE_ISA_MASK)
+	{
+	case ARM_DECODE_CACHE_EMPTY:
+		return NULL;
+	case ARM_DECODE_CACHE_T32:
+	case ARM_DECODE_CACHE_T32EE:
+		if((pc & 1))
+			return NULL;
+		break;
+	default:
+		if((pc & 3))
+			return NULL;
+		break;
+	}
 
-	if((itstate & 0x10))
-		condition = !condition;
+	arm_block_t * block = arm_block_cache_get_entry(cpu, pc);
+	if(block->tag == tag && block->pc == pc)
+	{
+		cpu->block_cache_hits ++;
+		return block;
+	}
 
-	return condition;
+	cpu->block_cache_misses ++;
+	return arm_block_translate(cpu, block, pc, tag);
 }
 
 static inline _Noreturn void arm_break_emulation(arm_state_t * cpu, arm_emu_result_t result)
@@ -2740,7 +3888,7 @@ uint32_t a32_lsl32(arm_state_t * cpu, uint32_t value, uint32_t amount, bool stor
 	if(amount == 0)
 		return value;
 	if(store_carry)
-		cpu->pstate.c = amount <= 32 ? (value >> (32 - amount)) & 1 : 0;
+		arm_set_carry(cpu, amount <= 32 ? (value >> (32 - amount)) & 1 : 0);
 	return amount < 32 ? value << amount : 0;
 }
 
@@ -2749,7 +3897,7 @@ uint32_t a32_lsr32(arm_state_t * cpu, uint32_t value, uint32_t amount, bool stor
 	if(amount == 0)
 		return value;
 	if(store_carry)
-		cpu->pstate.c = amount <= 32 ? (value >> (amount - 1)) & 1 : 0;
+		arm_set_carry(cpu, amount <= 32 ? (value >> (amount - 1)) & 1 : 0);
 	return amount < 32 ? value >> amount : 0;
 }
 
@@ -2758,7 +3906,7 @@ uint32_t a32_asr32(arm_state_t * cpu, uint32_t value, uint32_t amount, bool stor
 	if(amount == 0)
 		return value;
 	if(store_carry)
-		cpu->pstate.c = (amount <= 32 ? value >> (amount - 1) : value >> 31) & 1;
+		arm_set_carry(cpu, (amount <= 32 ? value >> (amount - 1) : value >> 31) & 1);
 	return amount < 32 ? (int32_t)value >> amount : (int32_t)value >> 31;
 }
 
@@ -2768,15 +3916,15 @@ uint32_t a32_ror32(arm_state_t * cpu, uint32_t value, uint32_t amount, bool stor
 		return value;
 	amount &= 0x1F;
 	if(store_carry)
-		cpu->pstate.c = (value >> (amount - 1)) & 1;
+		arm_set_carry(cpu, (value >> (amount - 1)) & 1);
 	return rotate_right32(value, amount);
 }
 
 uint32_t a32_rrx32(arm_state_t * cpu, uint32_t value, bool store_carry)
 {
-	int carry = cpu->pstate.c;
+	int carry = arm_get_carry(cpu);
 	if(store_carry)
-		cpu->pstate.c = value & 1;
+		arm_set_carry(cpu, value & 1);
 	return (value >> 1) | (carry << 31);
 }
 
@@ -2798,9 +3946,9 @@ uint32_t a32_get_register_operand(arm_state_t * cpu, uint32_t opcode, bool store
 	else if((opcode & 0x00000FF0) == 0x00000060)
 	{
 		/* rrx */
-		int carry = cpu->pstate.c;
+		int carry = arm_get_carry(cpu);
 		if(store_carry)
-			cpu->pstate.c = value & 1;
+			arm_set_carry(cpu, value & 1);
 		return (value >> 1) | (carry << 31);
 	}
 	else
@@ -2824,20 +3972,20 @@ uint32_t a32_get_register_operand(arm_state_t * cpu, uint32_t opcode, bool store
 		{
 		case 0b00: /* lsl */
 			if(store_carry)
-				cpu->pstate.c = amount <= 32 ? (value >> (32 - amount)) & 1 : 0;
+				arm_set_carry(cpu, amount <= 32 ? (value >> (32 - amount)) & 1 : 0);
 			return amount < 32 ? value << amount : 0;
 		case 0b01: /* lsr */
 			if(store_carry)
-				cpu->pstate.c = amount <= 32 ? (value >> (amount - 1)) & 1 : 0;
+				arm_set_carry(cpu, amount <= 32 ? (value >> (amount - 1)) & 1 : 0);
 			return amount < 32 ? value >> amount : 0;
 		case 0b10: /* asr */
 			if(store_carry)
-				cpu->pstate.c = (amount <= 32 ? value >> (amount - 1) : value >> 31) & 1;
+				arm_set_carry(cpu, (amount <= 32 ? value >> (amount - 1) : value >> 31) & 1);
 			return amount < 32 ? (int32_t)value >> amount : (int32_t)value >> 31;
 		case 0b11: /* ror */
 			amount &= 0x1F;
 			if(store_carry)
-				cpu->pstate.c = (value >> (amount - 1)) & 1;
+				arm_set_carry(cpu, (value >> (amount - 1)) & 1);
 			return rotate_right32(value, amount);
 		default:
 			assert(false);
@@ -2915,9 +4063,9 @@ uint32_t t32_get_register_operand(arm_state_t * cpu, uint32_t opcode1, uint32_t
 	else if((opcode2 & 0x70F0) == 0x0030)
 	{
 		/* rrx */
-		int carry = cpu->pstate.c;
+		int carry = arm_get_carry(cpu);
 		if(store_carry)
-			cpu->pstate.c = value & 1;
+			arm_set_carry(cpu, value & 1);
 		return (value >> 1) | (carry << 31);
 	}
 	else
@@ -2930,20 +4078,20 @@ uint32_t t32_get_register_operand(arm_state_t * cpu, uint32_t opcode1, uint32_t
 		{
 		case 0b00: /* lsl */
 			if(store_carry)
-				cpu->pstate.c = amount <= 32 ? (value >> (32 - amount)) & 1 : 0;
+				arm_set_carry(cpu, amount <= 32 ? (value >> (32 - amount)) & 1 : 0);
 			return amount < 32 ? value << amount : 0;
 		case 0b01: /* lsr */
 			if(store_carry)
-				cpu->pstate.c = amount <= 32 ? (value >> (amount - 1)) & 1 : 0;
+				arm_set_carry(cpu, amount <= 32 ? (value >> (amount - 1)) & 1 : 0);
 			return amount < 32 ? value >> amount : 0;
 		case 0b10: /* asr */
 			if(store_carry)
-				cpu->pstate.c = (amount <= 32 ? value >> (amount - 1) : value >> 31) & 1;
+				arm_set_carry(cpu, (amount <= 32 ? value >> (amount - 1) : value >> 31) & 1);
 			return amount < 32 ? (int32_t)value >> amount : (int32_t)value >> 31;
 		case 0b11: /* ror */
 			amount &= 0x1F;
 			if(store_carry)
-				cpu->pstate.c = (value >> (amount - 1)) & 1;
+				arm_set_carry(cpu, (value >> (amount - 1)) & 1);
 			return rotate_right32(value, amount);
 		default:
 			assert(false);
@@ -3122,39 +4270,52 @@ uint64_t a64_get_shifted_operand64(uint64_t value, int shift_type, uint8_t amoun
 
 /* Instructions */
 
+// the flags are only recorded here, see arm_evaluate_flags
+
+static inline void arm_record_nz(arm_state_t * cpu, uint8_t kind, uint64_t res)
+{
+	arm_evaluate_carry_and_overflow(cpu);
+	cpu->lazy_flags.kind = kind;
+	cpu->lazy_flags.result = res;
+}
+
+static inline void arm_record_nzcv(arm_state_t * cpu, uint8_t kind, uint64_t res, uint64_t op1, uint64_t op2)
+{
+	cpu->lazy_flags.kind = kind;
+	cpu->lazy_flags.result = res;
+	cpu->lazy_flags.operand1 = op1;
+	cpu->lazy_flags.operand2 = op2;
+}
+
 static inline void a32_test_nz(arm_state_t * cpu, uint32_t res)
 {
-	cpu->pstate.z = res == 0;
-	cpu->pstate.n = (res >> 31) & 1;
+	arm_record_nz(cpu, ARM_FLAGS_NZ32, res);
 }
 
 static inline void a32_test64_nz(arm_state_t * cpu, uint64_t res)
 {
-	cpu->pstate.z = res == 0;
-	cpu->pstate.n = (res >> 63) & 1;
+	arm_record_nz(cpu, ARM_FLAGS_NZ64, res);
 }
 
 static inline void a64_test32_nz(arm_state_t * cpu, uint32_t res)
 {
-	cpu->pstate.z = res == 0;
-	cpu->pstate.n = (res >> 31) & 1;
+	arm_record_nz(cpu, ARM_FLAGS_NZ32, res);
 }
 
 static inline void a64_test64_nz(arm_state_t * cpu, uint64_t res)
 {
-	cpu->pstate.z = res == 0;
-	cpu->pstate.n = (res >> 63) & 1;
+	arm_record_nz(cpu, ARM_FLAGS_NZ64, res);
 }
 
 static inline void a32_test_nzvc(arm_state_t * cpu, uint32_t res, uint32_t op1, uint32_t op2)
 {
-	cpu->pstate.c = (((op1 & op2) | (op1 & ~res) | (op2 & ~res)) >> 31) & 1;
-	cpu->pstate.v = (((op1 & op2 & ~res) | (~op1 & ~op2 & res)) >> 31) & 1;
-	a32_test_nz(cpu, res);
+	arm_record_nzcv(cpu, ARM_FLAGS_NZCV32, res, op1, op2);
 }
 
 static inline void a64_test32_nzvc(arm_state_t * cpu, uint32_t res, uint32_t op1, uint32_t op2)
 {
+	// does not fit any of the recorded kinds, since V is left unchanged
+	arm_evaluate_flags(cpu);
 	cpu->pstate.c = (((op1 & op2) | (op1 & ~res) | (op2 & ~res)) >> 31) & 1;
 	cpu->pstate.c = (((op1 & op2 & ~res) | (~op1 & ~op2 & res)) >> 31) & 1;
 	a64_test32_nz(cpu, res);
@@ -3162,9 +4323,7 @@ static inline void a64_test32_nzvc(arm_state_t * cpu, uint32_t res, uint32_t op1
 
 static inline void a64_test64_nzvc(arm_state_t * cpu, uint64_t res, uint64_t op1, uint64_t op2)
 {
-	cpu->pstate.c = (((op1 & op2) | (op1 & ~res) | (op2 & ~res)) >> 63) & 1;
-	cpu->pstate.v = (((op1 & op2 & ~res) | (~op1 & ~op2 & res)) >> 63) & 1;
-	a64_test64_nz(cpu, res);
+	arm_record_nzcv(cpu, ARM_FLAGS_NZCV64, res, op1, op2);
 }
 
 /* for 26-bit mode, copy the flags from value, otherwise from the SPR, this is used by certain instructions that modify R15 and set the flags */
@@ -3360,7 +4519,7 @@ static inline uint64_t a64_add64(arm_state_t * cpu, uint64_t op1, uint64_t op2,
 
 static inline uint32_t a32_adc32(arm_state_t * cpu, uint32_t op1, uint32_t op2, bool set_flags, bool destination_is_pc)
 {
-	uint32_t res = op1 + op2 + cpu->pstate.c;
+	uint32_t res = op1 + op2 + arm_get_carry(cpu);
 	if(set_flags)
 	{
 		a32_or_a26_test_nzvc(cpu, res, op1, op2, destination_is_pc);
@@ -3374,7 +4533,7 @@ static inline uint32_t a32_adc32(arm_state_t * cpu, uint32_t op1, uint32_t op2,
 
 static inline uint32_t a64_adc32(arm_state_t * cpu, uint32_t op1, uint32_t op2, bool set_flags)
 {
-	uint32_t res = op1 + op2 + cpu->pstate.c;
+	uint32_t res = op1 + op2 + arm_get_carry(cpu);
 	if(set_flags)
 	{
 		a64_test32_nzvc(cpu, res, op1, op2);
@@ -3384,7 +4543,7 @@ static inline uint32_t a64_adc32(arm_state_t * cpu, uint32_t op1, uint32_t op2,
 
 static inline uint64_t a64_adc64(arm_state_t * cpu, uint64_t op1, uint64_t op2, bool set_flags)
 {
-	uint64_t res = op1 + op2 + cpu->pstate.c;
+	uint64_t res = op1 + op2 + arm_get_carry(cpu);
 	if(set_flags)
 	{
 		a64_test64_nzvc(cpu, res, op1, op2);
@@ -3430,7 +4589,7 @@ static inline uint64_t a64_sub64(arm_state_t * cpu, uint64_t op1, uint64_t op2,
 
 static inline uint32_t a32_sbc32(arm_state_t * cpu, uint32_t op1, uint32_t op2, bool set_flags, bool destination_is_pc)
 {
-	uint32_t res = op1 - op2 + cpu->pstate.c - 1;
+	uint32_t res = op1 - op2 + arm_get_carry(cpu) - 1;
 	if(set_flags)
 	{
 		a32_or_a26_test_nzvc(cpu, res, op1, ~op2, destination_is_pc);
@@ -3444,7 +4603,7 @@ static inline uint32_t a32_sbc32(arm_state_t * cpu, uint32_t op1, uint32_t op2,
 
 static inline uint32_t a64_sbc32(arm_state_t * cpu, uint32_t op1, uint32_t op2, bool set_flags)
 {
-	uint32_t res = op1 - op2 + cpu->pstate.c - 1;
+	uint32_t res = op1 - op2 + arm_get_carry(cpu) - 1;
 	if(set_flags)
 	{
 		a64_test32_nzvc(cpu, res, op1, ~op2);
@@ -3454,7 +4613,7 @@ static inline uint32_t a64_sbc32(arm_state_t * cpu, uint32_t op1, uint32_t op2,
 
 static inline uint64_t a64_sbc64(arm_state_t * cpu, uint64_t op1, uint64_t op2, bool set_flags)
 {
-	uint64_t res = op1 - op2 + cpu->pstate.c - 1;
+	uint64_t res = op1 - op2 + arm_get_carry(cpu) - 1;
 	if(set_flags)
 	{
 		a64_test64_nzvc(cpu, res, op1, ~op2);
@@ -4763,24 +5922,26 @@ static inline void a32_srs(arm_state_t * cpu, int mode, bool upward, bool change
 	}
 }
 
-static inline void a32_mark_exclusive(arm_state_t * cpu, uint64_t base, size_t size)
+static inline void a32_mark_exclusive(arm_state_t * cpu, uint64_t base, size_t size, uint64_t value)
 {
-	// TODO: set exclusive_procid
+	cpu->exclusive_procid = cpu->processor_id;
 	cpu->exclusive_start = base;
 	cpu->exclusive_end = base + size - 1;
+	cpu->exclusive_value[0] = value;
 }
 
-static inline bool a32_check_exclusive(arm_state_t * cpu, uint64_t base, size_t size)
+// a store exclusive clears the local monitor, whether it succeeded or not
+static inline bool a32_store_exclusive(arm_state_t * cpu, uint64_t base, size_t size, uint64_t value, arm_endianness_t endian)
 {
-	// TODO: check exclusive_procid
-	return cpu->exclusive_start < base + size && base <= cpu->exclusive_end;
+	bool marked = arm_exclusive_is_marked(cpu, base, size);
+	uint64_t expected = cpu->exclusive_value[0];
+	arm_exclusive_unmark(cpu);
+	return marked && memory_compare_exchange(cpu, base, size, &expected, value, endian);
 }
 
 static inline void a32_clear_exclusive(arm_state_t * cpu)
 {
-	// TODO: clear exclusive_procid
-	cpu->exclusive_start = (uint32_t)-1;
-	cpu->exclusive_end = 0;
+	arm_exclusive_unmark(cpu);
 }
 
 static inline uint32_t a32_ldrexb(arm_state_t * cpu, regnum_t base, uint32_t offset)
@@ -4797,8 +5958,9 @@ static inline uint32_t a32_ldrexb(arm_state_t * cpu, regnum_t base, uint32_t off
 	address += offset;
 
 	a26_check_address(cpu, address);
-	a32_mark_exclusive(cpu, address, 1);
-	return a32_read8(cpu, address);
+	uint8_t value = a32_read8(cpu, address);
+	a32_mark_exclusive(cpu, address, 1, value);
+	return value;
 }
 
 static inline uint32_t a32_ldrexh(arm_state_t * cpu, regnum_t base, uint32_t offset)
@@ -4830,8 +5992,9 @@ static inline uint32_t a32_ldrexh(arm_state_t * cpu, regnum_t base, uint32_t off
 	}
 
 	a26_check_address(cpu, address);
-	a32_mark_exclusive(cpu, address, 2);
-	return a32_read16(cpu, address);
+	uint16_t value = a32_read16(cpu, address);
+	a32_mark_exclusive(cpu, address, 2, value);
+	return value;
 }
 
 static inline uint32_t a32_ldrex(arm_state_t * cpu, regnum_t base, uint32_t offset)
@@ -4863,8 +6026,9 @@ static inline uint32_t a32_ldrex(arm_state_t * cpu, regnum_t base, uint32_t offs
 	}
 
 	a26_check_address(cpu, address);
-	a32_mark_exclusive(cpu, address, 4);	
-	return a32_read8(cpu, address);
+	uint32_t value = a32_read32(cpu, address);
+	a32_mark_exclusive(cpu, address, 4, value);
+	return value;
 }
 
 static inline void a32_ldrexd(arm_state_t * cpu, regnum_t operand1, regnum_t operand2, regnum_t base, uint32_t offset)
@@ -4896,9 +6060,11 @@ static inline void a32_ldrexd(arm_state_t * cpu, regnum_t operand1, regnum_t ope
 	}
 
 	a26_check_address(cpu, address); // only the first address needs checking
-	a32_check_exclusive(cpu, address, 8);
-	a32_register_set32(cpu, operand1, a32_read32(cpu, address));
-	a32_register_set32(cpu, operand2, a32_read32(cpu, address + 4));
+	uint32_t value1 = a32_read32(cpu, address);
+	uint32_t value2 = a32_read32(cpu, address + 4);
+	a32_mark_exclusive(cpu, address, 8, arm_pack_words(value1, value2, a32_get_data_endianness(cpu)));
+	a32_register_set32(cpu, operand1, value1);
+	a32_register_set32(cpu, operand2, value2);
 }
 
 static inline uint32_t a32_strexb(arm_state_t * cpu, uint32_t value, regnum_t base, uint32_t offset)
@@ -4914,16 +6080,8 @@ static inline uint32_t a32_strexb(arm_state_t * cpu, uint32_t value, regnum_t ba
 
 	address += offset;
 
-	if(a32_check_exclusive(cpu, address, 1))
-	{
-		a26_check_address(cpu, address);
-		a32_write8(cpu, address, value);
-		return 0;
-	}
-	else
-	{
-		return 1;
-	}
+	a26_check_address(cpu, address);
+	return a32_store_exclusive(cpu, address, 1, value, a32_get_data_endianness(cpu)) ? 0 : 1;
 }
 
 static inline uint32_t a32_strexh(arm_state_t * cpu, uint32_t value, regnum_t base, uint32_t offset)
@@ -4954,16 +6112,8 @@ static inline uint32_t a32_strexh(arm_state_t * cpu, uint32_t value, regnum_t ba
 			arm_unaligned(cpu);
 	}
 
-	if(a32_check_exclusive(cpu, address, 2))
-	{
-		a26_check_address(cpu, address);
-		a32_write16(cpu, address, value);
-		return 0;
-	}
-	else
-	{
-		return 1;
-	}
+	a26_check_address(cpu, address);
+	return a32_store_exclusive(cpu, address, 2, value, a32_get_data_endianness(cpu)) ? 0 : 1;
 }
 
 static inline uint32_t a32_strex(arm_state_t * cpu, uint32_t value, regnum_t base, uint32_t offset)
@@ -4994,16 +6144,8 @@ static inline uint32_t a32_strex(arm_state_t * cpu, uint32_t value, regnum_t bas
 			arm_unaligned(cpu);
 	}
 
-	if(a32_check_exclusive(cpu, address, 4))
-	{
-		a26_check_address(cpu, address);
-		a32_write32(cpu, address, value);
-		return 0;
-	}
-	else
-	{
-		return 1;
-	}
+	a26_check_address(cpu, address);
+	return a32_store_exclusive(cpu, address, 4, value, a32_get_data_endianness(cpu)) ? 0 : 1;
 }
 
 static inline uint32_t a32_strexd(arm_state_t * cpu, regnum_t operand1, regnum_t operand2, regnum_t base, uint32_t offset)
@@ -5034,17 +6176,9 @@ static inline uint32_t a32_strexd(arm_state_t * cpu, regnum_t operand1, regnum_t
 			arm_unaligned(cpu);
 	}
 
-	if(a32_check_exclusive(cpu, address, 4))
-	{
-		a26_check_address(cpu, address); // only the first address needs checking
-		a32_write32(cpu, address, a32_register_get32(cpu, operand1));
-		a32_write32(cpu, address + 4, a32_register_get32(cpu, operand2));
-		return 0;
-	}
-	else
-	{
-		return 1;
-	}
+	a26_check_address(cpu, address); // only the first address needs checking
+	uint64_t value = arm_pack_words(a32_register_get32(cpu, operand1), a32_register_get32(cpu, operand2), a32_get_data_endianness(cpu));
+	return a32_store_exclusive(cpu, address, 8, value, a32_get_data_endianness(cpu)) ? 0 : 1;
 }
 
 #define OP32 false
@@ -5262,6 +6396,155 @@ static inline void a64_stp(arm_state_t * cpu, bool operand64, size_t bytes, regn
 	}
 }
 
+// exclusive and atomic accesses must be naturally aligned
+static inline uint64_t a64_atomic_address(arm_state_t * cpu, regnum_t base, size_t bytes)
+{
+	uint64_t address = a64_register_get64(cpu, base, false);
+
+	if(base == A64_SP && (address & 0xF) != 0)
+	{
+		a64_unaligned_sp(cpu);
+	}
+
+	if((address & (bytes - 1)) != 0)
+	{
+		arm_unaligned(cpu);
+	}
+
+	return address;
+}
+
+static inline uint64_t a64_atomic_mask(size_t bytes)
+{
+	return bytes == 8 ? (uint64_t)-1 : ((uint64_t)1 << (8 * bytes)) - 1;
+}
+
+static inline void a64_ldxr(arm_state_t * cpu, size_t bytes, regnum_t operand, regnum_t base, bool acquire)
+{
+	uint64_t address = a64_atomic_address(cpu, base, bytes);
+
+	uint64_t value;
+	switch(bytes)
+	{
+	case 1:
+		value = a64_read8(cpu, address);
+		break;
+	case 2:
+		value = a64_read16(cpu, address);
+		break;
+	case 4:
+		value = a64_read32(cpu, address);
+		break;
+	case 8:
+		value = a64_read64(cpu, address);
+		break;
+	}
+
+	a32_mark_exclusive(cpu, address, bytes, value);
+	a64_register_set64(cpu, operand, SUPPRESS_SP, value);
+
+	if(acquire)
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
+static inline void a64_stxr(arm_state_t * cpu, size_t bytes, regnum_t status, regnum_t operand, regnum_t base)
+{
+	uint64_t address = a64_atomic_address(cpu, base, bytes);
+	uint64_t value = a64_register_get64(cpu, operand, SUPPRESS_SP) & a64_atomic_mask(bytes);
+	bool success = a32_store_exclusive(cpu, address, bytes, value, a64_get_data_endianness(cpu));
+	a64_register_set32(cpu, status, SUPPRESS_SP, success ? 0 : 1);
+}
+
+static inline void a64_ldxp(arm_state_t * cpu, bool operand64, regnum_t operand1, regnum_t operand2, regnum_t base, bool acquire)
+{
+	uint64_t address = a64_atomic_address(cpu, base, operand64 ? 16 : 8);
+
+	if(!operand64)
+	{
+		uint32_t value1 = a64_read32(cpu, address);
+		uint32_t value2 = a64_read32(cpu, address + 4);
+		a32_mark_exclusive(cpu, address, 8, arm_pack_words(value1, value2, a64_get_data_endianness(cpu)));
+		a64_register_set32(cpu, operand1, SUPPRESS_SP, value1);
+		a64_register_set32(cpu, operand2, SUPPRESS_SP, value2);
+	}
+	else
+	{
+		uint64_t value1 = a64_read64(cpu, address);
+		uint64_t value2 = a64_read64(cpu, address + 8);
+		a32_mark_exclusive(cpu, address, 16, value1);
+		cpu->exclusive_value[1] = value2;
+		a64_register_set64(cpu, operand1, SUPPRESS_SP, value1);
+		a64_register_set64(cpu, operand2, SUPPRESS_SP, value2);
+	}
+
+	if(acquire)
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+}
+
+static inline void a64_stxp(arm_state_t * cpu, bool operand64, regnum_t status, regnum_t operand1, regnum_t operand2, regnum_t base)
+{
+	uint64_t address = a64_atomic_address(cpu, base, operand64 ? 16 : 8);
+	arm_endianness_t endian = a64_get_data_endianness(cpu);
+
+	bool success;
+	if(!operand64)
+	{
+		uint64_t value = arm_pack_words(a64_register_get32(cpu, operand1, SUPPRESS_SP), a64_register_get32(cpu, operand2, SUPPRESS_SP), endian);
+		success = a32_store_exclusive(cpu, address, 8, value, endian);
+	}
+	else
+	{
+		bool marked = arm_exclusive_is_marked(cpu, address, 16);
+		uint64_t expected[2] = { cpu->exclusive_value[0], cpu->exclusive_value[1] };
+		uint64_t desired[2] = { a64_register_get64(cpu, operand1, SUPPRESS_SP), a64_register_get64(cpu, operand2, SUPPRESS_SP) };
+		arm_exclusive_unmark(cpu);
+		success = marked && memory_compare_exchange_pair(cpu, address, expected, desired, endian);
+	}
+
+	a64_register_set32(cpu, status, SUPPRESS_SP, success ? 0 : 1);
+}
+
+// the register holding the compared value receives the value found in memory
+static inline void a64_cas(arm_state_t * cpu, size_t bytes, regnum_t compare, regnum_t operand, regnum_t base)
+{
+	uint64_t address = a64_atomic_address(cpu, base, bytes);
+	uint64_t mask = a64_atomic_mask(bytes);
+	uint64_t value = a64_register_get64(cpu, compare, SUPPRESS_SP) & mask;
+	memory_compare_exchange(cpu, address, bytes, &value, a64_register_get64(cpu, operand, SUPPRESS_SP) & mask, a64_get_data_endianness(cpu));
+	a64_register_set64(cpu, compare, SUPPRESS_SP, value);
+}
+
+static inline void a64_casp(arm_state_t * cpu, bool operand64, regnum_t compare, regnum_t operand, regnum_t base)
+{
+	uint64_t address = a64_atomic_address(cpu, base, operand64 ? 16 : 8);
+	arm_endianness_t endian = a64_get_data_endianness(cpu);
+
+	if(!operand64)
+	{
+		uint64_t value = arm_pack_words(a64_register_get32(cpu, compare, SUPPRESS_SP), a64_register_get32(cpu, compare + 1, SUPPRESS_SP), endian);
+		uint64_t desired = arm_pack_words(a64_register_get32(cpu, operand, SUPPRESS_SP), a64_register_get32(cpu, operand + 1, SUPPRESS_SP), endian);
+		memory_compare_exchange(cpu, address, 8, &value, desired, endian);
+		a64_register_set32(cpu, compare, SUPPRESS_SP, arm_unpack_first_word(value, endian));
+		a64_register_set32(cpu, compare + 1, SUPPRESS_SP, arm_unpack_second_word(value, endian));
+	}
+	else
+	{
+		uint64_t value[2] = { a64_register_get64(cpu, compare, SUPPRESS_SP), a64_register_get64(cpu, compare + 1, SUPPRESS_SP) };
+		uint64_t desired[2] = { a64_register_get64(cpu, operand, SUPPRESS_SP), a64_register_get64(cpu, operand + 1, SUPPRESS_SP) };
+		memory_compare_exchange_pair(cpu, address, value, desired, endian);
+		a64_register_set64(cpu, compare, SUPPRESS_SP, value[0]);
+		a64_register_set64(cpu, compare + 1, SUPPRESS_SP, value[1]);
+	}
+}
+
+// ldadd, ldclr, ldeor, ldset, ldsmax, ldsmin, ldumax, ldumin and swp
+static inline void a64_atomic(arm_state_t * cpu, size_t bytes, arm_atomic_operation_t operation, regnum_t source, regnum_t target, regnum_t base)
+{
+	uint64_t address = a64_atomic_address(cpu, base, bytes);
+	uint64_t value = memory_atomic(cpu, address, bytes, operation, a64_register_get64(cpu, source, SUPPRESS_SP), a64_get_data_endianness(cpu));
+	a64_register_set64(cpu, target, SUPPRESS_SP, value);
+}
+
 static inline uint64_t a64_extend(uint64_t value, uint8_t operation, uint8_t amount)
 {
 	switch(operation)
@@ -5501,6 +6784,8 @@ uint64_t a64_perform_mrs(arm_state_t * cpu, uint32_t opcode)
 					case 4:
 					case 7:
 						return arm_get_midr(cpu);
+					case 5:
+						return arm_get_mpidr(cpu);
 					default:
 						arm_undefined(cpu);
 					}
@@ -5650,6 +6935,28 @@ uint64_t a64_perform_mrs(arm_state_t * cpu, uint32_t opcode)
 			default:
 				arm_undefined(cpu);
 			}
+		case 13:
+			switch(opc1)
+			{
+			case 3:
+				switch(cr2)
+				{
+				case 0:
+					switch(opc2)
+					{
+					case 2:
+						return cpu->tpidr_el0;
+					case 3:
+						return cpu->tpidrro_el0;
+					default:
+						arm_undefined(cpu);
+					}
+				default:
+					arm_undefined(cpu);
+				}
+			default:
+				arm_undefined(cpu);
+			}
 		default:
 			arm_undefined(cpu);
 		}
@@ -5845,6 +7152,35 @@ void a64_perform_msr(arm_state_t * cpu, uint32_t opcode, uint64_t value)
 			default:
 				arm_undefined(cpu);
 			}
+		case 13:
+			switch(opc1)
+			{
+			case 3:
+				switch(cr2)
+				{
+				case 0:
+					switch(opc2)
+					{
+					case 2:
+						cpu->tpidr_el0 = value;
+						return;
+					case 3:
+						if(!arm_is_privileged_mode(cpu))
+						{
+							// read only at EL0
+							arm_undefined(cpu);
+						}
+						cpu->tpidrro_el0 = value;
+						return;
+					default:
+						arm_undefined(cpu);
+					}
+				default:
+					arm_undefined(cpu);
+				}
+			default:
+				arm_undefined(cpu);
+			}
 		default:
 			arm_undefined(cpu);
 		}
@@ -5934,12 +7270,20 @@ uint32_t cp14_perform_mrc(arm_state_t * cpu, uint32_t opcode);
 void cp15_perform_mcr(arm_state_t * cpu, uint32_t opcode, uint32_t value);
 uint32_t cp15_perform_mrc(arm_state_t * cpu, uint32_t opcode);
 
+/* Decoders */
+
+void arm_select_decoders(arm_state_t * cpu);
+
 /* Initialization */
 
 void arm_emu_init(arm_state_t * cpu, arm_configuration_t config, uint16_t supported_isas, const memory_interface_t * memory_interface)
 {
 	memset(cpu, 0, sizeof(arm_state_t));
+	arm_exclusive_unmark(cpu);
 	cpu->memory = memory_interface;
+	cpu->fetch_memory = *memory_interface;
+	if(memory_interface->fetch != NULL)
+		cpu->fetch_memory.read = memory_interface->fetch;
 	cpu->config = config;
 	cpu->supported_isas = supported_isas;
 
@@ -6072,6 +7416,8 @@ void arm_emu_init(arm_state_t * cpu, arm_configuration_t config, uint16_t suppor
 	cpu->coproc[15].perform_mrc = cp15_perform_mrc;
 //	cpu->coproc[15].perform_mrrc = cp15_perform_mrrc;
 
+	arm_select_decoders(cpu);
+
 	cpu->sctlr_el1 = 0;
 	if(!(cpu->config.features & FEATURE_ARM26))
 	{
@@ -6079,6 +7425,26 @@ void arm_emu_init(arm_state_t * cpu, arm_configuration_t config, uint16_t suppor
 	}
 }
 
+void arm_emu_clone(arm_state_t * cpu, arm_state_t * source)
+{
+	arm_evaluate_flags(source);
+
+	arm_emu_init(cpu, source->config, source->supported_isas, source->memory);
+	memcpy(cpu, source, ARM_STATE_SNAPSHOT_SIZE);
+	arm_exclusive_unmark(cpu);
+	if(source->jit.enabled && arm_jit_enable(cpu))
+		cpu->jit.threshold = source->jit.threshold;
+	if(source->global_monitor != NULL)
+		arm_global_monitor_attach(source->global_monitor, cpu);
+}
+
+void arm_emu_free(arm_state_t * cpu)
+{
+	if(cpu->global_monitor != NULL)
+		arm_global_monitor_detach(cpu->global_monitor, cpu);
+	arm_jit_free(cpu);
+}
+
 #include "jazelle.c"
 
 void a32_step(arm_state_t * cpu);
@@ -6086,9 +7452,22 @@ void a64_step(arm_state_t * cpu);
 void t32_step(arm_state_t * cpu);
 void j32_step(arm_state_t * cpu);
 
-void step(arm_state_t * cpu)
+void a32_step_execute(arm_state_t * cpu, uint32_t opcode, uint16_t index);
+void a64_step_execute(arm_state_t * cpu, uint32_t opcode, uint16_t index);
+void t32_step_execute(arm_state_t * cpu, uint16_t opcode1, uint16_t opcode2, uint16_t index);
+void t16_step_execute(arm_state_t * cpu, uint16_t opcode1, uint16_t index);
+
+#include "jit.c"
+
+/*
+ * The instruction steppers do not catch exceptions themselves, since arming setjmp for every instruction is expensive
+ * Instead, step and arm_run arm it once, and on an exception they restore the state the same way
+ */
+
+// executes a single instruction, the caller must have set up cpu->exc
+static inline void arm_step_instruction(arm_state_t * cpu)
 {
-	cpu->result = ARM_EMU_OK;
+	cpu->instruction_count ++;
 	switch(cpu->pstate.rw)
 	{
 	case PSTATE_RW_26:
@@ -6120,5 +7499,120 @@ void step(arm_state_t * cpu)
 	}
 }
 
+// called after an exception interrupted execution in the instruction set identified by the tag
+static inline void arm_step_exception(arm_state_t * cpu, uint8_t tag)
+{
+	if((tag & ARM_DECODE_CACHE_ISA_MASK) == ARM_DECODE_CACHE_T32 || (tag & ARM_DECODE_CACHE_ISA_MASK) == ARM_DECODE_CACHE_T32EE)
+		t32_set_it_state(cpu, 0);
+}
+
+void step(arm_state_t * cpu)
+{
+	uint8_t tag = arm_block_get_tag(cpu);
+	cpu->result = ARM_EMU_OK;
+	if(setjmp(cpu->exc))
+	{
+		arm_step_exception(cpu, tag);
+		return;
+	}
+	arm_step_instruction(cpu);
+}
+
+// interprets the instructions of a block until one of them does not continue with the next one
+static inline void arm_interpret_block(arm_state_t * cpu, arm_block_t * block, uint8_t tag)
+{
+	uint64_t pc = block->pc;
+	for(int i = 0; i < block->count; i++)
+	{
+		// stop if the previous instruction did not continue with this one, changed the state the block was decoded in or overwrote the block
+		if(i > 0 && (cpu->r[PC] != pc || arm_block_get_tag(cpu) != tag || block->tag != tag))
+			return;
+
+		uint32_t opcode = block->instructions[i].opcode;
+		uint16_t index = block->instructions[i].index;
+		cpu->old_pc = pc;
+		cpu->instruction_count ++;
+		pc += block->instructions[i].length;
+		switch(tag & ARM_DECODE_CACHE_ISA_MASK)
+		{
+		case ARM_DECODE_CACHE_A26:
+			pc &= 0x03FFFFFF;
+			cpu->r[PC] = pc;
+			a32_step_execute(cpu, opcode, index);
+			break;
+		case ARM_DECODE_CACHE_A32:
+			cpu->r[PC] = pc;
+			a32_step_execute(cpu, opcode, index);
+			break;
+		case ARM_DECODE_CACHE_T32:
+		case ARM_DECODE_CACHE_T32EE:
+			cpu->r[PC] = pc;
+			if(block->instructions[i].length == 4)
+				t32_step_execute(cpu, opcode >> 16, opcode, index);
+			else
+				t16_step_execute(cpu, opcode >> 16, index);
+			break;
+		case ARM_DECODE_CACHE_A64:
+			cpu->r[PC] = pc;
+			a64_step_execute(cpu, opcode, index);
+			break;
+		}
+	}
+}
+
+arm_emu_result_t arm_run(arm_state_t * cpu, uint64_t max_instructions, uint64_t * retired_instructions)
+{
+	uint64_t start = cpu->instruction_count;
+	// these must survive a longjmp
+	volatile uint8_t tag = 0;
+	arm_block_t * volatile native_block = NULL;
+
+	cpu->result = ARM_EMU_OK;
+	if(setjmp(cpu->exc))
+	{
+		// either an event for the caller, or the processor entered an exception handler and execution continues
+		if(native_block != NULL)
+		{
+			cpu->instruction_count += arm_jit_executed_count(cpu, native_block);
+			native_block = NULL;
+		}
+		arm_step_exception(cpu, tag);
+	}
+
+	while(cpu->result == ARM_EMU_OK && cpu->instruction_count - start < max_instructions)
+	{
+		arm_process_pending_invalidations(cpu);
+		tag = arm_block_get_tag(cpu);
+		arm_block_t * block = arm_block_fetch(cpu, tag);
+		if(block == NULL || block->count > max_instructions - (cpu->instruction_count - start))
+		{
+			// no block available or it could exceed the limit
+			arm_step_instruction(cpu);
+			continue;
+		}
+
+		if(block->native == NULL && cpu->jit.enabled && ++block->executions == cpu->jit.threshold)
+			arm_jit_translate(cpu, block, tag);
+
+		if(arm_jit_is_executable(cpu, block))
+		{
+			// native code works on the flags in pstate
+			arm_evaluate_flags(cpu);
+			native_block = block;
+			block->native(cpu);
+			native_block = NULL;
+			cpu->instruction_count += arm_jit_executed_count(cpu, block);
+		}
+		else
+		{
+			arm_interpret_block(cpu, block, tag);
+		}
+	}
+
+	if(retired_instructions != NULL)
+		*retired_instructions = cpu->instruction_count - start;
+	return cpu->result;
+}
+
 #include "step.gen.c"
 
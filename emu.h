@@ -7,6 +7,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <setjmp.h>
+#include <pthread.h>
 #include "arm.h"
 
 /* Conventions
@@ -295,8 +296,17 @@ typedef struct arm_coprocessor_t
 
 typedef struct memory_interface_t
 {
-	bool (* read)(arm_state_t *, uint64_t, void *, size_t, bool);
-	bool (* write)(arm_state_t *, uint64_t, const void *, size_t, bool);
+	// passed as the first argument to every callback, the CPU argument may be NULL
+	void * data;
+	bool (* read)(void *, arm_state_t *, uint64_t, void *, size_t, bool);
+	bool (* write)(void *, arm_state_t *, uint64_t, const void *, size_t, bool);
+	// optional, instruction fetches use read if NULL
+	bool (* fetch)(void *, arm_state_t *, uint64_t, void *, size_t, bool);
+	// optional, returns the host address of the ARM_MEMORY_MAP_PAGE_SIZE bytes at the (aligned) address, or NULL if they must go through read/write
+	void * (* map)(void *, arm_state_t *, uint64_t, bool);
+	// optional, but needed along with map for atomic accesses to stay atomic with respect to each other
+	// returns the host address of the naturally aligned bytes of a single atomic access, which counts as a write, even when map refuses writes
+	void * (* map_atomic)(void *, arm_state_t *, uint64_t, size_t);
 } memory_interface_t;
 
 /* PSTATE RW field, bit 0 is stored in xPSR bit 4
@@ -346,12 +356,153 @@ typedef struct arm_pstate_t
 	uint32_t n : 1; // negative/less than (v1+)
 } arm_pstate_t;
 
+/* Condition flags that have not yet been stored in arm_pstate_t
+ * Flag setting instructions only record their result and operands, the flags are computed when something reads them (see arm_evaluate_flags)
+ */
+enum
+{
+	ARM_FLAGS_EVALUATED = 0, // the flags in pstate are up to date
+	ARM_FLAGS_NZ32, // N and Z from a 32-bit result, C and V are in pstate
+	ARM_FLAGS_NZ64, // N and Z from a 64-bit result, C and V are in pstate
+	ARM_FLAGS_NZCV32, // all flags from a 32-bit addition
+	ARM_FLAGS_NZCV64, // all flags from a 64-bit addition
+};
+
+typedef struct arm_lazy_flags_t
+{
+	uint8_t kind;
+	uint64_t result;
+	uint64_t operand1;
+	uint64_t operand2;
+} arm_lazy_flags_t;
+
+#ifndef ARM_DECODE_CACHE_SIZE
+# define ARM_DECODE_CACHE_SIZE 0x1000 // must be a power of 2
+#endif
+
+/* a previously fetched and decoded instruction */
+typedef struct arm_decode_cache_entry_t
+{
+	uint64_t pc;
+	uint32_t opcode; // for 32-bit Thumb instructions, the first halfword is stored in the upper 16 bits
+	uint16_t index; // returned by the generated decoder for the instruction set
+	uint8_t tag; // instruction set and state the instruction was decoded in, 0 for an empty entry
+	uint8_t length; // in bytes
+} arm_decode_cache_entry_t;
+
+#define ARM_MEMORY_MAP_PAGE_SIZE 0x1000
+
+#ifndef ARM_MEMORY_MAP_SIZE
+# define ARM_MEMORY_MAP_SIZE 0x100 // must be a power of 2
+#endif
+
+/* a guest page mapped into host memory, see memory_interface_t map */
+typedef struct arm_memory_map_entry_t
+{
+	uint64_t address;
+	uint8_t * host; // NULL for an empty entry
+} arm_memory_map_entry_t;
+
+#ifndef ARM_BLOCK_CACHE_SIZE
+# define ARM_BLOCK_CACHE_SIZE 0x400 // must be a power of 2
+#endif
+
+#ifndef ARM_BLOCK_MAX_LENGTH
+# define ARM_BLOCK_MAX_LENGTH 32
+#endif
+
+/* a sequence of consecutive decoded instructions within a single page, executed together until one of them branches away */
+typedef struct arm_block_t
+{
+	uint64_t pc;
+	uint8_t tag; // same as for the decode cache, 0 for an empty entry
+	uint8_t count;
+	uint8_t length; // in bytes
+	struct
+	{
+		uint32_t opcode; // for 32-bit Thumb instructions, the first halfword is stored in the upper 16 bits
+		uint16_t index;
+		uint8_t length;
+	} instructions[ARM_BLOCK_MAX_LENGTH];
+	uint16_t executions; // counted until the block is translated to native code
+	uint32_t native_state; // the processor state (mode, stack pointer selection) the native code was generated for, since it accesses the banked registers directly
+	void (* native)(arm_state_t * cpu); // executes the entire block, or NULL if it has not been translated
+} arm_block_t;
+
+#ifndef ARM_CODE_PAGE_COUNT
+# define ARM_CODE_PAGE_COUNT 0x40 // must be a power of 2
+#endif
+#define ARM_CODE_PAGE_SIZE 0x1000
+
+/* a guest page holding the instructions of translated blocks */
+typedef struct arm_code_page_t
+{
+	uint64_t address;
+	uint16_t block_count; // 0 for an empty entry
+	uint32_t words[ARM_CODE_PAGE_SIZE / 4 / 32]; // one bit for every word that might hold a translated instruction
+} arm_code_page_t;
+
+#ifndef ARM_DECODED_PAGE_COUNT
+# define ARM_DECODED_PAGE_COUNT 0x1000 // must be a power of 2
+#endif
+
+#ifndef ARM_JIT_THRESHOLD
+# define ARM_JIT_THRESHOLD 16 // number of times a block is executed before it gets translated to native code
+#endif
+
+#ifndef ARM_JIT_BUFFER_SIZE
+# define ARM_JIT_BUFFER_SIZE 0x1000000
+#endif
+
+/* state of the native code generator for A32/ARM26/A64 blocks, only available on x86-64 hosts (see jit.c) */
+typedef struct arm_jit_t
+{
+	bool enabled;
+	uint16_t threshold; // number of times a block is executed before it gets translated, ARM_JIT_THRESHOLD unless changed after enabling
+	uint8_t * buffer;
+	size_t used;
+	// the layout of the bitfields in arm_pstate_t is up to the compiler, so it is determined when the generator is enabled
+	uint16_t flags_offset; // byte containing the NZCV flags
+	uint8_t flags_shift; // position of the V flag, followed by C, Z and N
+	uint32_t state_mask; // bits of the first word of the pstate that hold the rw, mode, jt, sp and el fields
+	uint16_t condition_masks[16]; // for each condition code, the NZCV values that satisfy it
+} arm_jit_t;
+
+#ifndef ARM_SHARED_CODE_LINE_COUNT
+# define ARM_SHARED_CODE_LINE_COUNT 0x10000 // must be a power of 2
+#endif
+#define ARM_SHARED_CODE_LINE_SIZE 16
+
+#ifndef ARM_PENDING_INVALIDATION_COUNT
+# define ARM_PENDING_INVALIDATION_COUNT 8
+#endif
+
+/* Global exclusive monitor
+ * Shared by the CPUs of a multiprocessor system, each of which runs on its own host thread
+ * Exclusive and atomic accesses are performed with host atomic instructions, so the monitor itself holds no ranges
+ * The lock only serializes the atomic accesses to memory that cannot be accessed directly by the host
+ * The monitor also keeps track of the attached CPUs, so that writes to instructions decoded by one of them can be passed on to the others
+ */
+typedef struct arm_global_monitor_t
+{
+	pthread_mutex_t lock;
+	// protects the list of CPUs and their pending invalidations
+	pthread_mutex_t cpu_lock;
+	size_t cpu_count;
+	size_t cpu_capacity;
+	arm_state_t ** cpus;
+	// one bit for every line any of the CPUs decoded instructions from (indexed by the address), set atomically and never cleared
+	uint64_t code_lines[ARM_SHARED_CODE_LINE_COUNT / 64];
+} arm_global_monitor_t;
+
 struct arm_state_t
 {
 	arm_configuration_t config;
 	uint16_t supported_isas;
 	arm_part_number_t part_number;
 	arm_vendor_t vendor;
+	// position of the CPU within a multiprocessor system, reported in MPIDR
+	uint8_t processor_id;
 
 	/* 4: fully 32-bit */
 	uint8_t lowest_64bit_only_el;
@@ -368,8 +519,12 @@ struct arm_state_t
 	// modified at runtime
 	uint64_t r[REG_COUNT];
 	uint64_t old_pc;
+	// number of instructions executed so far
+	uint64_t instruction_count;
 
 	arm_pstate_t pstate;
+	// the N, Z, C, V fields of pstate are only valid after arm_evaluate_flags
+	arm_lazy_flags_t lazy_flags;
 
 	// coprocessor/system registers
 	union
@@ -410,9 +565,12 @@ struct arm_state_t
 # error Unknown byte order
 #endif
 
-	uint32_t exclusive_procid; // TODO
+	// local exclusive monitor, no range is marked if exclusive_start > exclusive_end
+	uint32_t exclusive_procid;
 	uint64_t exclusive_start;
 	uint64_t exclusive_end;
+	// the values read by the load exclusive, the store exclusive only succeeds if the memory still holds them
+	uint64_t exclusive_value[2];
 
 	// p32|64, #, c#, c#, #
 
@@ -459,13 +617,81 @@ struct arm_state_t
 	// AArch64 name
 	uint64_t vbar_el3;
 
+	// p15|3, 0(?3), c13, c0, 2
+	// AArch64 name, AArch32 name is tpidrurw
+	uint64_t tpidr_el0;
+	// p15|3, 0(?3), c13, c0, 3
+	// AArch64 name, AArch32 name is tpidruro
+	uint64_t tpidrro_el0;
+
+	// the fields above hold the architectural state, the ones below are derived from the configuration or cache other state
 	const memory_interface_t * memory;
+	// same as memory, except that reads go through the fetch callback
+	memory_interface_t fetch_memory;
+	// host addresses of recently accessed pages, indexed by the address, separately for reads and writes
+	arm_memory_map_entry_t memory_map[2][ARM_MEMORY_MAP_SIZE];
+	// NULL on a uniprocessor system
+	arm_global_monitor_t * global_monitor;
+	// memory written by other CPUs that might hold instructions decoded by this one, protected by the cpu_lock of the global monitor
+	bool invalidation_pending; // also read without the lock before every block
+	uint8_t pending_invalidation_count; // above ARM_PENDING_INVALIDATION_COUNT if all decoded instructions must be discarded
+	struct
+	{
+		uint64_t address;
+		uint64_t size;
+	} pending_invalidations[ARM_PENDING_INVALIDATION_COUNT];
+
+	// instruction decoders, specialized for the configuration if possible (see arm_select_decoders)
+	uint16_t (* a32_decode)(arm_state_t * cpu, uint32_t opcode);
+	uint16_t (* a64_decode)(arm_state_t * cpu, uint32_t opcode);
+	uint16_t (* t32_decode)(arm_state_t * cpu, uint16_t opcode1, uint16_t opcode2);
+	uint16_t (* t16_decode)(arm_state_t * cpu, uint16_t opcode1);
+	const char * decoder_profile; // name of the configuration the decoders are specialized for, NULL for the generic ones
+
+	// decoded instructions, indexed by the address
+	arm_decode_cache_entry_t decode_cache[ARM_DECODE_CACHE_SIZE];
+	// one bit for every page (hashed by its address) that might hold decoded instructions, writes to other pages do not need to search the decode cache
+	uint64_t decoded_pages[ARM_DECODED_PAGE_COUNT / 64];
+	uint64_t decode_cache_hits;
+	uint64_t decode_cache_misses;
+
+	// translated blocks, indexed by their first address
+	arm_block_t block_cache[ARM_BLOCK_CACHE_SIZE];
+	// pages holding translated blocks, indexed by the address, only writes to their marked words need to invalidate blocks
+	arm_code_page_t code_pages[ARM_CODE_PAGE_COUNT];
+	uint64_t block_cache_hits;
+	uint64_t block_cache_misses;
+
+	arm_jit_t jit;
 
 	jmp_buf exc;
 };
 
+// number of bytes at the start of arm_state_t that must be saved to restore the state later
+#define ARM_STATE_SNAPSHOT_SIZE offsetof(arm_state_t, memory)
+
 void arm_emu_init(arm_state_t * cpu, arm_configuration_t config, uint16_t supported_isas, const memory_interface_t * memory_interface);
+// initializes cpu as another CPU of the same system as source with a copy of its state and a cleared exclusive monitor, the caller must assign a new processor_id
+void arm_emu_clone(arm_state_t * cpu, arm_state_t * source);
+// releases the resources held by a CPU that is no longer running, the structure itself is not freed
+void arm_emu_free(arm_state_t * cpu);
+void arm_global_monitor_init(arm_global_monitor_t * monitor);
+// must be called before the CPU starts running, the other CPUs attached to the monitor may already be running
+void arm_global_monitor_attach(arm_global_monitor_t * monitor, arm_state_t * cpu);
+void arm_global_monitor_detach(arm_global_monitor_t * monitor, arm_state_t * cpu);
 void step(arm_state_t * cpu);
+// must be called if the pages returned by the map callback of the memory interface change
+void arm_memory_map_flush(arm_state_t * cpu);
+// executes instructions until an event stops the emulation or max_instructions have been executed (returns ARM_EMU_OK)
+// retired_instructions (if not NULL) receives the number of instructions executed, including the one that raised the event
+arm_emu_result_t arm_run(arm_state_t * cpu, uint64_t max_instructions, uint64_t * retired_instructions);
+
+// must be called after memory is written, also notifies the other CPUs attached to the global monitor
+void arm_decode_cache_invalidate(arm_state_t * cpu, uint64_t address, uint64_t size);
+void arm_decode_cache_flush(arm_state_t * cpu);
+void arm_block_cache_flush(arm_state_t * cpu);
+bool arm_jit_enable(arm_state_t * cpu);
+void arm_jit_free(arm_state_t * cpu);
 
 void arm_set_isa(arm_state_t * cpu, arm_instruction_set_t isa);
 arm_instruction_set_t arm_get_current_instruction_set(arm_state_t * cpu);
@@ -473,6 +699,7 @@ arm_instruction_set_t arm_get_current_instruction_set(arm_state_t * cpu);
 bool is_supported_isa(arm_state_t * cpu, arm_instruction_set_t isa);
 bool a32_is_arm26(arm_state_t * cpu);
 
+void arm_evaluate_flags(arm_state_t * cpu);
 uint32_t a32_get_cpsr(arm_state_t * cpu);
 void a32_set_cpsr(arm_state_t * cpu, uint32_t mask, uint32_t cpsr);
 
@@ -486,6 +713,7 @@ void a64_register_set64(arm_state_t * cpu, int regnum, bool_suppress_sp_t suppre
 
 arm_endianness_t a32_get_instruction_endianness(arm_state_t * cpu);
 arm_endianness_t a32_get_data_endianness(arm_state_t * cpu);
+arm_endianness_t a64_get_data_endianness(arm_state_t * cpu);
 
 uint8_t arm_memory_read8_data(arm_state_t * cpu, uint64_t address);
 uint16_t arm_memory_read16_data(arm_state_t * cpu, uint64_t address);
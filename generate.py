@@ -1676,7 +1676,30 @@ TABLEN = 24 # j32 only
 
 COUNTER = 0
 
-def generate_branches(mode, order, indent, method, cpnum = None):
+def format_condition(conditions, primary, known = ()):
+	# conditions is a list of conjuncts, with None standing for the opcode match in primary
+	# and (variable, mask, value, digits) for an excluded opcode pattern
+	# primary is a list of (variable, mask, value, digits) for each opcode word
+	# known lists (mask, value) for each word, the bits already tested by the decoder
+	tests = []
+	for i, (name, mask, value, digits) in enumerate(primary):
+		if i < len(known):
+			mask &= ~known[i][0]
+			value &= mask
+		if mask != 0:
+			tests.append(f"({name} & 0x{mask:0{digits}X}) == 0x{value:0{digits}X}")
+	parts = []
+	for condition in conditions:
+		if condition is None:
+			parts += tests
+		elif type(condition) is tuple:
+			name, mask, value, digits = condition
+			parts.append(f"({name} & 0x{mask:0{digits}X}) != 0x{value:0{digits}X}")
+		else:
+			parts.append(condition)
+	return ' && '.join(parts)
+
+def generate_branches(mode, order, indent, method, cpnum = None, dispatch = None):
 	global LINE_NUMBER, INS_LINE, COUNTER
 
 	# a32 - ARM26, ARM32
@@ -1696,6 +1719,13 @@ def generate_branches(mode, order, indent, method, cpnum = None):
 		assert mode in COPROC_ISAS
 		assert method == 'step'
 
+	if dispatch is not None:
+		# Instead of an if-else chain, generate the cases of a switch statement, and collect the conditions for the decoder
+		# Index 0 is reserved for undefined instructions
+		assert mode in {'a32', 'a64', 't16', 't32'}
+		case_indent = indent
+		indent = indent + '\t'
+
 	else_kwd = ''
 	for _, ins in sorted(order.items(), key = lambda pair: pair[0]):
 		INS_LINE = ins['#']
@@ -1744,40 +1774,39 @@ def generate_branches(mode, order, indent, method, cpnum = None):
 		if mode == 'a32' or mode == 'a64' or mode in COPROC_ISAS:
 			# 32-bit wide instructions
 
+			conditions = []
 			if mode == 'a32' and ins.get('a26') == 'yes':
-				is_arm26 = 'is_arm26' if method == 'parse' else 'a32_is_arm26(cpu)'
-				a26_condition = f"{is_arm26} && "
-			else:
-				a26_condition = ""
+				conditions.append('is_arm26' if method == 'parse' else 'a32_is_arm26(cpu)')
 			for m in ins.get('match', ()):
 				_, m_mask1, m_value1, _, _ = extract_mask(mode, m)
 				ins_assert((value1 & m_mask1) == (m_value1 & mask1))
 				mask1 |= m_mask1
 				value1 |= m_value1
-			condition = f"{a26_condition}(opcode & 0x{mask1:08X}) == 0x{value1:08X}"
+			primary = [('opcode', mask1, value1, 8)]
+			conditions.append(None)
 			for ex in ins.get('exclude', ()):
 				if '\texcept\t' in ex:
 					ex, tag = ex.split('\texcept\t')
-					_, mask1, value1, _, _ = extract_mask(mode, ex)
+					_, ex_mask1, ex_value1, _, _ = extract_mask(mode, ex)
 					feature = FEATURE_LIST[FEATURES[tag]]
 
 					assert type(feature) is str
 					predicate = f"({cpu}->config.features & (1 << {feature}))"
 
-					condition = f"{condition} && ((opcode & 0x{mask1:08X}) != 0x{value1:08X} || {predicate})"
+					conditions.append(f"((opcode & 0x{ex_mask1:08X}) != 0x{ex_value1:08X} || {predicate})")
 
 				elif '\twhen\t' in ex:
 					ex, ver = ex.split('\twhen\t')
 					features = VERSION_TYPES[ver]['a']['feature']
 					assert len(features) == 1
 					feature = FEATURE_LIST[features[0]]
-					_, mask1, value1, _, _ = extract_mask(mode, ex)
+					_, ex_mask1, ex_value1, _, _ = extract_mask(mode, ex)
 					assert type(feature) is str
-					condition = f"{condition} && ((opcode & 0x{mask1:08X}) != 0x{value1:08X} || !({cpu}->config.features & (1 << {feature})))"
+					conditions.append(f"((opcode & 0x{ex_mask1:08X}) != 0x{ex_value1:08X} || !({cpu}->config.features & (1 << {feature})))")
 
 				else:
-					_, mask1, value1, _, _ = extract_mask(mode, ex)
-					condition = f"{condition} && (opcode & 0x{mask1:08X}) != 0x{value1:08X}"
+					_, ex_mask1, ex_value1, _, _ = extract_mask(mode, ex)
+					conditions.append(f"(opcode & 0x{ex_mask1:08X}) != 0x{ex_value1:08X}")
 
 		elif mode == 't16' or mode == 't32':
 			# Thumb instruction set
@@ -1785,29 +1814,31 @@ def generate_branches(mode, order, indent, method, cpnum = None):
 			if method == 'parse':
 				is_thumbee = 'is_thumbee'
 				if 'it' not in ins:
-					it_condition = ""
+					it_condition = None
 				elif ins['it'] == 'yes':
-					it_condition = " && dis->t32.it_block_count > 0"
+					it_condition = "dis->t32.it_block_count > 0"
 				elif ins['it'] == 'no':
-					it_condition = " && dis->t32.it_block_count == 0"
+					it_condition = "dis->t32.it_block_count == 0"
 				elif ins['it'] == 'end':
-					it_condition = " && dis->t32.it_block_count <= 1"
+					it_condition = "dis->t32.it_block_count <= 1"
 				else:
 					ins_assert(False)
 			elif method == 'step':
 				is_thumbee = 't32_is_thumbee(cpu)'
 				if 'it' not in ins:
-					it_condition = ""
+					it_condition = None
 				elif ins['it'] == 'yes':
-					it_condition = " && t32_in_it_block(cpu)"
+					it_condition = "t32_in_it_block(cpu)"
 				elif ins['it'] == 'no':
-					it_condition = " && !t32_in_it_block(cpu)"
+					it_condition = "!t32_in_it_block(cpu)"
 				elif ins['it'] == 'end':
-					it_condition = " && (!t32_in_it_block(cpu) || t32_last_in_it_block(cpu))"
+					it_condition = "(!t32_in_it_block(cpu) || t32_last_in_it_block(cpu))"
 				else:
 					ins_assert(False)
 
-			ee_condition = f"{'' if ins['thumbee'] == 'yes' else '!'}{is_thumbee} && " if 'thumbee' in ins else ""
+			conditions = []
+			if 'thumbee' in ins:
+				conditions.append(f"{'' if ins['thumbee'] == 'yes' else '!'}{is_thumbee}")
 
 			if mode == 't16':
 				for m in ins.get('match', ()):
@@ -1816,10 +1847,13 @@ def generate_branches(mode, order, indent, method, cpnum = None):
 					mask1 |= m_mask1
 					value1 |= m_value1
 
-				condition = f"{ee_condition}(opcode1 & 0x{mask1:04X}) == 0x{value1:04X}{it_condition}"
+				primary = [('opcode1', mask1, value1, 4)]
+				conditions.append(None)
+				if it_condition is not None:
+					conditions.append(it_condition)
 				for ex in ins.get('exclude', ()):
-					_, mask1, value1, _, _ = extract_mask(mode, ex)
-					condition = f"{condition} && (opcode1 & 0x{mask1:04X}) != 0x{value1:04X}"
+					_, ex_mask1, ex_value1, _, _ = extract_mask(mode, ex)
+					conditions.append(('opcode1', ex_mask1, ex_value1, 4))
 			elif mode == 't32':
 				for m in ins.get('match', ()):
 					_, m_mask1, m_value1, m_mask2, m_value2 = extract_mask(mode, m)
@@ -1830,21 +1864,25 @@ def generate_branches(mode, order, indent, method, cpnum = None):
 					mask2 |= m_mask2
 					value2 |= m_value2
 
-				condition = f"{ee_condition}(opcode1 & 0x{mask1:04X}) == 0x{value1:04X} && (opcode2 & 0x{mask2:04X}) == 0x{value2:04X}{it_condition}"
+				primary = [('opcode1', mask1, value1, 4), ('opcode2', mask2, value2, 4)]
+				conditions.append(None)
+				if it_condition is not None:
+					conditions.append(it_condition)
 				for ex in ins.get('exclude', ()):
-					_, mask1, value1, mask2, value2 = extract_mask(mode, ex)
-					if mask2 == 0:
-						assert mask1 != 0
-						condition = f"{condition} && (opcode1 & 0x{mask1:04X}) != 0x{value1:04X}"
-					elif mask1 == 0:
-						condition = f"{condition} && (opcode2 & 0x{mask2:04X}) != 0x{value2:04X}"
+					_, ex_mask1, ex_value1, ex_mask2, ex_value2 = extract_mask(mode, ex)
+					if ex_mask2 == 0:
+						assert ex_mask1 != 0
+						conditions.append(f"(opcode1 & 0x{ex_mask1:04X}) != 0x{ex_value1:04X}")
+					elif ex_mask1 == 0:
+						conditions.append(f"(opcode2 & 0x{ex_mask2:04X}) != 0x{ex_value2:04X}")
 					else:
-						condition = f"{condition} && !((opcode1 & 0x{mask1:04X}) == 0x{value1:04X} && (opcode2 & 0x{mask2:04X}) == 0x{value2:04X})"
+						conditions.append(f"!((opcode1 & 0x{ex_mask1:04X}) == 0x{ex_value1:04X} && (opcode2 & 0x{ex_mask2:04X}) == 0x{ex_value2:04X})")
 			else:
 				ins_assert(False)
 
 		elif mode == 'j32':
-			condition = f"opcode == 0x{code:02X}"
+			primary = []
+			conditions = [f"opcode == 0x{code:02X}"]
 
 			if method == 'parse':
 				fetch8 = 'file_fetch8'
@@ -1876,20 +1914,20 @@ def generate_branches(mode, order, indent, method, cpnum = None):
 				if ins['added'] == 'JVM':
 					pass
 				elif ins['added'] == '5TEJ':
-					condition = f'{cpu}->config.jazelle_implementation == ARM_JAVA_JAZELLE && ' + condition
+					conditions.insert(0, f'{cpu}->config.jazelle_implementation == ARM_JAVA_JAZELLE')
 				elif ins['added'] == 'picoJava':
-					condition = f'{cpu}->config.jazelle_implementation >= ARM_JAVA_PICOJAVA && ' + condition
+					conditions.insert(0, f'{cpu}->config.jazelle_implementation >= ARM_JAVA_PICOJAVA')
 				elif ins['added'] == 'extension':
-					condition = f'{cpu}->config.jazelle_implementation >= ARM_JAVA_EXTENSION && ' + condition
+					conditions.insert(0, f'{cpu}->config.jazelle_implementation >= ARM_JAVA_EXTENSION')
 			elif method == 'step':
 				if 'usedby' not in ins:
 					pass # not used
 				elif ins['usedby'] == 'JVM':
-					condition = f'{cpu}->config.jazelle_implementation >= ARM_JAVA_EXTENSION && ' + condition
+					conditions.insert(0, f'{cpu}->config.jazelle_implementation >= ARM_JAVA_EXTENSION')
 				elif ins['usedby'] == '5TEJ':
-					condition = f'{cpu}->config.jazelle_implementation >= ARM_JAVA_JAZELLE && ' + condition
+					conditions.insert(0, f'{cpu}->config.jazelle_implementation >= ARM_JAVA_JAZELLE')
 				elif ins['usedby'] == 'picoJava' or ins['added'] == 'extension':
-					condition = f'{cpu}->config.jazelle_implementation >= ARM_JAVA_EXTENSION && ' + condition
+					conditions.insert(0, f'{cpu}->config.jazelle_implementation >= ARM_JAVA_EXTENSION')
 
 		elif added is None or added['type'] == 'main':
 			# non-coprocessor instructions
@@ -2067,14 +2105,14 @@ def generate_branches(mode, order, indent, method, cpnum = None):
 
 			if m_predicates is not None:
 				if predicates is not None:
-					condition = f'({m_profile_check} ? {m_predicates} : {predicates}) && ' + condition
+					conditions.insert(0, f'({m_profile_check} ? {m_predicates} : {predicates})')
 				else:
-					condition = f'(!{m_profile_check} || {m_predicates}) && ' + condition
+					conditions.insert(0, f'(!{m_profile_check} || {m_predicates})')
 			else:
 				if predicates is not None:
-					condition = predicates + ' && ' + condition
+					conditions.insert(0, predicates)
 				if m_intro is False:
-					condition = f'!{m_profile_check} && ' + condition
+					conditions.insert(0, f'!{m_profile_check}')
 
 		elif added['type'] == 'coproc':
 			# coprocessor instructions
@@ -2114,9 +2152,13 @@ def generate_branches(mode, order, indent, method, cpnum = None):
 				predicates = predicates1
 
 			if predicates is not None:
-				condition = predicates + ' && ' + condition
+				conditions.insert(0, predicates)
 
-		print_file(file, indent + f"{else_kwd}if({condition})")
+		if dispatch is not None:
+			dispatch.append((conditions, primary))
+			print_file(file, case_indent + f"case {len(dispatch)}:")
+		else:
+			print_file(file, indent + f"{else_kwd}if({format_condition(conditions, primary)})")
 		print_file(file, indent + "{")
 
 		if mode == 'j32':
@@ -2977,9 +3019,23 @@ def generate_branches(mode, order, indent, method, cpnum = None):
 				print_file(file, indent + "\treturn result;")
 
 		print_file(file, indent + "}")
-		else_kwd = 'else '
+		if dispatch is not None:
+			print_file(file, indent + "break;")
+		else:
+			else_kwd = 'else '
+
+	if dispatch is not None:
+		print_file(file, case_indent + "default:")
+		if method == 'parse':
+			print_file(file, indent + "printf(\"?\\n\");")
+		elif mode == 'a32':
+			print_file(file, indent + 'if(cpu->config.version >= ARMV4)')
+			print_file(file, indent + "\tarm_undefined(cpu);")
+		else:
+			print_file(file, indent + "arm_undefined(cpu);")
+		print_file(file, indent + "break;")
 
-	if method == 'parse':
+	elif method == 'parse':
 		if else_kwd != '':
 			print_file(file, indent + f"{else_kwd.strip()}")
 		print_file(file, indent + "{")
@@ -2995,7 +3051,7 @@ def generate_branches(mode, order, indent, method, cpnum = None):
 		if mode == 'j32':
 			print_file(file, indent + "dis->j32.wide = false;")
 
-	if method == 'step':
+	elif method == 'step':
 		if mode == 'a32':
 			print_file(file, indent + f'{else_kwd}if(cpu->config.version >= ARMV4)')
 		elif else_kwd != '':
@@ -3011,6 +3067,278 @@ def generate_branches(mode, order, indent, method, cpnum = None):
 
 		print_file(file, indent + "}")
 
+DECODER_LEAF_SIZE = 8 # largest candidate list tested sequentially
+DECODER_FIELD_SIZE = 6 # widest bit field a single switch dispatches on
+
+# Common configurations that get their own decoders, with the configuration dependent predicates folded into constants
+# Each entry lists the configuration (as set up by arm_emu_init) and the instruction sets to specialize
+STEP_PROFILES = [
+	('armv4t', {
+		'version': 'ARMV4',
+		'fp_version': '0',
+		'features': '((1 << FEATURE_SWP) | (1 << FEATURE_ARM32) | (1 << FEATURE_MULL) | (1 << FEATURE_THUMB) | (1 << FEATURE_JAZELLE))',
+		'jazelle_implementation': 'ARM_JAVA_JAZELLE',
+	}, ['a32', 't32', 't16']),
+	('armv5tej', {
+		'version': 'ARMV5',
+		'fp_version': '0',
+		'features': '((1 << FEATURE_SWP) | (1 << FEATURE_ARM32) | (1 << FEATURE_MULL) | (1 << FEATURE_THUMB) | (1 << FEATURE_ENH_DSP) | (1 << FEATURE_DSP_PAIR) | (1 << FEATURE_JAZELLE))',
+		'jazelle_implementation': 'ARM_JAVA_JAZELLE',
+	}, ['a32', 't32', 't16']),
+	('armv7a', {
+		'version': 'ARMV7',
+		'fp_version': '0',
+		'features': '(ARM_PROFILE_A | (1 << FEATURE_SWP) | (1 << FEATURE_ARM32) | (1 << FEATURE_MULL) | (1 << FEATURE_THUMB) | (1 << FEATURE_ENH_DSP) | (1 << FEATURE_DSP_PAIR) | (1 << FEATURE_JAZELLE) | (1 << FEATURE_THUMB2))',
+		'jazelle_implementation': 'ARM_JAVA_JAZELLE',
+	}, ['a32', 't32', 't16']),
+	('armv8a', {
+		'version': 'ARMV8',
+		'fp_version': '0',
+		'features': '(ARM_PROFILE_A | (1 << FEATURE_SWP) | (1 << FEATURE_ARM32) | (1 << FEATURE_MULL) | (1 << FEATURE_THUMB) | (1 << FEATURE_ENH_DSP) | (1 << FEATURE_DSP_PAIR) | (1 << FEATURE_JAZELLE) | (1 << FEATURE_MULTIPROC) | (1 << FEATURE_THUMB2) | (1 << FEATURE_SECURITY) | (1 << FEATURE_VIRTUALIZATION) | (1 << FEATURE_ARM64))',
+		'jazelle_implementation': 'ARM_JAVA_JAZELLE',
+	}, ['a32', 'a64', 't32', 't16']),
+]
+
+# The ways the conditions read the configuration, arm_select_decoders only picks a profile if each of them gives the same result as for the profile
+CONFIG_PREDICATE = re.compile(r'\(cpu->config\.features & FEATURE_PROFILE_MASK\) [=!]= \w+|cpu->config\.features & \(1 << \w+\)|cpu->config\.\w+ (?:>=|<=|==|!=|<|>) \w+')
+# for each profile, the configuration predicates folded into its decoders
+STEP_PROFILE_PREDICATES = {}
+
+def specialize_dispatch(dispatch, profile):
+	# Replaces the configuration fields in the run time conditions by the values of the profile, so that the C compiler can fold them
+	if profile is None:
+		return dispatch
+	name, config, _ = profile
+	predicates = STEP_PROFILE_PREDICATES.setdefault(name, set())
+	specialized = []
+	for conditions, primary in dispatch:
+		conditions = list(conditions)
+		for condition_index, condition in enumerate(conditions):
+			if type(condition) is str:
+				predicates.update(CONFIG_PREDICATE.findall(condition))
+				assert 'cpu->config.' not in CONFIG_PREDICATE.sub('', condition), f"Unrecognized configuration predicate: {condition}"
+				for field, value in config.items():
+					condition = condition.replace(f'cpu->config.{field}', value)
+				conditions[condition_index] = condition
+		specialized.append((conditions, primary))
+	return specialized
+
+def build_decoder_tree(entries, width, word_size, known_mask = 0):
+	# entries is a list of (index, mask, value), in the order they must be tested
+	# The opcode is made up of words of word_size bits, a field may not cross a word boundary
+	# Returns either ('leaf', entries) or ('switch', shift, size, children), where the children are indexed by the field value
+	if len(entries) <= DECODER_LEAF_SIZE:
+		return ('leaf', entries)
+
+	best = None
+	for size in range(1, DECODER_FIELD_SIZE + 1):
+		field_mask = (1 << size) - 1
+		for shift in range(width - size + 1):
+			if (known_mask >> shift) & field_mask:
+				continue
+			if shift // word_size != (shift + size - 1) // word_size:
+				continue
+			total = 0
+			buckets = [0] * (1 << size)
+			for _, mask, value in entries:
+				fmask = (mask >> shift) & field_mask
+				fvalue = (value >> shift) & field_mask
+				if fmask == field_mask:
+					buckets[fvalue] += 1
+					total += 1
+				else:
+					for key in range(1 << size):
+						if (key & fmask) == fvalue:
+							buckets[key] += 1
+							total += 1
+			largest = max(buckets)
+			if largest == len(entries):
+				continue
+			# prefer fields that split evenly without duplicating entries across many cases
+			cost = (total / (1 << size) + largest) * (total / len(entries)) ** 0.5
+			if best is None or cost < best[0]:
+				best = (cost, shift, size)
+
+	if best is None:
+		return ('leaf', entries)
+
+	_, shift, size = best
+	field_mask = (1 << size) - 1
+	children = []
+	subtrees = {}
+	for key in range(1 << size):
+		subset = [entry for entry in entries if (((entry[1] >> shift) & field_mask) & key) == ((entry[2] >> shift) & field_mask)]
+		signature = tuple(entry[0] for entry in subset)
+		if signature not in subtrees:
+			subtrees[signature] = build_decoder_tree(subset, width, word_size, known_mask | (field_mask << shift))
+		children.append(subtrees[signature])
+	return ('switch', shift, size, children)
+
+def print_decoder_tree(file, tree, indent, dispatch, words, word_size, known_mask = 0, known_value = 0):
+	# words lists the opcode variables, starting with the most significant
+	word_mask = (1 << word_size) - 1
+	if tree[0] == 'leaf':
+		known = []
+		for word_index in range(len(words)):
+			word_shift = (len(words) - 1 - word_index) * word_size
+			known.append(((known_mask >> word_shift) & word_mask, (known_value >> word_shift) & word_mask))
+		for index, _, _ in tree[1]:
+			conditions, primary = dispatch[index - 1]
+			condition = format_condition(conditions, primary, known)
+			if condition == '':
+				print_file(file, indent + f"return {index};")
+				return
+			print_file(file, indent + f"if({condition})")
+			print_file(file, indent + f"\treturn {index};")
+		print_file(file, indent + "return 0;")
+		return
+
+	_, shift, size, children = tree
+	field_mask = (1 << size) - 1
+	var = words[len(words) - 1 - shift // word_size]
+	if shift % word_size == 0:
+		print_file(file, indent + f"switch({var} & 0x{field_mask:X})")
+	else:
+		print_file(file, indent + f"switch(({var} >> {shift % word_size}) & 0x{field_mask:X})")
+	print_file(file, indent + "{")
+	# group the cases that share the same subtree, the largest group becomes the default
+	groups = []
+	for key, child in enumerate(children):
+		for group in groups:
+			if group[0] is child:
+				group[1].append(key)
+				break
+		else:
+			groups.append((child, [key]))
+	default = max(range(len(groups)), key = lambda group_index: len(groups[group_index][1]))
+	groups.append(groups.pop(default))
+	for group_index, (child, keys) in enumerate(groups):
+		if group_index == len(groups) - 1:
+			print_file(file, indent + "default:")
+		else:
+			for key in keys:
+				print_file(file, indent + f"case {key}:")
+		# only the bits shared by all the keys of the group are known
+		common_mask = field_mask
+		for key in keys:
+			common_mask &= ~(key ^ keys[0])
+		print_decoder_tree(file, child, indent + "\t", dispatch, words, word_size, known_mask | (common_mask << shift), known_value | ((keys[0] & common_mask) << shift))
+	print_file(file, indent + "}")
+
+def generate_decoder(file, mode, method, dispatch, profile = None):
+	# Generates a function that returns the index of the first matching instruction (or 0 if none), using a decision tree over the opcode bits
+	# If a profile is given, the function is specialized for that configuration
+	if mode == 't32':
+		words = ['opcode1', 'opcode2']
+		opcode_parameters = 'uint16_t opcode1, uint16_t opcode2'
+	else:
+		words = ['opcode']
+		opcode_parameters = 'uint32_t opcode'
+	word_size = 32 // len(words)
+
+	if method == 'parse':
+		extra_parameters = {'a32': ', bool is_arm26', 't32': ', bool is_thumbee'}.get(mode, '')
+		print_file(file, f'uint16_t {mode}_parse_decode(arm_parser_state_t * dis, {opcode_parameters}{extra_parameters})')
+	elif method == 'step' and profile is None:
+		print_file(file, f'uint16_t {mode}_step_decode(arm_state_t * cpu, {opcode_parameters})')
+	elif method == 'step':
+		print_file(file, f'static uint16_t {mode}_step_decode_{profile[0]}(arm_state_t * cpu, {opcode_parameters})')
+	print_file(file, '{')
+
+	dispatch = specialize_dispatch(dispatch, profile)
+	entries = []
+	for index, (conditions, primary) in enumerate(dispatch, 1):
+		assert len(primary) == len(words)
+		mask = 0
+		value = 0
+		for _, word_mask, word_value, _ in primary:
+			mask = (mask << word_size) | word_mask
+			value = (value << word_size) | word_value
+		entries.append((index, mask, value))
+	tree = build_decoder_tree(entries, 32, word_size)
+	print_decoder_tree(file, tree, '\t', dispatch, words, word_size)
+
+	print_file(file, '}')
+
+def generate_decode_table(file, mode, method, dispatch, profile = None):
+	# Generates a function that returns the index of the first matching 16-bit instruction (or 0 if none)
+	# Opcode masks and excluded patterns are resolved for all 65536 opcodes when generating the table, leaving only the run time conditions (version, features, IT block, ThumbEE state)
+	# A table entry is either an instruction index, or if bit 15 is set, a list of candidates to test in order
+	# If a profile is given, only the function is generated, specialized for that configuration, and it shares the table of the generic function
+	candidates = [[] for opcode in range(0x10000)]
+	resolved = [False] * 0x10000
+	for index, (conditions, primary) in enumerate(dispatch, 1):
+		assert len(primary) == 1
+		_, mask, value, _ = primary[0]
+		excludes = [condition for condition in conditions if type(condition) is tuple]
+		unconditional = all(condition is None or type(condition) is tuple for condition in conditions)
+		free = ~mask & 0xFFFF
+		opcode = 0
+		while True:
+			opcode1 = value | opcode
+			if not resolved[opcode1] and all((opcode1 & ex_mask) != ex_value for _, ex_mask, ex_value, _ in excludes):
+				candidates[opcode1].append(index)
+				if unconditional:
+					resolved[opcode1] = True
+			if opcode == free:
+				break
+			opcode = ((opcode | mask) + 1) & free
+
+	lists = {}
+	table = []
+	for opcode1 in range(0x10000):
+		entry = tuple(candidates[opcode1])
+		if len(entry) == 0:
+			table.append(0)
+		elif resolved[opcode1] and len(entry) == 1:
+			table.append(entry[0])
+		else:
+			if entry not in lists:
+				lists[entry] = len(lists)
+			table.append(0x8000 | lists[entry])
+
+	assert len(dispatch) < 0x8000 and 0 < len(lists) < 0x8000
+
+	if profile is None:
+		print_file(file, f'static const uint16_t {mode}_{method}_decode_table[0x10000] =')
+		print_file(file, '{')
+		for row in range(0, 0x10000, 16):
+			print_file(file, '\t' + ' '.join(f'0x{entry:04X},' for entry in table[row:row + 16]))
+		print_file(file, '};')
+
+	if method == 'parse':
+		print_file(file, f'uint16_t {mode}_parse_decode(arm_parser_state_t * dis, uint16_t opcode1, bool is_thumbee)')
+	elif method == 'step' and profile is None:
+		print_file(file, f'uint16_t {mode}_step_decode(arm_state_t * cpu, uint16_t opcode1)')
+	elif method == 'step':
+		print_file(file, f'static uint16_t {mode}_step_decode_{profile[0]}(arm_state_t * cpu, uint16_t opcode1)')
+	print_file(file, '{')
+
+	dispatch = specialize_dispatch(dispatch, profile)
+	print_file(file, f'\tuint16_t entry = {mode}_{method}_decode_table[opcode1];')
+	print_file(file, '\tif(!(entry & 0x8000))')
+	print_file(file, '\t\treturn entry;')
+	print_file(file, '\tswitch(entry & 0x7FFF)')
+	print_file(file, '\t{')
+	for number, (entry, list_id) in enumerate(lists.items()):
+		if number == len(lists) - 1:
+			print_file(file, '\tdefault:')
+		else:
+			print_file(file, f'\tcase {list_id}:')
+		for index in entry:
+			conditions, primary = dispatch[index - 1]
+			# the opcode is already matched, only keep the run time conditions
+			condition = ' && '.join(condition for condition in conditions if type(condition) is str)
+			if condition == '':
+				print_file(file, f'\t\treturn {index};')
+				break
+			print_file(file, f'\t\tif({condition})')
+			print_file(file, f'\t\t\treturn {index};')
+		else:
+			print_file(file, '\t\treturn 0;')
+	print_file(file, '\t}')
+	print_file(file, '}')
+
 def generate_all(method, file):
 	global LINE_NUMBER
 
@@ -3089,16 +3417,33 @@ def generate_all(method, file):
 
 	#### A32
 
+	a32_dispatch = []
+	print_file(file, f'void a32_{method}_execute({args}, uint32_t opcode, uint16_t index)')
+	print_file(file, '{')
+	print_file(file, '\tswitch(index)')
+	print_file(file, '\t{')
+	generate_branches('a32', a32_order, '\t', method, dispatch = a32_dispatch)
+	print_file(file, '\t}')
+	print_file(file, '}')
+
+	generate_decoder(file, 'a32', method, a32_dispatch)
+	if method == 'step':
+		for profile in STEP_PROFILES:
+			if 'a32' in profile[2]:
+				generate_decoder(file, 'a32', method, a32_dispatch, profile)
+
 	print_file(file, f'void a32_{method}({args}{", bool is_arm26" if method == "parse" else ""})')
 	print_file(file, '{')
 	if method == 'parse':
 		print_file(file, '\tuint32_t old_pc = dis->pc;')
 	elif method == 'step':
-		print_file(file, '\tif(setjmp(cpu->exc))')
-		print_file(file, '\t\treturn;')
 		print_file(file, '\tcpu->old_pc = cpu->r[PC];')
 
-	print_file(file, f'\tuint32_t opcode = {a32_fetch}32({cpu});')
+	if method == 'parse':
+		print_file(file, f'\tuint32_t opcode = {a32_fetch}32({cpu});')
+	elif method == 'step':
+		print_file(file, '\tuint32_t opcode;')
+		print_file(file, '\tuint16_t index = a32_fetch_decoded(cpu, &opcode);')
 	if method == 'parse':
 		print_file(file, '\tif(opcode == 0)')
 		print_file(file, '\t{')
@@ -3121,22 +3466,42 @@ def generate_all(method, file):
 		print_file(file, '\tprintf("[%08X]\\t", old_pc);')
 		print_file(file, f'\tprintf("<%08X>\\t", opcode);')
 
-	generate_branches('a32', a32_order, '\t', method)
+	if method == 'parse':
+		print_file(file, '\ta32_parse_execute(dis, opcode, a32_parse_decode(dis, opcode, is_arm26));')
+	elif method == 'step':
+		print_file(file, '\ta32_step_execute(cpu, opcode, index);')
 
 	print_file(file, "}")
 
 	#### A64
 
+	a64_dispatch = []
+	print_file(file, f'void a64_{method}_execute({args}, uint32_t opcode, uint16_t index)')
+	print_file(file, '{')
+	print_file(file, '\tswitch(index)')
+	print_file(file, '\t{')
+	generate_branches('a64', a64_order, '\t', method, dispatch = a64_dispatch)
+	print_file(file, '\t}')
+	print_file(file, '}')
+
+	generate_decoder(file, 'a64', method, a64_dispatch)
+	if method == 'step':
+		for profile in STEP_PROFILES:
+			if 'a64' in profile[2]:
+				generate_decoder(file, 'a64', method, a64_dispatch, profile)
+
 	print_file(file, f"void a64_{method}({args})")
 	print_file(file, '{')
 	if method == 'parse':
 		print_file(file, '\tuint64_t old_pc = dis->pc;')
 	elif method == 'step':
-		print_file(file, '\tif(setjmp(cpu->exc))')
-		print_file(file, '\t\treturn;')
 		print_file(file, '\tcpu->old_pc = cpu->r[PC];')
 
-	print_file(file, f'\tuint32_t opcode = {a64_fetch}32({cpu});')
+	if method == 'parse':
+		print_file(file, f'\tuint32_t opcode = {a64_fetch}32({cpu});')
+	elif method == 'step':
+		print_file(file, '\tuint32_t opcode;')
+		print_file(file, '\tuint16_t index = a64_fetch_decoded(cpu, &opcode);')
 	if method == 'parse':
 		print_file(file, '\tif(opcode == 0)')
 		print_file(file, '\t{')
@@ -3159,29 +3524,62 @@ def generate_all(method, file):
 		print_file(file, '\tprintf("[%016"PRIX64"]\\t", old_pc);')
 		print_file(file, '\tprintf("<%08X>\\t", opcode);')
 
-	generate_branches('a64', a64_order, '\t', method)
+	if method == 'parse':
+		print_file(file, '\ta64_parse_execute(dis, opcode, a64_parse_decode(dis, opcode));')
+	elif method == 'step':
+		print_file(file, '\ta64_step_execute(cpu, opcode, index);')
 
 	print_file(file, "}")
 
 	#### T32
 
+	t32_dispatch = []
+	t16_dispatch = []
+
+	if method == 'parse':
+		print_file(file, 'uint16_t t32_parse_decode(arm_parser_state_t * dis, uint16_t opcode1, uint16_t opcode2, bool is_thumbee);')
+		print_file(file, 'uint16_t t16_parse_decode(arm_parser_state_t * dis, uint16_t opcode1, bool is_thumbee);')
+	elif method == 'step':
+		# the IT instruction returns early, so that the IT state is not advanced
+		print_file(file, 'void t32_step_execute(arm_state_t * cpu, uint16_t opcode1, uint16_t opcode2, uint16_t index)')
+		print_file(file, '{')
+		print_file(file, '\tswitch(index)')
+		print_file(file, '\t{')
+		generate_branches('t32', t32_order, '\t', method, dispatch = t32_dispatch)
+		print_file(file, '\t}')
+		print_file(file, '\tt32_advance_it(cpu);')
+		print_file(file, '}')
+
+		print_file(file, 'void t16_step_execute(arm_state_t * cpu, uint16_t opcode1, uint16_t index)')
+		print_file(file, '{')
+		print_file(file, '\tswitch(index)')
+		print_file(file, '\t{')
+		generate_branches('t16', t16_order, '\t', method, dispatch = t16_dispatch)
+		print_file(file, '\t}')
+		print_file(file, '\tt32_advance_it(cpu);')
+		print_file(file, '}')
+
 	print_file(file, f"void t32_{method}({args}{', bool is_thumbee' if method == 'parse' else ''})")
 	print_file(file, '{')
 
 	if method == 'parse':
 		print_file(file, '\tuint32_t old_pc = dis->pc;')
 	elif method == 'step':
-		print_file(file, '\tif(setjmp(cpu->exc))')
-		print_file(file, '\t{')
-		print_file(file, '\t\tt32_set_it_state(cpu, 0);')
-		print_file(file, '\t\treturn;')
-		print_file(file, '\t}')
 		print_file(file, '\tcpu->old_pc = cpu->r[PC];')
-	print_file(file, f'\tuint16_t opcode1 = {a32_fetch}16({cpu});')
-	is_thumb2 = f'(({cpu}->config.features & (1 << FEATURE_THUMB2)) || (({cpu}->config.features & FEATURE_PROFILE_MASK) == ARM_PROFILE_M))'
-	print_file(file, f'\tif({is_thumb2} && ((opcode1 & 0xF800) == 0xE800 || (opcode1 & 0xF800) == 0xF000 || (opcode1 & 0xF800) == 0xF800))')
-	print_file(file, '\t{')
-	print_file(file, f'\t\tuint16_t opcode2 = {a32_fetch}16({cpu});')
+	if method == 'parse':
+		print_file(file, '\tuint16_t opcode1 = file_fetch16(dis);')
+		is_thumb2 = '((dis->config.features & (1 << FEATURE_THUMB2)) || ((dis->config.features & FEATURE_PROFILE_MASK) == ARM_PROFILE_M))'
+		print_file(file, f'\tif({is_thumb2} && ((opcode1 & 0xF800) == 0xE800 || (opcode1 & 0xF800) == 0xF000 || (opcode1 & 0xF800) == 0xF800))')
+		print_file(file, '\t{')
+		print_file(file, '\t\tuint16_t opcode2 = file_fetch16(dis);')
+	elif method == 'step':
+		print_file(file, '\tuint16_t opcode1;')
+		print_file(file, '\tuint16_t opcode2;')
+		print_file(file, '\tuint16_t index;')
+		print_file(file, '\tif(t32_fetch_decoded(cpu, &opcode1, &opcode2, &index))')
+		print_file(file, '\t\tt32_step_execute(cpu, opcode1, opcode2, index);')
+		print_file(file, '\telse')
+		print_file(file, '\t\tt16_step_execute(cpu, opcode1, index);')
 	if method == 'parse':
 		print_file(file, '\t\tif(opcode1 == 0 && opcode2 == 0)')
 		print_file(file, '\t\t{')
@@ -3204,14 +3602,16 @@ def generate_all(method, file):
 		print_file(file, '\t\tprintf("[%08X]\\t", old_pc);')
 		print_file(file, '\t\tprintf("<%04X %04X>\\t", opcode1, opcode2);')
 
-	#### T32, 32-bit
+		#### T32, 32-bit
 
-	generate_branches('t32', t32_order, '\t\t', method)
+		print_file(file, '\t\tswitch(t32_parse_decode(dis, opcode1, opcode2, is_thumbee))')
+		print_file(file, '\t\t{')
+		generate_branches('t32', t32_order, '\t\t', method, dispatch = t32_dispatch)
+		print_file(file, '\t\t}')
 
-	print_file(file, '\t}')
-	print_file(file, '\telse')
-	print_file(file, '\t{')
-	if method == 'parse':
+		print_file(file, '\t}')
+		print_file(file, '\telse')
+		print_file(file, '\t{')
 		print_file(file, '\t\tif(opcode1 == 0)')
 		print_file(file, '\t\t{')
 		print_file(file, '\t\t\tswitch(dis->input_null_count++)')
@@ -3233,13 +3633,15 @@ def generate_all(method, file):
 		print_file(file, '\t\tprintf("[%08X]\\t", old_pc);')
 		print_file(file, '\t\tprintf("<%04X>\\t\\t", opcode1);')
 
-	#### T32, 16-bit
+		#### T32, 16-bit
 
-	generate_branches('t16', t16_order, '\t\t', method)
+		print_file(file, '\t\tswitch(t16_parse_decode(dis, opcode1, is_thumbee))')
+		print_file(file, '\t\t{')
+		generate_branches('t16', t16_order, '\t\t', method, dispatch = t16_dispatch)
+		print_file(file, '\t\t}')
 
-	print_file(file, "\t}")
+		print_file(file, "\t}")
 
-	if method == 'parse':
 		print_file(file, "\tif(dis->t32.it_block_count > 0)")
 		print_file(file, "\t{")
 		print_file(file, "\t\tdis->t32.it_block_count --;")
@@ -3247,11 +3649,18 @@ def generate_all(method, file):
 		print_file(file, "\t\tif(dis->t32.it_block_count == 0)")
 		print_file(file, "\t\t\tdis->t32.it_block_condition = COND_ALWAYS;")
 		print_file(file, "\t}")
-	elif method == 'step':
-		print_file(file, "\tt32_advance_it(cpu);")
 
 	print_file(file, "}")
 
+	generate_decoder(file, 't32', method, t32_dispatch)
+	generate_decode_table(file, 't16', method, t16_dispatch)
+	if method == 'step':
+		for profile in STEP_PROFILES:
+			if 't32' in profile[2]:
+				generate_decoder(file, 't32', method, t32_dispatch, profile)
+			if 't16' in profile[2]:
+				generate_decode_table(file, 't16', method, t16_dispatch, profile)
+
 	#### Java
 
 	print_file(file, f"void j32_{method}({args})")
@@ -3259,8 +3668,6 @@ def generate_all(method, file):
 	if method == 'parse':
 		print_file(file, '\tuint32_t old_pc = dis->pc;')
 	elif method == 'step':
-		print_file(file, '\tif(setjmp(cpu->exc))')
-		print_file(file, '\t\treturn;')
 		print_file(file, '\tcpu->old_pc = cpu->r[PC];')
 	if method == 'parse':
 		print_file(file, '\tif(dis->j32.parse_state_count <= 0)')
@@ -3337,6 +3744,34 @@ def generate_all(method, file):
 
 	print_file(file, "}")
 
+	#### Decoder selection
+
+	if method == 'step':
+		print_file(file, 'void arm_select_decoders(arm_state_t * cpu)')
+		print_file(file, '{')
+		for profile_index, (name, config, modes) in enumerate(STEP_PROFILES):
+			# fields and feature bits that no condition reads may differ from the profile
+			condition = []
+			for predicate in sorted(STEP_PROFILE_PREDICATES.get(name, ())):
+				folded = predicate
+				for field, value in config.items():
+					folded = folded.replace(f'cpu->config.{field}', value)
+				condition.append(f'!({predicate}) == !({folded})')
+			condition = '\n\t\t&& '.join(condition) if len(condition) > 0 else 'true'
+			print_file(file, f'\t{"else " if profile_index > 0 else ""}if({condition})')
+			print_file(file, '\t{')
+			for mode in ['a32', 'a64', 't32', 't16']:
+				print_file(file, f'\t\tcpu->{mode}_decode = {mode}_step_decode{"_" + name if mode in modes else ""};')
+			print_file(file, f'\t\tcpu->decoder_profile = "{name}";')
+			print_file(file, '\t}')
+		print_file(file, '\telse')
+		print_file(file, '\t{')
+		for mode in ['a32', 'a64', 't32', 't16']:
+			print_file(file, f'\t\tcpu->{mode}_decode = {mode}_step_decode;')
+		print_file(file, '\t\tcpu->decoder_profile = NULL;')
+		print_file(file, '\t}')
+		print_file(file, '}')
+
 if PARSE_FILE is not None:
 	GEN_FILE = PARSE_FILE
 	with open(GEN_FILE, 'w') as file:
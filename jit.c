@@ -0,0 +1,1090 @@
+
+/* Native code generation for A32/ARM26/A64 blocks, must be included from emu.c for proper behavior */
+
+/*
+	Hot blocks (see step_block) are translated into x86-64 machine code, one host function per block
+	The generated code keeps all guest state in the arm_state_t structure, pointed to by RBX, so that it can be freely mixed with the interpreter
+	Integer data processing instructions and direct branches are translated inline, A64 loads and stores call the memory access routines directly
+	Every other instruction is executed by calling the interpreter routine for its decoded index, after which the block is left if the instruction
+	branched away, changed the processor state the block was translated for, or invalidated the block
+	Exceptions raised by the interpreter routines unwind through the generated code, since it does not keep any state on the host stack apart from RBX
+*/
+
+#if defined(__x86_64__)
+# include <sys/mman.h>
+
+#ifndef ARM_JIT_MAX_BLOCK_SIZE
+# define ARM_JIT_MAX_BLOCK_SIZE 0x2000 // upper limit on the native code generated for a single block
+#endif
+
+enum
+{
+	X86_EAX = 0,
+	X86_ECX = 1,
+	X86_EDX = 2,
+	X86_EBX = 3, // pointer to the arm_state_t
+	X86_ESI = 6,
+	X86_EDI = 7,
+};
+
+// condition codes for Jcc/SETcc
+enum
+{
+	X86_CC_O = 0x0,
+	X86_CC_C = 0x2,
+	X86_CC_NC = 0x3,
+	X86_CC_Z = 0x4,
+	X86_CC_NZ = 0x5,
+	X86_CC_S = 0x8,
+};
+
+// opcodes for the "op r/m32, r32" form
+enum
+{
+	X86_ADD = 0x01,
+	X86_OR = 0x09,
+	X86_ADC = 0x11,
+	X86_SBB = 0x19,
+	X86_AND = 0x21,
+	X86_SUB = 0x29,
+	X86_XOR = 0x31,
+	X86_CMP = 0x39,
+	X86_TEST = 0x85,
+	X86_MOV = 0x89,
+};
+
+// ModRM extensions for the immediate forms
+enum
+{
+	X86_EXT_ADD = 0,
+	X86_EXT_OR = 1,
+	X86_EXT_AND = 4,
+	X86_EXT_CMP = 7,
+
+	X86_EXT_ROR = 1,
+	X86_EXT_SHL = 4,
+	X86_EXT_SHR = 5,
+	X86_EXT_SAR = 7,
+};
+
+typedef struct jit_emitter_t
+{
+	uint8_t * code;
+	size_t length;
+	size_t limit;
+	arm_block_t * block; // the block being translated
+} jit_emitter_t;
+
+static inline void jit_emit8(jit_emitter_t * e, uint8_t value)
+{
+	if(e->length < e->limit)
+		e->code[e->length] = value;
+	e->length++;
+}
+
+static inline void jit_emit32(jit_emitter_t * e, uint32_t value)
+{
+	for(int i = 0; i < 4; i++)
+		jit_emit8(e, value >> (8 * i));
+}
+
+static inline void jit_emit64(jit_emitter_t * e, uint64_t value)
+{
+	for(int i = 0; i < 8; i++)
+		jit_emit8(e, value >> (8 * i));
+}
+
+static inline void jit_emit_modrm_rr(jit_emitter_t * e, int reg, int rm)
+{
+	jit_emit8(e, 0xC0 | (reg << 3) | rm);
+}
+
+// [rbx + offset]
+static inline void jit_emit_modrm_state(jit_emitter_t * e, int reg, size_t offset)
+{
+	jit_emit8(e, 0x80 | (reg << 3) | X86_EBX);
+	jit_emit32(e, offset);
+}
+
+// prefix for the 64-bit version of the following instruction
+static inline void jit_rex_w(jit_emitter_t * e)
+{
+	jit_emit8(e, 0x48);
+}
+
+static inline void jit_load32(jit_emitter_t * e, int reg, size_t offset)
+{
+	jit_emit8(e, 0x8B);
+	jit_emit_modrm_state(e, reg, offset);
+}
+
+static inline void jit_load64(jit_emitter_t * e, int reg, size_t offset)
+{
+	jit_rex_w(e);
+	jit_load32(e, reg, offset);
+}
+
+static inline void jit_load8(jit_emitter_t * e, int reg, size_t offset)
+{
+	// movzx
+	jit_emit8(e, 0x0F);
+	jit_emit8(e, 0xB6);
+	jit_emit_modrm_state(e, reg, offset);
+}
+
+// the upper half of the register is always clear after a 32-bit operation
+static inline void jit_store64(jit_emitter_t * e, int reg, size_t offset)
+{
+	jit_rex_w(e);
+	jit_emit8(e, 0x89);
+	jit_emit_modrm_state(e, reg, offset);
+}
+
+static inline void jit_store8(jit_emitter_t * e, int reg, size_t offset)
+{
+	jit_emit8(e, 0x88);
+	jit_emit_modrm_state(e, reg, offset);
+}
+
+static inline void jit_mov_immediate64(jit_emitter_t * e, int reg, uint64_t value)
+{
+	if(value <= 0xFFFFFFFF)
+	{
+		// zero extended
+		jit_emit8(e, 0xB8 | reg);
+		jit_emit32(e, value);
+	}
+	else
+	{
+		jit_rex_w(e);
+		jit_emit8(e, 0xB8 | reg);
+		jit_emit64(e, value);
+	}
+}
+
+static inline void jit_store_immediate64(jit_emitter_t * e, size_t offset, uint64_t value)
+{
+	jit_mov_immediate64(e, X86_EAX, value);
+	jit_store64(e, X86_EAX, offset);
+}
+
+static inline void jit_mov_immediate(jit_emitter_t * e, int reg, uint32_t value)
+{
+	jit_emit8(e, 0xB8 | reg);
+	jit_emit32(e, value);
+}
+
+static inline void jit_alu(jit_emitter_t * e, int opcode, int dst, int src)
+{
+	jit_emit8(e, opcode);
+	jit_emit_modrm_rr(e, src, dst);
+}
+
+static inline void jit_alu_immediate(jit_emitter_t * e, int extension, int reg, uint32_t value)
+{
+	jit_emit8(e, 0x81);
+	jit_emit_modrm_rr(e, extension, reg);
+	jit_emit32(e, value);
+}
+
+static inline void jit_shift(jit_emitter_t * e, int extension, int reg, uint8_t amount)
+{
+	jit_emit8(e, 0xC1);
+	jit_emit_modrm_rr(e, extension, reg);
+	jit_emit8(e, amount);
+}
+
+static inline void jit_not(jit_emitter_t * e, int reg)
+{
+	jit_emit8(e, 0xF7);
+	jit_emit_modrm_rr(e, 2, reg);
+}
+
+// sets the register to 0 or 1
+static inline void jit_setcc(jit_emitter_t * e, int cc, int reg)
+{
+	// without a REX prefix, the low byte of ESI/EDI would be encoded as DH/BH instead
+	if(reg >= 4)
+		jit_emit8(e, 0x40);
+	jit_emit8(e, 0x0F);
+	jit_emit8(e, 0x90 | cc);
+	jit_emit_modrm_rr(e, 0, reg);
+	// movzx
+	if(reg >= 4)
+		jit_emit8(e, 0x40);
+	jit_emit8(e, 0x0F);
+	jit_emit8(e, 0xB6);
+	jit_emit_modrm_rr(e, reg, reg);
+}
+
+// copies a bit of the register into the carry flag
+static inline void jit_bt_immediate(jit_emitter_t * e, int reg, uint8_t bit)
+{
+	jit_emit8(e, 0x0F);
+	jit_emit8(e, 0xBA);
+	jit_emit_modrm_rr(e, 4, reg);
+	jit_emit8(e, bit);
+}
+
+static inline void jit_bt(jit_emitter_t * e, int reg, int bit)
+{
+	jit_emit8(e, 0x0F);
+	jit_emit8(e, 0xA3);
+	jit_emit_modrm_rr(e, bit, reg);
+}
+
+static inline void jit_cmc(jit_emitter_t * e)
+{
+	jit_emit8(e, 0xF5);
+}
+
+// returns the location to be patched once the target is known
+static inline size_t jit_jcc_forward(jit_emitter_t * e, int cc)
+{
+	jit_emit8(e, 0x0F);
+	jit_emit8(e, 0x80 | cc);
+	jit_emit32(e, 0);
+	return e->length;
+}
+
+static inline void jit_patch_forward(jit_emitter_t * e, size_t location)
+{
+	if(location <= e->limit)
+	{
+		uint32_t displacement = e->length - location;
+		memcpy(&e->code[location - 4], &displacement, 4);
+	}
+}
+
+static inline void jit_prologue(jit_emitter_t * e)
+{
+	// push rbx
+	jit_emit8(e, 0x53);
+	// mov rbx, rdi
+	jit_rex_w(e);
+	jit_alu(e, X86_MOV, X86_EBX, X86_EDI);
+}
+
+static inline void jit_return(jit_emitter_t * e)
+{
+	// pop rbx
+	jit_emit8(e, 0x5B);
+	// ret
+	jit_emit8(e, 0xC3);
+}
+
+// leaves the block unless the flags indicate the given condition
+static inline void jit_return_unless(jit_emitter_t * e, int cc)
+{
+	// short jcc over the return sequence
+	jit_emit8(e, 0x70 | cc);
+	jit_emit8(e, 2);
+	jit_return(e);
+}
+
+static inline void jit_call(jit_emitter_t * e, void * function)
+{
+	// mov rax, function
+	jit_rex_w(e);
+	jit_emit8(e, 0xB8 | X86_EAX);
+	jit_emit64(e, (uintptr_t)function);
+	// call rax
+	jit_emit8(e, 0xFF);
+	jit_emit_modrm_rr(e, 2, X86_EAX);
+}
+
+// skips the instruction unless the NZCV flags are one of the values in the mask, returns the location to patch or 0 if the instruction is unconditional
+static size_t jit_emit_condition(arm_state_t * cpu, jit_emitter_t * e, uint16_t mask)
+{
+	if(mask == 0xFFFF)
+		return 0;
+
+	jit_load8(e, X86_ESI, cpu->jit.flags_offset);
+	if(cpu->jit.flags_shift != 0)
+		jit_shift(e, X86_EXT_SHR, X86_ESI, cpu->jit.flags_shift);
+	jit_alu_immediate(e, X86_EXT_AND, X86_ESI, 0xF);
+	jit_mov_immediate(e, X86_EDX, mask);
+	jit_bt(e, X86_EDX, X86_ESI);
+	return jit_jcc_forward(e, X86_CC_NC);
+}
+
+// how an instruction sets the flags
+enum
+{
+	JIT_FLAGS_ADD, // NZCV, C from the host carry
+	JIT_FLAGS_SUBTRACT, // NZCV, C is the inverse of the host borrow
+	JIT_FLAGS_SHIFTER, // NZC, C from ESI
+	JIT_FLAGS_LOGICAL, // NZ
+};
+
+// updates the flags from the result in EAX/RAX and the host flags of the last operation that produced it
+static void jit_emit_flags(arm_state_t * cpu, jit_emitter_t * e, int kind, bool wide)
+{
+	// collect the new flags in ECX, in the order N, Z, C, V from the most significant bit
+	uint8_t mask;
+	switch(kind)
+	{
+	case JIT_FLAGS_ADD:
+	case JIT_FLAGS_SUBTRACT:
+		jit_setcc(e, X86_CC_O, X86_ECX);
+		jit_setcc(e, kind == JIT_FLAGS_SUBTRACT ? X86_CC_NC : X86_CC_C, X86_EDX);
+		jit_shift(e, X86_EXT_SHL, X86_EDX, 1);
+		jit_alu(e, X86_OR, X86_ECX, X86_EDX);
+		mask = 0xF;
+		break;
+	case JIT_FLAGS_SHIFTER:
+		jit_alu(e, X86_MOV, X86_ECX, X86_ESI);
+		jit_shift(e, X86_EXT_SHL, X86_ECX, 1);
+		mask = 0xE;
+		break;
+	default:
+		jit_alu(e, X86_XOR, X86_ECX, X86_ECX);
+		mask = 0xC;
+		break;
+	}
+
+	if(wide)
+		jit_rex_w(e);
+	jit_alu(e, X86_TEST, X86_EAX, X86_EAX);
+	jit_setcc(e, X86_CC_Z, X86_EDX);
+	jit_shift(e, X86_EXT_SHL, X86_EDX, 2);
+	jit_alu(e, X86_OR, X86_ECX, X86_EDX);
+	if(wide)
+		jit_rex_w(e);
+	jit_alu(e, X86_TEST, X86_EAX, X86_EAX);
+	jit_setcc(e, X86_CC_S, X86_EDX);
+	jit_shift(e, X86_EXT_SHL, X86_EDX, 3);
+	jit_alu(e, X86_OR, X86_ECX, X86_EDX);
+
+	if(cpu->jit.flags_shift != 0)
+		jit_shift(e, X86_EXT_SHL, X86_ECX, cpu->jit.flags_shift);
+	jit_load8(e, X86_EDX, cpu->jit.flags_offset);
+	jit_alu_immediate(e, X86_EXT_AND, X86_EDX, ~(mask << cpu->jit.flags_shift) & 0xFF);
+	jit_alu(e, X86_OR, X86_EDX, X86_ECX);
+	jit_store8(e, X86_EDX, cpu->jit.flags_offset);
+}
+
+// leaves the block if it was invalidated, for example because it modified itself
+static void jit_emit_invalidation_check(arm_state_t * cpu, jit_emitter_t * e)
+{
+	// cmp byte [block->tag], tag
+	jit_mov_immediate64(e, X86_EAX, (uintptr_t)&e->block->tag);
+	jit_emit8(e, 0x80);
+	jit_emit8(e, (X86_EXT_CMP << 3) | X86_EAX);
+	jit_emit8(e, e->block->tag);
+	jit_return_unless(e, X86_CC_Z);
+}
+
+// checks whether the instruction just executed by the interpreter (or a memory access) let the block continue, leaves it otherwise
+static void jit_emit_continue_check(arm_state_t * cpu, jit_emitter_t * e, uint64_t next)
+{
+	// cmp [rbx + r[PC]], rax
+	jit_mov_immediate64(e, X86_EAX, next);
+	jit_rex_w(e);
+	jit_emit8(e, X86_CMP);
+	jit_emit_modrm_state(e, X86_EAX, offsetof(arm_state_t, r[PC]));
+	jit_return_unless(e, X86_CC_Z);
+
+	uint32_t state;
+	memcpy(&state, &cpu->pstate, sizeof state);
+	jit_load32(e, X86_EAX, offsetof(arm_state_t, pstate));
+	jit_alu_immediate(e, X86_EXT_AND, X86_EAX, cpu->jit.state_mask);
+	jit_alu_immediate(e, X86_EXT_CMP, X86_EAX, state & cpu->jit.state_mask);
+	jit_return_unless(e, X86_CC_Z);
+
+	jit_load32(e, X86_EAX, offsetof(arm_state_t, sctlr_el1));
+	jit_alu_immediate(e, X86_EXT_AND, X86_EAX, SCTLR_B);
+	jit_alu_immediate(e, X86_EXT_CMP, X86_EAX, cpu->sctlr_el1 & SCTLR_B);
+	jit_return_unless(e, X86_CC_Z);
+
+	jit_emit_invalidation_check(cpu, e);
+}
+
+// the result of translating a single instruction
+enum
+{
+	JIT_NOT_TRANSLATED, // nothing was generated, the instruction must be executed by the interpreter
+	JIT_TRANSLATED,
+	JIT_END_OF_BLOCK, // the instruction always leaves the block
+};
+
+/* A32 */
+
+static inline size_t a32_jit_register_offset(arm_state_t * cpu, int regnum)
+{
+	return (uint8_t *)&a32_register(cpu, regnum) - (uint8_t *)cpu;
+}
+
+static bool a32_jit_is_translatable_data_processing(uint32_t opcode)
+{
+	if((opcode & 0xF0000000) == 0xF0000000 || (opcode & 0x0C000000) != 0)
+		return false;
+
+	int op = (opcode >> 21) & 0xF;
+	int rn = (opcode >> 16) & 0xF;
+	int rd = (opcode >> 12) & 0xF;
+
+	if(op >= 0x8 && op <= 0xB)
+	{
+		// TST, TEQ, CMP, CMN, the other encodings are different instructions, and R15 as destination is TSTP/TEQP/CMPP/CMNP
+		if(!(opcode & 0x00100000) || rd != 0)
+			return false;
+	}
+	else if(rd == A32_PC_NUM)
+	{
+		return false;
+	}
+
+	if(op != 0xD && op != 0xF && rn == A32_PC_NUM)
+		return false;
+
+	if(!(opcode & 0x02000000))
+	{
+		// only shifts by an immediate, excluding RRX and shifts by 32
+		if((opcode & 0x00000010) || (opcode & 0xF) == A32_PC_NUM)
+			return false;
+		if((opcode & 0x00000F80) == 0 && (opcode & 0x00000060) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+static void a32_jit_emit_data_processing(arm_state_t * cpu, jit_emitter_t * e, uint32_t opcode)
+{
+	static const uint8_t shifts[4] = { X86_EXT_SHL, X86_EXT_SHR, X86_EXT_SAR, X86_EXT_ROR };
+
+	int op = (opcode >> 21) & 0xF;
+	bool set_flags = (opcode & 0x00100000) != 0;
+	bool logical = op == 0x0 || op == 0x1 || op == 0x8 || op == 0x9 || op >= 0xC;
+	bool subtraction = op == 0x2 || op == 0x3 || op == 0x6 || op == 0x7 || op == 0xA;
+	bool shifter_carry = false;
+
+	size_t skip = jit_emit_condition(cpu, e, cpu->jit.condition_masks[opcode >> 28]);
+
+	// second operand in ECX
+	if((opcode & 0x02000000))
+	{
+		jit_mov_immediate(e, X86_ECX, a32_get_immediate_operand(opcode));
+	}
+	else
+	{
+		jit_load32(e, X86_ECX, a32_jit_register_offset(cpu, opcode & 0xF));
+		int amount = (opcode >> 7) & 0x1F;
+		if(amount != 0)
+		{
+			jit_shift(e, shifts[(opcode >> 5) & 3], X86_ECX, amount);
+			if(logical && set_flags)
+			{
+				// the last bit shifted out is the carry for logical instructions, kept in ESI
+				jit_setcc(e, X86_CC_C, X86_ESI);
+				shifter_carry = true;
+			}
+		}
+	}
+
+	// first operand and result in EAX
+	if(op != 0xD && op != 0xF)
+		jit_load32(e, X86_EAX, a32_jit_register_offset(cpu, (opcode >> 16) & 0xF));
+
+	if(op == 0x5 || op == 0x6 || op == 0x7)
+	{
+		jit_load8(e, X86_EDX, cpu->jit.flags_offset);
+		jit_bt_immediate(e, X86_EDX, cpu->jit.flags_shift + 1);
+		if(op != 0x5)
+			jit_cmc(e); // x86 subtracts the borrow, the inverse of the carry
+	}
+
+	switch(op)
+	{
+	case 0x0: /* and */
+	case 0x8: /* tst */
+		jit_alu(e, X86_AND, X86_EAX, X86_ECX);
+		break;
+	case 0x1: /* eor */
+	case 0x9: /* teq */
+		jit_alu(e, X86_XOR, X86_EAX, X86_ECX);
+		break;
+	case 0x2: /* sub */
+	case 0xA: /* cmp */
+		jit_alu(e, X86_SUB, X86_EAX, X86_ECX);
+		break;
+	case 0x3: /* rsb */
+		jit_alu(e, X86_SUB, X86_ECX, X86_EAX);
+		jit_alu(e, X86_MOV, X86_EAX, X86_ECX);
+		break;
+	case 0x4: /* add */
+	case 0xB: /* cmn */
+		jit_alu(e, X86_ADD, X86_EAX, X86_ECX);
+		break;
+	case 0x5: /* adc */
+		jit_alu(e, X86_ADC, X86_EAX, X86_ECX);
+		break;
+	case 0x6: /* sbc */
+		jit_alu(e, X86_SBB, X86_EAX, X86_ECX);
+		break;
+	case 0x7: /* rsc */
+		jit_alu(e, X86_SBB, X86_ECX, X86_EAX);
+		jit_alu(e, X86_MOV, X86_EAX, X86_ECX);
+		break;
+	case 0xC: /* orr */
+		jit_alu(e, X86_OR, X86_EAX, X86_ECX);
+		break;
+	case 0xD: /* mov */
+		jit_alu(e, X86_MOV, X86_EAX, X86_ECX);
+		break;
+	case 0xE: /* bic */
+		jit_not(e, X86_ECX);
+		jit_alu(e, X86_AND, X86_EAX, X86_ECX);
+		break;
+	case 0xF: /* mvn */
+		jit_not(e, X86_ECX);
+		jit_alu(e, X86_MOV, X86_EAX, X86_ECX);
+		break;
+	}
+
+	if(op < 0x8 || op > 0xB)
+		jit_store64(e, X86_EAX, a32_jit_register_offset(cpu, (opcode >> 12) & 0xF));
+
+	if(set_flags)
+		jit_emit_flags(cpu, e, !logical ? (subtraction ? JIT_FLAGS_SUBTRACT : JIT_FLAGS_ADD) : shifter_carry ? JIT_FLAGS_SHIFTER : JIT_FLAGS_LOGICAL, false);
+
+	if(skip != 0)
+		jit_patch_forward(e, skip);
+}
+
+// B and BL, the ARM26 version of BL stores the flags in the link register, so it is not translated
+static bool a32_jit_is_translatable_branch(uint32_t opcode, uint8_t tag)
+{
+	if((opcode & 0xF0000000) == 0xF0000000 || (opcode & 0x0E000000) != 0x0A000000)
+		return false;
+	return !(opcode & 0x01000000) || (tag & ARM_DECODE_CACHE_ISA_MASK) == ARM_DECODE_CACHE_A32;
+}
+
+static void a32_jit_emit_branch(arm_state_t * cpu, jit_emitter_t * e, uint32_t opcode, uint64_t pc)
+{
+	size_t skip = jit_emit_condition(cpu, e, cpu->jit.condition_masks[opcode >> 28]);
+
+	if((opcode & 0x01000000))
+		jit_store_immediate64(e, a32_jit_register_offset(cpu, A32_LR), (uint32_t)(pc + 4));
+	jit_store_immediate64(e, offsetof(arm_state_t, old_pc), pc);
+	jit_store_immediate64(e, offsetof(arm_state_t, r[PC]), (uint32_t)(pc + 8 + sign_extend(26, (opcode & 0x00FFFFFF) << 2)) & 0xFFFFFFFC);
+	jit_return(e);
+
+	if(skip != 0)
+		jit_patch_forward(e, skip);
+}
+
+static int a32_jit_emit_instruction(arm_state_t * cpu, jit_emitter_t * e, uint32_t opcode, uint8_t tag, uint64_t pc)
+{
+	if(a32_jit_is_translatable_data_processing(opcode))
+	{
+		a32_jit_emit_data_processing(cpu, e, opcode);
+		return JIT_TRANSLATED;
+	}
+	else if(a32_jit_is_translatable_branch(opcode, tag))
+	{
+		a32_jit_emit_branch(cpu, e, opcode, pc);
+		return (opcode & 0xF0000000) == 0xE0000000 ? JIT_END_OF_BLOCK : JIT_TRANSLATED;
+	}
+	else
+	{
+		return JIT_NOT_TRANSLATED;
+	}
+}
+
+/* A64 */
+
+static inline size_t a64_jit_register_offset(arm_state_t * cpu, int regnum)
+{
+	// R31 is the stack pointer of the current exception level, this is part of the state the block is translated for
+	if(regnum != A64_SP)
+		return offsetof(arm_state_t, r) + regnum * sizeof(cpu->r[0]);
+	else if(!cpu->pstate.sp)
+		return offsetof(arm_state_t, r) + SP_EL0 * sizeof(cpu->r[0]);
+	else
+		return offsetof(arm_state_t, r) + (SP_EL0 + cpu->pstate.el) * sizeof(cpu->r[0]);
+}
+
+// same as a64_register_get32/a64_register_get64
+static void a64_jit_load_register(arm_state_t * cpu, jit_emitter_t * e, int reg, int regnum, bool operand64, bool_suppress_sp_t suppress_sp)
+{
+	if(regnum == A64_SP && suppress_sp)
+		jit_alu(e, X86_XOR, reg, reg);
+	else if(operand64)
+		jit_load64(e, reg, a64_jit_register_offset(cpu, regnum));
+	else
+		jit_load32(e, reg, a64_jit_register_offset(cpu, regnum));
+}
+
+// same as a64_register_set32/a64_register_set64, 32-bit results are already zero extended
+static void a64_jit_store_register(arm_state_t * cpu, jit_emitter_t * e, int reg, int regnum, bool_suppress_sp_t suppress_sp)
+{
+	if(!(regnum == A64_SP && suppress_sp))
+		jit_store64(e, reg, a64_jit_register_offset(cpu, regnum));
+}
+
+static void a64_jit_emit_shifted_operand(jit_emitter_t * e, int reg, bool operand64, int shift_type, uint8_t amount)
+{
+	static const uint8_t shifts[4] = { X86_EXT_SHL, X86_EXT_SHR, X86_EXT_SAR, X86_EXT_ROR };
+	if(amount == 0)
+		return;
+	if(operand64)
+		jit_rex_w(e);
+	jit_shift(e, shifts[shift_type], reg, amount);
+}
+
+static void a64_jit_emit_jump(jit_emitter_t * e, uint64_t pc, uint64_t target)
+{
+	jit_store_immediate64(e, offsetof(arm_state_t, old_pc), pc);
+	jit_store_immediate64(e, offsetof(arm_state_t, r[PC]), target);
+	jit_return(e);
+}
+
+static int a64_jit_emit_instruction(arm_state_t * cpu, jit_emitter_t * e, uint32_t opcode, uint64_t pc, uint64_t next)
+{
+	bool operand64 = (opcode & 0x80000000) != 0;
+	int d = opcode & 0x1F;
+	int n = (opcode >> 5) & 0x1F;
+	int m = (opcode >> 16) & 0x1F;
+
+	if((opcode & 0x1F800000) == 0x11000000)
+	{
+		/* add/adds/sub/subs (immediate) */
+		bool subtract = (opcode & 0x40000000) != 0;
+		bool set_flags = (opcode & 0x20000000) != 0;
+		if(set_flags && !operand64)
+			return JIT_NOT_TRANSLATED; // the 32-bit flags are computed by a64_test32_nzvc
+
+		uint32_t immediate = (opcode >> 10) & 0xFFF;
+		if((opcode & 0x00400000))
+			immediate <<= 12;
+
+		a64_jit_load_register(cpu, e, X86_EAX, n, operand64, false);
+		jit_mov_immediate(e, X86_ECX, immediate);
+		if(operand64)
+			jit_rex_w(e);
+		jit_alu(e, subtract ? X86_SUB : X86_ADD, X86_EAX, X86_ECX);
+		a64_jit_store_register(cpu, e, X86_EAX, d, set_flags);
+		if(set_flags)
+			jit_emit_flags(cpu, e, subtract ? JIT_FLAGS_SUBTRACT : JIT_FLAGS_ADD, true);
+		return JIT_TRANSLATED;
+	}
+	else if((opcode & 0x1F800000) == 0x12000000)
+	{
+		/* and/orr/eor/ands (immediate) */
+		int op = (opcode >> 29) & 3;
+		if(!operand64 && (opcode & 0x00400000))
+			return JIT_NOT_TRANSLATED;
+
+		a64_jit_load_register(cpu, e, X86_EAX, n, operand64, SUPPRESS_SP);
+		jit_mov_immediate64(e, X86_ECX, operand64 ? a64_get_bitmask64(opcode) : a64_get_bitmask32(opcode));
+		if(operand64)
+			jit_rex_w(e);
+		jit_alu(e, op == 1 ? X86_OR : op == 2 ? X86_XOR : X86_AND, X86_EAX, X86_ECX);
+		// only ANDS writes to the zero register
+		a64_jit_store_register(cpu, e, X86_EAX, d, op == 3);
+		if(op == 3)
+			jit_emit_flags(cpu, e, JIT_FLAGS_LOGICAL, operand64);
+		return JIT_TRANSLATED;
+	}
+	else if((opcode & 0x1F800000) == 0x12800000)
+	{
+		/* movn/movz/movk */
+		int op = (opcode >> 29) & 3;
+		int shift = ((opcode >> 21) & 3) << 4;
+		uint64_t immediate = (uint64_t)((opcode >> 5) & 0xFFFF) << shift;
+		if(op == 1 || (!operand64 && shift >= 32))
+			return JIT_NOT_TRANSLATED;
+		if(op == 3 && shift >= 32)
+			return JIT_NOT_TRANSLATED; // the interpreter shifts the immediate as a 32-bit value
+
+		if(d == A64_SP)
+			return JIT_TRANSLATED; // discarded
+
+		switch(op)
+		{
+		case 0:
+			jit_store_immediate64(e, a64_jit_register_offset(cpu, d), operand64 ? ~immediate : (uint32_t)~immediate);
+			break;
+		case 2:
+			jit_store_immediate64(e, a64_jit_register_offset(cpu, d), immediate);
+			break;
+		case 3:
+			a64_jit_load_register(cpu, e, X86_EAX, d, operand64, SUPPRESS_SP);
+			jit_mov_immediate64(e, X86_ECX, operand64 ? ~((uint64_t)0xFFFF << shift) : (uint32_t)~(0xFFFF << shift));
+			if(operand64)
+				jit_rex_w(e);
+			jit_alu(e, X86_AND, X86_EAX, X86_ECX);
+			jit_mov_immediate64(e, X86_ECX, immediate);
+			if(operand64)
+				jit_rex_w(e);
+			jit_alu(e, X86_OR, X86_EAX, X86_ECX);
+			a64_jit_store_register(cpu, e, X86_EAX, d, SUPPRESS_SP);
+			break;
+		}
+		return JIT_TRANSLATED;
+	}
+	else if((opcode & 0x1F200000) == 0x0B000000)
+	{
+		/* add/adds/sub/subs (shifted register) */
+		bool subtract = (opcode & 0x40000000) != 0;
+		bool set_flags = (opcode & 0x20000000) != 0;
+		int shift_type = (opcode >> 22) & 3;
+		int amount = (opcode >> 10) & 0x3F;
+		if(shift_type == 3 || (!operand64 && amount >= 32))
+			return JIT_NOT_TRANSLATED;
+		if(set_flags && !operand64)
+			return JIT_NOT_TRANSLATED; // the 32-bit flags are computed by a64_test32_nzvc
+		if(n == A64_SP || (d == A64_SP && !set_flags))
+			return JIT_NOT_TRANSLATED; // the interpreter accesses the stack pointer here
+
+		a64_jit_load_register(cpu, e, X86_ECX, m, operand64, SUPPRESS_SP);
+		a64_jit_emit_shifted_operand(e, X86_ECX, operand64, shift_type, amount);
+		a64_jit_load_register(cpu, e, X86_EAX, n, operand64, SUPPRESS_SP);
+		if(operand64)
+			jit_rex_w(e);
+		jit_alu(e, subtract ? X86_SUB : X86_ADD, X86_EAX, X86_ECX);
+		a64_jit_store_register(cpu, e, X86_EAX, d, SUPPRESS_SP);
+		if(set_flags)
+			jit_emit_flags(cpu, e, subtract ? JIT_FLAGS_SUBTRACT : JIT_FLAGS_ADD, true);
+		return JIT_TRANSLATED;
+	}
+	else if((opcode & 0x1F000000) == 0x0A000000)
+	{
+		/* and/orr/orn/eor/ands (shifted register) */
+		int op = (opcode >> 29) & 3;
+		bool invert = (opcode & 0x00200000) != 0;
+		int amount = (opcode >> 10) & 0x3F;
+		if((invert && op != 1) || (!operand64 && amount >= 32))
+			return JIT_NOT_TRANSLATED; // BIC, BICS and EON are not translated
+
+		a64_jit_load_register(cpu, e, X86_ECX, m, operand64, SUPPRESS_SP);
+		a64_jit_emit_shifted_operand(e, X86_ECX, operand64, (opcode >> 22) & 3, amount);
+		if(invert)
+		{
+			if(operand64)
+				jit_rex_w(e);
+			jit_not(e, X86_ECX);
+		}
+		a64_jit_load_register(cpu, e, X86_EAX, n, operand64, SUPPRESS_SP);
+		if(operand64)
+			jit_rex_w(e);
+		jit_alu(e, op == 1 ? X86_OR : op == 2 ? X86_XOR : X86_AND, X86_EAX, X86_ECX);
+		a64_jit_store_register(cpu, e, X86_EAX, d, SUPPRESS_SP);
+		if(op == 3)
+			jit_emit_flags(cpu, e, JIT_FLAGS_LOGICAL, operand64);
+		return JIT_TRANSLATED;
+	}
+	else if((opcode & 0x7C000000) == 0x14000000)
+	{
+		/* b/bl */
+		if((opcode & 0x80000000))
+			jit_store_immediate64(e, a64_jit_register_offset(cpu, A64_LR), pc + 4);
+		a64_jit_emit_jump(e, pc, pc + (int64_t)sign_extend(28, (opcode & 0x03FFFFFF) << 2));
+		return JIT_END_OF_BLOCK;
+	}
+	else if((opcode & 0xFF000010) == 0x54000000)
+	{
+		/* b.cond */
+		int condition = opcode & 0xF;
+		size_t skip = jit_emit_condition(cpu, e, condition == 0xF ? 0xFFFF : cpu->jit.condition_masks[condition]);
+		a64_jit_emit_jump(e, pc, pc + (int64_t)sign_extend(21, ((opcode >> 5) & 0x7FFFF) << 2));
+		if(skip == 0)
+			return JIT_END_OF_BLOCK;
+		jit_patch_forward(e, skip);
+		return JIT_TRANSLATED;
+	}
+	else if((opcode & 0x7E000000) == 0x34000000)
+	{
+		/* cbz/cbnz */
+		a64_jit_load_register(cpu, e, X86_EAX, d, operand64, SUPPRESS_SP);
+		if(operand64)
+			jit_rex_w(e);
+		jit_alu(e, X86_TEST, X86_EAX, X86_EAX);
+		size_t skip = jit_jcc_forward(e, (opcode & 0x01000000) ? X86_CC_Z : X86_CC_NZ);
+		a64_jit_emit_jump(e, pc, pc + (int64_t)sign_extend(21, ((opcode >> 5) & 0x7FFFF) << 2));
+		jit_patch_forward(e, skip);
+		return JIT_TRANSLATED;
+	}
+	else if((opcode & 0xBF800000) == 0xB9000000)
+	{
+		/* ldr/str (unsigned offset) of 32-bit and 64-bit registers */
+		bool load = (opcode & 0x00400000) != 0;
+		operand64 = (opcode & 0x40000000) != 0;
+		uint32_t offset = ((opcode >> 10) & 0xFFF) << (operand64 ? 3 : 2);
+		if(n == A64_SP)
+			return JIT_NOT_TRANSLATED; // the stack pointer must be checked for alignment
+
+		// memory accesses can raise exceptions
+		jit_store_immediate64(e, offsetof(arm_state_t, old_pc), pc);
+		jit_store_immediate64(e, offsetof(arm_state_t, r[PC]), next);
+
+		a64_jit_load_register(cpu, e, X86_ESI, n, true, false);
+		jit_rex_w(e);
+		jit_alu_immediate(e, X86_EXT_ADD, X86_ESI, offset);
+		if(!load)
+			a64_jit_load_register(cpu, e, X86_EDX, d, operand64, SUPPRESS_SP);
+		// mov rdi, rbx
+		jit_rex_w(e);
+		jit_alu(e, X86_MOV, X86_EDI, X86_EBX);
+
+		if(load)
+		{
+			jit_call(e, operand64 ? (void *)a64_read64 : (void *)a64_read32);
+			if(!operand64)
+				jit_alu(e, X86_MOV, X86_EAX, X86_EAX); // the upper half of the return value is undefined
+			a64_jit_store_register(cpu, e, X86_EAX, d, SUPPRESS_SP);
+		}
+		else
+		{
+			jit_call(e, operand64 ? (void *)a64_write64 : (void *)a64_write32);
+			jit_emit_invalidation_check(cpu, e);
+		}
+		return JIT_TRANSLATED;
+	}
+
+	return JIT_NOT_TRANSLATED;
+}
+
+/* Blocks */
+
+// calls the interpreter, and leaves the block if execution cannot continue with the next instruction
+static void jit_emit_call_interpreter(arm_state_t * cpu, jit_emitter_t * e, void * step_execute, uint32_t opcode, uint16_t index, uint64_t pc, uint64_t next)
+{
+	jit_store_immediate64(e, offsetof(arm_state_t, old_pc), pc);
+	jit_store_immediate64(e, offsetof(arm_state_t, r[PC]), next);
+
+	// mov rdi, rbx
+	jit_rex_w(e);
+	jit_alu(e, X86_MOV, X86_EDI, X86_EBX);
+	jit_mov_immediate(e, X86_ESI, opcode);
+	jit_mov_immediate(e, X86_EDX, index);
+	jit_call(e, step_execute);
+
+	// the generated code accesses the flags in pstate directly, so any flags recorded by the interpreter must be evaluated
+	// cmp byte [rbx + lazy_flags.kind], ARM_FLAGS_EVALUATED
+	jit_emit8(e, 0x80);
+	jit_emit_modrm_state(e, X86_EXT_CMP, offsetof(arm_state_t, lazy_flags.kind));
+	jit_emit8(e, ARM_FLAGS_EVALUATED);
+	size_t evaluated = jit_jcc_forward(e, X86_CC_Z);
+	// mov rdi, rbx
+	jit_rex_w(e);
+	jit_alu(e, X86_MOV, X86_EDI, X86_EBX);
+	jit_call(e, arm_evaluate_flags);
+	jit_patch_forward(e, evaluated);
+
+	jit_emit_continue_check(cpu, e, next);
+}
+
+static inline uint32_t arm_jit_get_state(arm_state_t * cpu)
+{
+	uint32_t state;
+	memcpy(&state, &cpu->pstate, sizeof state);
+	return state & cpu->jit.state_mask;
+}
+
+// native code accesses the banked registers directly, so it can only be used in the state it was generated for
+static inline bool arm_jit_is_executable(arm_state_t * cpu, arm_block_t * block)
+{
+	return block->native != NULL && block->native_state == arm_jit_get_state(cpu);
+}
+
+// native code executes the instructions of a block in order, and stores the address of the last one it started in old_pc
+static inline uint64_t arm_jit_executed_count(arm_state_t * cpu, arm_block_t * block)
+{
+	return ((cpu->old_pc - block->pc) >> 2) + 1;
+}
+
+static void arm_jit_translate(arm_state_t * cpu, arm_block_t * block, uint8_t tag)
+{
+	uint8_t isa = tag & ARM_DECODE_CACHE_ISA_MASK;
+	if(isa != ARM_DECODE_CACHE_A26 && isa != ARM_DECODE_CACHE_A32 && isa != ARM_DECODE_CACHE_A64)
+		return;
+
+	if(cpu->jit.used + ARM_JIT_MAX_BLOCK_SIZE > ARM_JIT_BUFFER_SIZE)
+	{
+		// out of space, start over with the next block that gets hot
+		arm_block_cache_flush(cpu);
+		return;
+	}
+
+	jit_emitter_t e[1];
+	e->code = cpu->jit.buffer + cpu->jit.used;
+	e->length = 0;
+	e->limit = ARM_JIT_MAX_BLOCK_SIZE;
+	e->block = block;
+
+	jit_prologue(e);
+
+	uint64_t pc = block->pc;
+	uint64_t last = pc;
+	int i;
+	for(i = 0; i < block->count; i++)
+	{
+		uint32_t opcode = block->instructions[i].opcode;
+		uint16_t index = block->instructions[i].index;
+		uint64_t next = pc + 4;
+		if(isa == ARM_DECODE_CACHE_A26)
+			next &= 0x03FFFFFF;
+
+		int result;
+		if(isa == ARM_DECODE_CACHE_A64)
+		{
+			result = a64_jit_emit_instruction(cpu, e, opcode, pc, next);
+			if(result == JIT_NOT_TRANSLATED)
+				jit_emit_call_interpreter(cpu, e, a64_step_execute, opcode, index, pc, next);
+		}
+		else
+		{
+			result = a32_jit_emit_instruction(cpu, e, opcode, tag, pc);
+			if(result == JIT_NOT_TRANSLATED)
+				jit_emit_call_interpreter(cpu, e, a32_step_execute, opcode, index, pc, next);
+		}
+
+		if(result == JIT_END_OF_BLOCK)
+			break; // the rest of the block is never reached
+
+		last = pc;
+		pc = next;
+	}
+
+	if(i == block->count)
+	{
+		jit_store_immediate64(e, offsetof(arm_state_t, old_pc), last);
+		jit_store_immediate64(e, offsetof(arm_state_t, r[PC]), pc);
+		jit_return(e);
+	}
+
+	if(e->length > e->limit)
+		return;
+
+	block->native = (void (*)(arm_state_t *))e->code;
+	block->native_state = arm_jit_get_state(cpu);
+	cpu->jit.used += (e->length + 15) & ~(size_t)15;
+}
+
+bool arm_jit_enable(arm_state_t * cpu)
+{
+	arm_pstate_t probe;
+	uint8_t bytes[sizeof(arm_pstate_t)];
+
+	// locate the flags, they must be adjacent within a single byte
+	memset(&probe, 0, sizeof probe);
+	probe.v = 1;
+	memcpy(bytes, &probe, sizeof probe);
+	int offset = -1;
+	for(size_t index = 0; index < sizeof bytes; index++)
+	{
+		if(bytes[index] != 0)
+		{
+			offset = index;
+			break;
+		}
+	}
+	if(offset < 0)
+		return false;
+	int shift = 0;
+	while(!(bytes[offset] & (1 << shift)))
+		shift++;
+	if(shift > 4)
+		return false;
+
+	memset(&probe, 0, sizeof probe);
+	probe.n = probe.z = probe.c = probe.v = 1;
+	memcpy(bytes, &probe, sizeof probe);
+	for(size_t index = 0; index < sizeof bytes; index++)
+	{
+		if(bytes[index] != (index == (size_t)offset ? 0xF << shift : 0))
+			return false;
+	}
+
+	// the fields that select the register bank and instruction set must be in the first word
+	uint32_t state_mask;
+	memset(&probe, 0, sizeof probe);
+	probe.rw = 3;
+	probe.mode = 15;
+	probe.jt = 3;
+	probe.sp = 1;
+	probe.el = 3;
+	memcpy(bytes, &probe, sizeof probe);
+	for(size_t index = sizeof state_mask; index < sizeof bytes; index++)
+	{
+		if(bytes[index] != 0)
+			return false;
+	}
+	memcpy(&state_mask, bytes, sizeof state_mask);
+
+	if(cpu->jit.buffer == NULL)
+	{
+		void * buffer = mmap(NULL, ARM_JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(buffer == MAP_FAILED)
+			return false;
+		cpu->jit.buffer = buffer;
+	}
+
+	cpu->jit.flags_offset = offsetof(arm_state_t, pstate) + offset;
+	cpu->jit.flags_shift = shift;
+	cpu->jit.state_mask = state_mask;
+
+	// evaluate every condition for every combination of flags, so that the generated code behaves exactly like a32_check_condition
+	arm_evaluate_flags(cpu);
+	arm_pstate_t pstate = cpu->pstate;
+	for(int condition = 0; condition < 16; condition++)
+	{
+		cpu->jit.condition_masks[condition] = 0;
+		for(int flags = 0; flags < 16; flags++)
+		{
+			cpu->pstate.v = flags & 1;
+			cpu->pstate.c = (flags >> 1) & 1;
+			cpu->pstate.z = (flags >> 2) & 1;
+			cpu->pstate.n = (flags >> 3) & 1;
+			if(a32_check_condition(cpu, condition))
+				cpu->jit.condition_masks[condition] |= 1 << flags;
+		}
+	}
+	cpu->pstate = pstate;
+
+	cpu->jit.used = 0;
+	arm_block_cache_flush(cpu);
+	cpu->jit.threshold = ARM_JIT_THRESHOLD;
+	cpu->jit.enabled = true;
+	return true;
+}
+
+void arm_jit_free(arm_state_t * cpu)
+{
+	if(cpu->jit.buffer != NULL)
+		munmap(cpu->jit.buffer, ARM_JIT_BUFFER_SIZE);
+	cpu->jit.buffer = NULL;
+	cpu->jit.enabled = false;
+}
+
+#else
+
+static inline bool arm_jit_is_executable(arm_state_t * cpu, arm_block_t * block)
+{
+	return false;
+}
+
+static inline uint64_t arm_jit_executed_count(arm_state_t * cpu, arm_block_t * block)
+{
+	return 0;
+}
+
+static void arm_jit_translate(arm_state_t * cpu, arm_block_t * block, uint8_t tag)
+{
+}
+
+bool arm_jit_enable(arm_state_t * cpu)
+{
+	// no code generator for this host
+	return false;
+}
+
+void arm_jit_free(arm_state_t * cpu)
+{
+}
+
+#endif
+
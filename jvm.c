@@ -10,8 +10,6 @@
 #include "dis.h"
 #include "elf.h"
 
-jvm_constant_t * constant_pool;
-
 static inline uint32_t count_argument_bytes(jvm_utf8_t * utf8)
 {
 	uint32_t arg_bytes = 0;
@@ -78,7 +76,8 @@ void read_class_file(FILE * input_file, environment_t * env)
 
 	fseek(input_file, 4L, SEEK_CUR);
 	constant_pool_count = fread16be(input_file);
-	constant_pool = malloc(sizeof(jvm_constant_t) * constant_pool_count);
+	env->constant_pool_count = constant_pool_count;
+	jvm_constant_t * constant_pool = env->constant_pool = malloc(sizeof(jvm_constant_t) * constant_pool_count);
 	memset(constant_pool, 0, sizeof(jvm_constant_t) * constant_pool_count);
 	for(uint16_t i = 1; i < constant_pool_count; i++)
 	{
@@ -123,7 +122,7 @@ void read_class_file(FILE * input_file, environment_t * env)
 			break;
 		default:
 			fprintf(stderr, "Invalid constant pool entry\n");
-			exit(1);
+			exit_emulation(env, 1);
 		}
 	}
 
@@ -297,7 +296,7 @@ void read_class_file(FILE * input_file, environment_t * env)
 					if((access_flags) & 0x0500) // abstract or native
 					{
 						fprintf(stderr, "Error: native/abstract method with body\n");
-						exit(1);
+						exit_emulation(env, 1);
 					}
 
 					address = (address + 3) & ~3;
@@ -313,7 +312,6 @@ void read_class_file(FILE * input_file, environment_t * env)
 						env->clinit_entry = address + 12;
 					}
 
-					uint64_t offset;
 					{
 						arm_memory_write32(env->memory_interface, address, env->cp_start, env->endian);
 
@@ -330,11 +328,7 @@ void read_class_file(FILE * input_file, environment_t * env)
 					}
 					address += 12;
 
-					for(offset = 0; offset < code_length; offset++)
-					{
-						char c = fgetc(input_file);
-						arm_memory_write8(env->memory_interface, address + offset, c, env->endian == ARM_ENDIAN_SWAPPED ? ARM_ENDIAN_SWAPPED : ARM_ENDIAN_LITTLE);
-					}
+					memory_load_file(env->memory, input_file, address, code_length, env->endian == ARM_ENDIAN_SWAPPED);
 					address += code_length;
 					address = (address + 3) & ~3;
 				}
@@ -544,6 +538,20 @@ void read_class_file(FILE * input_file, environment_t * env)
 	env->stack = address;
 }
 
+void free_class_file(environment_t * env)
+{
+	if(env->constant_pool == NULL)
+		return;
+
+	for(uint16_t i = 1; i < env->constant_pool_count; i++)
+	{
+		if(env->constant_pool[i].type == CONSTANT_Utf8)
+			free(env->constant_pool[i].utf8.bytes);
+	}
+	free(env->constant_pool);
+	env->constant_pool = NULL;
+}
+
 void j32_invoke(arm_state_t * cpu, uint32_t argument_count, uint32_t local_count, uint32_t address)
 {
 	uint32_t old_loc = cpu->r[J32_LOC];
@@ -558,8 +566,9 @@ void j32_invoke(arm_state_t * cpu, uint32_t argument_count, uint32_t local_count
 	cpu->r[PC] = address;
 }
 
-bool j32_simulate_instruction(arm_state_t * cpu, uint32_t heap_start)
+bool j32_simulate_instruction(arm_state_t * cpu, environment_t * env)
 {
+	jvm_constant_t * constant_pool = env->constant_pool;
 	j32_spill_fast_stack(cpu);
 	switch(arm_fetch8(cpu, cpu->r[PC]++))
 	{
@@ -713,7 +722,7 @@ bool j32_simulate_instruction(arm_state_t * cpu, uint32_t heap_start)
 			{
 				// system call
 				uint32_t syscall_num = arm_memory_read32_data(cpu, method_address + 8);
-				if(!j32_linux_syscall(cpu, syscall_num))
+				if(!j32_linux_syscall(cpu, env, syscall_num))
 					return false;
 				cpu->r[PC] += 2;
 			}
@@ -104,11 +104,11 @@ enum
 	J32_HEAP = 10,
 };
 
-extern jvm_constant_t * constant_pool;
-
 void read_class_file(FILE * input_file, environment_t * env);
+// releases the constant pool loaded by read_class_file
+extern void free_class_file(environment_t * env);
 
 extern void j32_invoke(arm_state_t * cpu, uint32_t argument_count, uint32_t local_count, uint32_t address);
-extern bool j32_simulate_instruction(arm_state_t * cpu, uint32_t heap_start);
+extern bool j32_simulate_instruction(arm_state_t * cpu, environment_t * env);
 
 #endif // _JVM_H
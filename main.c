@@ -11,13 +11,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <setjmp.h>
+#include <pthread.h>
 #include <unistd.h>
+#if MEMORY_FLAT
+# include <sys/mman.h>
+#endif
 #include "dis.h"
 #include "emu.h"
 #include "debug.h"
 #include "elf.h"
 #include "jvm.h"
 #include "jazelle.h"
+#include "batch.h"
 
 const char * const arm_instruction_set_names[] =
 {
@@ -61,88 +66,607 @@ const char * const arm_simd_version_names[ARM_VFPV5 + 1] =
 	[ARM_VFPV4] = "Neon v2",
 };
 
-uint64_t memory_changed_lowest = -1;
-uint64_t memory_changed_highest = 0;
+static inline size_t _hash_number(uint64_t number)
+{
+	number *= UINT64_C(0x9E3779B97F4A7C15);
+	return number ^ (number >> 32);
+}
+
+/* Guest memory
+ * All the state of an instance lives in a memory_t, so several instances (each with its own CPU) can run in the same process
+ * The memory interface is the first member, and its data field points back to the memory_t
+ */
+
+/* Dirty memory tracking
+ * While there are subscribers, every write marks the MEMORY_DIRTY_PAGE_SIZE sized pages it touches in a sparse bitmap,
+ * and the range of changed bytes is also recorded for the debugger
+ * Without subscribers, writes are not tracked at all and may bypass _memory_write through the map callback
+ */
+
+#define DIRTY_CHUNK_PAGES 0x200 // pages covered by a chunk of the bitmap, must be a multiple of 64
+#define DIRTY_INITIAL_SIZE 0x10 // must be a power of 2
+
+typedef struct dirty_chunk_t
+{
+	uint64_t number; // address / (MEMORY_DIRTY_PAGE_SIZE * DIRTY_CHUNK_PAGES)
+	bool used;
+	uint64_t bits[DIRTY_CHUNK_PAGES / 64];
+} dirty_chunk_t;
+
+#if MEMORY_SINGLE_BLOCK
+
+#define MEMORY_SINGLE_BLOCK_SIZE 0x04000000
+
+#elif MEMORY_FLAT
+
+/* Flat memory
+ * The 4 GiB guest address space is reserved as a single inaccessible host region, and pages are made accessible when first used
+ * A guest address is translated by adding it to the start of the region
+ * Addresses are truncated to 32 bits, so this is only suitable for AArch32 and AArch26 guests, setup_cpu refuses the others
+ */
+
+#define PAGE_SIZE 0x10000 // must be a power of 2
+#define PAGE_MASK ((uint64_t)PAGE_SIZE - 1)
+#define MEMORY_FLAT_SIZE ((uint64_t)1 << 32)
+#define MEMORY_FLAT_MASK (MEMORY_FLAT_SIZE - 1)
+
+#else
+
+#define PAGE_SIZE 0x10000 // must be a power of 2
+#define PAGE_MASK ((uint64_t)PAGE_SIZE - 1)
+typedef uint8_t page_t[PAGE_SIZE];
+
+/* Page map
+ * Allocated pages are stored in an open addressing hash table indexed by the page number
+ * The table grows with the number of pages, so sparse address spaces (such as a stack at a high address) cost little
+ */
+typedef struct page_map_entry_t
+{
+	uint64_t number; // address / PAGE_SIZE
+	page_t * page; // NULL for an empty entry
+} page_map_entry_t;
+
+#define PAGE_MAP_INITIAL_SIZE 0x40 // must be a power of 2
+
+/* Pages that have never been written to read as zeros from a single shared page
+ * A private page is only allocated on the first write, from arenas of zeroed pages
+ */
+
+#define PAGE_ARENA_COUNT 0x10
+
+/* Software TLB
+ * Caches the host address of recently accessed pages, so that most accesses do not search the page map
+ * Reads, writes and instruction fetches have their own entries, so they do not evict each other
+ * Pages are never unmapped or moved, so the entries only need to be flushed when that changes,
+ * except for entries referring to the zero page, which are invalidated when the page is allocated
+ */
+
+#define TLB_SIZE 0x40 // must be a power of 2
+
+typedef struct tlb_entry_t
+{
+	uint64_t address; // address of the page
+	uint8_t * page; // NULL if the entry is unused
+} tlb_entry_t;
+
+#endif
+
+struct memory_t
+{
+	memory_interface_t interface;
+
+	// set if the memory is accessed from several threads, then all accesses are serialized through the lock
+	bool shared;
+	pthread_mutex_t lock;
+
+	// dirty memory tracking
+	uint64_t changed_lowest;
+	uint64_t changed_highest;
+	unsigned dirty_subscribers;
+	dirty_chunk_t * dirty_chunks;
+	size_t dirty_chunks_size;
+	size_t dirty_chunk_count;
+
+	// only the latest snapshot can be restored, since the dirty pages are tracked from the moment it was taken
+	arm_snapshot_t * snapshot_current;
+
+#if MEMORY_SINGLE_BLOCK
+	uint8_t * contents;
+#elif MEMORY_FLAT
+	uint8_t * contents;
+	// pages that have been made accessible
+	bool committed[MEMORY_FLAT_SIZE / PAGE_SIZE];
+#else
+	page_map_entry_t * page_map;
+	size_t page_map_size;
+	size_t page_count;
+
+	page_t * arena;
+	size_t arena_free;
+	page_t ** arenas;
+	size_t arena_count;
+
+	tlb_entry_t tlb[TLB_COUNT][TLB_SIZE];
+	uint64_t tlb_hits[TLB_COUNT];
+	uint64_t tlb_misses[TLB_COUNT];
+#endif
+};
+
+static dirty_chunk_t * _dirty_find(dirty_chunk_t * chunks, size_t size, uint64_t number)
+{
+	size_t index = _hash_number(number) & (size - 1);
+	while(chunks[index].used && chunks[index].number != number)
+		index = (index + 1) & (size - 1);
+	return &chunks[index];
+}
+
+static dirty_chunk_t * _dirty_get_chunk(memory_t * memory, uint64_t number)
+{
+	if(memory->dirty_chunks_size != 0)
+	{
+		dirty_chunk_t * chunk = _dirty_find(memory->dirty_chunks, memory->dirty_chunks_size, number);
+		if(chunk->used)
+			return chunk;
+	}
+
+	if(2 * (memory->dirty_chunk_count + 1) > memory->dirty_chunks_size)
+	{
+		size_t size = memory->dirty_chunks_size == 0 ? DIRTY_INITIAL_SIZE : memory->dirty_chunks_size * 2;
+		dirty_chunk_t * chunks = calloc(size, sizeof(dirty_chunk_t));
+		for(size_t index = 0; index < memory->dirty_chunks_size; index++)
+		{
+			if(memory->dirty_chunks[index].used)
+				*_dirty_find(chunks, size, memory->dirty_chunks[index].number) = memory->dirty_chunks[index];
+		}
+		free(memory->dirty_chunks);
+		memory->dirty_chunks = chunks;
+		memory->dirty_chunks_size = size;
+	}
+
+	dirty_chunk_t * chunk = _dirty_find(memory->dirty_chunks, memory->dirty_chunks_size, number);
+	chunk->number = number;
+	chunk->used = true;
+	memory->dirty_chunk_count ++;
+	return chunk;
+}
+
+static inline void _memory_mark_dirty(memory_t * memory, uint64_t address, size_t size)
+{
+	if(memory->dirty_subscribers == 0 || size == 0)
+		return;
+
+	if(address < memory->changed_lowest)
+		memory->changed_lowest = address;
+	if(address + (size - 1) > memory->changed_highest)
+		memory->changed_highest = address + (size - 1);
+
+	for(uint64_t page = address / MEMORY_DIRTY_PAGE_SIZE; page <= (address + (size - 1)) / MEMORY_DIRTY_PAGE_SIZE; page++)
+	{
+		dirty_chunk_t * chunk = _dirty_get_chunk(memory, page / DIRTY_CHUNK_PAGES);
+		chunk->bits[(page % DIRTY_CHUNK_PAGES) / 64] |= (uint64_t)1 << (page % 64);
+	}
+}
+
+void memory_dirty_subscribe(memory_t * memory)
+{
+	memory->dirty_subscribers ++;
+}
+
+void memory_dirty_unsubscribe(memory_t * memory)
+{
+	assert(memory->dirty_subscribers > 0);
+	memory->dirty_subscribers --;
+}
+
+bool memory_dirty_test(memory_t * memory, uint64_t address)
+{
+	uint64_t page = address / MEMORY_DIRTY_PAGE_SIZE;
+	if(memory->dirty_chunks_size == 0)
+		return false;
+	dirty_chunk_t * chunk = _dirty_find(memory->dirty_chunks, memory->dirty_chunks_size, page / DIRTY_CHUNK_PAGES);
+	return chunk->used && (chunk->bits[(page % DIRTY_CHUNK_PAGES) / 64] & ((uint64_t)1 << (page % 64))) != 0;
+}
+
+void memory_dirty_for_each(memory_t * memory, void (* callback)(uint64_t address, void * data), void * data)
+{
+	for(size_t index = 0; index < memory->dirty_chunks_size; index++)
+	{
+		dirty_chunk_t * chunk = &memory->dirty_chunks[index];
+		if(!chunk->used)
+			continue;
+		for(size_t page = 0; page < DIRTY_CHUNK_PAGES; page++)
+		{
+			if((chunk->bits[page / 64] & ((uint64_t)1 << (page % 64))) != 0)
+				callback((chunk->number * DIRTY_CHUNK_PAGES + page) * MEMORY_DIRTY_PAGE_SIZE, data);
+		}
+	}
+}
+
+void memory_dirty_clear(memory_t * memory)
+{
+	free(memory->dirty_chunks);
+	memory->dirty_chunks = NULL;
+	memory->dirty_chunks_size = 0;
+	memory->dirty_chunk_count = 0;
+	memory->changed_lowest = -1;
+	memory->changed_highest = 0;
+}
+
+void memory_take_changed_range(memory_t * memory, uint64_t * lowest, uint64_t * highest)
+{
+	*lowest = memory->changed_lowest;
+	*highest = memory->changed_highest;
+	memory->changed_lowest = -1;
+	memory->changed_highest = 0;
+}
+
+static memory_t * _memory_new(void);
 
 #if MEMORY_SINGLE_BLOCK
 
-uint8_t * memory;
+static bool _memory_read(void * data, arm_state_t * cpu, uint64_t address, void * buffer, size_t size, bool privileged_mode)
+{
+	memory_t * memory = data;
+	memcpy(buffer, &memory->contents[address], size);
+	return true;
+}
 
-static bool _memory_read(arm_state_t * cpu, uint64_t address, void * buffer, size_t size, bool privileged_mode)
+static bool _memory_write(void * data, arm_state_t * cpu, uint64_t address, const void * buffer, size_t size, bool privileged_mode)
 {
-	memcpy(buffer, &memory[address], size);
+	memory_t * memory = data;
+	_memory_mark_dirty(memory, address, size);
+	memcpy(&memory->contents[address], buffer, size);
 	return true;
 }
 
-static bool _memory_write(arm_state_t * cpu, uint64_t address, const void * buffer, size_t size, bool privileged_mode)
+static void * _memory_map(void * data, arm_state_t * cpu, uint64_t address, bool write)
+{
+	memory_t * memory = data;
+	if(write && memory->dirty_subscribers != 0)
+		return NULL;
+	return &memory->contents[address];
+}
+
+static void * _memory_map_atomic(void * data, arm_state_t * cpu, uint64_t address, size_t size)
+{
+	memory_t * memory = data;
+	_memory_mark_dirty(memory, address, size);
+	return &memory->contents[address];
+}
+
+memory_t * memory_init(void)
+{
+	memory_t * memory = _memory_new();
+	memory->contents = calloc(1, MEMORY_SINGLE_BLOCK_SIZE);
+	return memory;
+}
+
+void memory_free(memory_t * memory)
+{
+	free(memory->contents);
+	free(memory->dirty_chunks);
+	free(memory);
+}
+
+void memory_tlb_flush(memory_t * memory)
+{
+}
+
+void memory_get_tlb_statistics(memory_t * memory, uint64_t hits[TLB_COUNT], uint64_t misses[TLB_COUNT])
+{
+	memset(hits, 0, TLB_COUNT * sizeof(uint64_t));
+	memset(misses, 0, TLB_COUNT * sizeof(uint64_t));
+}
+
+size_t memory_get_overhead(memory_t * memory)
+{
+	return 0;
+}
+
+static void * _acquire_block(memory_t * memory, uint64_t address, size_t size)
+{
+	return &memory->contents[address];
+}
+
+static void _synchronize_block(memory_t * memory, uint64_t address, size_t size, void * buffer)
+{
+	_memory_mark_dirty(memory, address, size);
+}
+
+void memory_release_block(memory_t * memory, uint64_t address, size_t size, void * buffer)
+{
+}
+
+void memory_for_each_block(memory_t * memory, void (* callback)(uint64_t address, size_t size, void * data), void * data)
+{
+	callback(0, MEMORY_SINGLE_BLOCK_SIZE, data);
+}
+
+static int _acquire_iovec(memory_t * memory, uint64_t address, size_t size, bool write, struct iovec * iov, int max)
+{
+	iov[0].iov_base = &memory->contents[address];
+	iov[0].iov_len = size;
+	return 1;
+}
+
+#elif MEMORY_FLAT
+
+// the range must not wrap around
+static inline bool _commit_pages(memory_t * memory, uint64_t address, size_t size)
 {
-	if(address < memory_changed_lowest)
-		memory_changed_lowest = address;
-	if(address + (size - 1) > memory_changed_highest)
-		memory_changed_highest = address + (size - 1);
-	memcpy(&memory[address], buffer, size);
+	for(uint64_t page = address & ~PAGE_MASK; page < address + size; page += PAGE_SIZE)
+	{
+		if(!memory->committed[page / PAGE_SIZE])
+		{
+			if(mprotect(&memory->contents[page], PAGE_SIZE, PROT_READ | PROT_WRITE) != 0)
+				return false;
+			memory->committed[page / PAGE_SIZE] = true;
+		}
+	}
+	return true;
+}
+
+static bool _memory_read(void * data, arm_state_t * cpu, uint64_t address, void * buffer, size_t size, bool privileged_mode)
+{
+	memory_t * memory = data;
+	address &= MEMORY_FLAT_MASK;
+	if(address + size > MEMORY_FLAT_SIZE)
+	{
+		size_t count = MEMORY_FLAT_SIZE - address;
+		return _memory_read(data, cpu, address, buffer, count, privileged_mode)
+			&& _memory_read(data, cpu, 0, (char *)buffer + count, size - count, privileged_mode);
+	}
+
+	if(!_commit_pages(memory, address, size))
+		return false;
+	memcpy(buffer, &memory->contents[address], size);
 	return true;
 }
 
-void memory_init(void)
+static bool _memory_write(void * data, arm_state_t * cpu, uint64_t address, const void * buffer, size_t size, bool privileged_mode)
+{
+	memory_t * memory = data;
+	address &= MEMORY_FLAT_MASK;
+	if(address + size > MEMORY_FLAT_SIZE)
+	{
+		size_t count = MEMORY_FLAT_SIZE - address;
+		return _memory_write(data, cpu, address, buffer, count, privileged_mode)
+			&& _memory_write(data, cpu, 0, (const char *)buffer + count, size - count, privileged_mode);
+	}
+
+	_memory_mark_dirty(memory, address, size);
+
+	if(!_commit_pages(memory, address, size))
+		return false;
+	memcpy(&memory->contents[address], buffer, size);
+	return true;
+}
+
+static void * _memory_map(void * data, arm_state_t * cpu, uint64_t address, bool write)
+{
+	memory_t * memory = data;
+	if(write && memory->dirty_subscribers != 0)
+		return NULL;
+	address &= MEMORY_FLAT_MASK;
+	if(!_commit_pages(memory, address, ARM_MEMORY_MAP_PAGE_SIZE))
+		return NULL;
+	return &memory->contents[address];
+}
+
+static void * _memory_map_atomic(void * data, arm_state_t * cpu, uint64_t address, size_t size)
 {
-	memory = malloc(0x04000000);
+	memory_t * memory = data;
+	address &= MEMORY_FLAT_MASK;
+	if(!_commit_pages(memory, address, size))
+		return NULL;
+	_memory_mark_dirty(memory, address, size);
+	return &memory->contents[address];
 }
 
-void * memory_acquire_block(uint64_t address, size_t size)
+memory_t * memory_init(void)
 {
-	return &memory[address];
+	memory_t * memory = _memory_new();
+	memory->contents = mmap(NULL, MEMORY_FLAT_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(memory->contents == MAP_FAILED)
+	{
+		fprintf(stderr, "Fatal error: unable to reserve guest memory, leaving\n");
+		exit(1);
+	}
+	return memory;
 }
 
-void memory_synchronize_block(uint64_t address, size_t size, void * buffer)
+void memory_free(memory_t * memory)
 {
+	munmap(memory->contents, MEMORY_FLAT_SIZE);
+	free(memory->dirty_chunks);
+	free(memory);
 }
 
-void memory_release_block(uint64_t address, size_t size, void * buffer)
+void memory_tlb_flush(memory_t * memory)
 {
 }
 
+void memory_get_tlb_statistics(memory_t * memory, uint64_t hits[TLB_COUNT], uint64_t misses[TLB_COUNT])
+{
+	memset(hits, 0, TLB_COUNT * sizeof(uint64_t));
+	memset(misses, 0, TLB_COUNT * sizeof(uint64_t));
+}
+
+size_t memory_get_overhead(memory_t * memory)
+{
+	return sizeof memory->committed;
+}
+
+static void * _acquire_block(memory_t * memory, uint64_t address, size_t size)
+{
+	address &= MEMORY_FLAT_MASK;
+	if(address + size <= MEMORY_FLAT_SIZE && _commit_pages(memory, address, size))
+	{
+		return &memory->contents[address];
+	}
+	else
+	{
+		void * buffer = malloc(size);
+		_memory_read(memory, NULL, address, buffer, size, false);
+		return buffer;
+	}
+}
+
+static void _synchronize_block(memory_t * memory, uint64_t address, size_t size, void * buffer)
+{
+	if(buffer != &memory->contents[address & MEMORY_FLAT_MASK])
+	{
+		_memory_write(memory, NULL, address, buffer, size, false);
+	}
+	else
+	{
+		_memory_mark_dirty(memory, address, size);
+	}
+}
+
+void memory_release_block(memory_t * memory, uint64_t address, size_t size, void * buffer)
+{
+	if(buffer != &memory->contents[address & MEMORY_FLAT_MASK])
+	{
+		free(buffer);
+	}
+}
+
+void memory_for_each_block(memory_t * memory, void (* callback)(uint64_t address, size_t size, void * data), void * data)
+{
+	for(uint64_t page = 0; page < MEMORY_FLAT_SIZE / PAGE_SIZE; page++)
+	{
+		if(memory->committed[page])
+			callback(page * PAGE_SIZE, PAGE_SIZE, data);
+	}
+}
+
+static int _acquire_iovec(memory_t * memory, uint64_t address, size_t size, bool write, struct iovec * iov, int max)
+{
+	address &= MEMORY_FLAT_MASK;
+	if(address + size > MEMORY_FLAT_SIZE || !_commit_pages(memory, address, size))
+		return 0;
+	iov[0].iov_base = &memory->contents[address];
+	iov[0].iov_len = size;
+	return 1;
+}
+
 #else
 
-#define PAGE_SIZE 0x10000 // must be a power of 2
-#define PAGE_MASK ((uint64_t)PAGE_SIZE - 1)
-typedef uint8_t page_t[PAGE_SIZE];
-typedef page_t * page_table_t[0x10000];
-typedef page_table_t * page_directory_t[0x10000];
+static page_map_entry_t * _page_map_find(page_map_entry_t * map, size_t size, uint64_t number)
+{
+	size_t index = _hash_number(number) & (size - 1);
+	while(map[index].page != NULL && map[index].number != number)
+		index = (index + 1) & (size - 1);
+	return &map[index];
+}
 
-page_directory_t * memory_contents[0x10000];
+// keeps the table at most half full
+static void _page_map_grow(memory_t * memory)
+{
+	size_t size = memory->page_map_size == 0 ? PAGE_MAP_INITIAL_SIZE : memory->page_map_size * 2;
+	page_map_entry_t * map = calloc(size, sizeof(page_map_entry_t));
+	for(size_t index = 0; index < memory->page_map_size; index++)
+	{
+		if(memory->page_map[index].page != NULL)
+			*_page_map_find(map, size, memory->page_map[index].number) = memory->page_map[index];
+	}
+	free(memory->page_map);
+	memory->page_map = map;
+	memory->page_map_size = size;
+}
+
+// shared between all instances, never written to
+static page_t memory_zero_page;
 
-static page_t * _get_page(uint64_t address)
+static void _tlb_invalidate(memory_t * memory, uint64_t address);
+
+static page_t * _allocate_page(memory_t * memory)
 {
-	uint16_t directory_index = address >> 48;
-	page_directory_t * directory = memory_contents[directory_index];
-	if(directory == NULL)
+	if(memory->arena_free == 0)
 	{
-		directory = memory_contents[directory_index] = malloc(sizeof(page_directory_t));
+		memory->arena = calloc(PAGE_ARENA_COUNT, sizeof(page_t));
+		memory->arena_free = PAGE_ARENA_COUNT;
+		// kept so that memory_free can release them
+		memory->arenas = realloc(memory->arenas, (memory->arena_count + 1) * sizeof(page_t *));
+		memory->arenas[memory->arena_count++] = memory->arena;
 	}
+	memory->arena_free --;
+	return memory->arena++;
+}
 
-	uint16_t table_index = (address >> 32) & 0xFFFF;
-	page_table_t * table = (*directory)[table_index];
-	if((*directory)[table_index] == NULL)
+// returns the shared zero page if the page has not been allocated yet and write is not set
+static page_t * _get_page(memory_t * memory, uint64_t address, bool write)
+{
+	uint64_t number = address / PAGE_SIZE;
+	if(memory->page_map_size != 0)
 	{
-		table = (*directory)[table_index] = malloc(sizeof(page_table_t));
+		page_map_entry_t * entry = _page_map_find(memory->page_map, memory->page_map_size, number);
+		if(entry->page != NULL)
+			return entry->page;
 	}
 
-	uint16_t page_index = (address >> 16) & 0xFFFF;
-	page_t * page = (*table)[page_index];
-	if((*table)[page_index] == NULL)
+	if(!write)
+		return &memory_zero_page;
+
+	if(2 * (memory->page_count + 1) > memory->page_map_size)
+		_page_map_grow(memory);
+
+	page_map_entry_t * entry = _page_map_find(memory->page_map, memory->page_map_size, number);
+	entry->number = number;
+	entry->page = _allocate_page(memory);
+	memory->page_count ++;
+	// the TLB might still refer to the zero page
+	_tlb_invalidate(memory, address);
+	return entry->page;
+}
+
+size_t memory_get_overhead(memory_t * memory)
+{
+	return memory->page_map_size * sizeof(page_map_entry_t);
+}
+
+void memory_tlb_flush(memory_t * memory)
+{
+	memset(memory->tlb, 0, sizeof memory->tlb);
+}
+
+void memory_get_tlb_statistics(memory_t * memory, uint64_t hits[TLB_COUNT], uint64_t misses[TLB_COUNT])
+{
+	memcpy(hits, memory->tlb_hits, sizeof memory->tlb_hits);
+	memcpy(misses, memory->tlb_misses, sizeof memory->tlb_misses);
+}
+
+static void _tlb_invalidate(memory_t * memory, uint64_t address)
+{
+	for(int access = 0; access < TLB_COUNT; access++)
 	{
-		page = (*table)[page_index] = malloc(sizeof(page_t));
+		tlb_entry_t * entry = &memory->tlb[access][(address / PAGE_SIZE) & (TLB_SIZE - 1)];
+		if(entry->address == (address & ~PAGE_MASK))
+			entry->page = NULL;
 	}
+}
 
-	return page;
+static inline uint8_t * _lookup_page(memory_t * memory, uint64_t address, int access)
+{
+	tlb_entry_t * entry = &memory->tlb[access][(address / PAGE_SIZE) & (TLB_SIZE - 1)];
+	if(entry->page != NULL && entry->address == (address & ~PAGE_MASK))
+	{
+		memory->tlb_hits[access] ++;
+		return entry->page;
+	}
+
+	memory->tlb_misses[access] ++;
+	entry->address = address & ~PAGE_MASK;
+	entry->page = *_get_page(memory, address, access == TLB_WRITE);
+	return entry->page;
 }
 
-static bool _memory_read(arm_state_t * cpu, uint64_t address, void * buffer, size_t size, bool privileged_mode)
+static inline bool _memory_read_page(memory_t * memory, uint64_t address, void * buffer, size_t size, int access)
 {
 	while(size > 0)
 	{
-		uint8_t * page = *_get_page(address);
+		uint8_t * page = _lookup_page(memory, address, access);
 		size_t count = PAGE_SIZE - (address & PAGE_MASK);
 		if(size < count)
 		{
@@ -160,16 +684,24 @@ static bool _memory_read(arm_state_t * cpu, uint64_t address, void * buffer, siz
 	return true;
 }
 
-static bool _memory_write(arm_state_t * cpu, uint64_t address, const void * buffer, size_t size, bool privileged_mode)
+static bool _memory_read(void * data, arm_state_t * cpu, uint64_t address, void * buffer, size_t size, bool privileged_mode)
 {
-	if(address < memory_changed_lowest)
-		memory_changed_lowest = address;
-	if(address + (size - 1) > memory_changed_highest)
-		memory_changed_highest = address + (size - 1);
+	return _memory_read_page(data, address, buffer, size, TLB_READ);
+}
+
+static bool _memory_fetch(void * data, arm_state_t * cpu, uint64_t address, void * buffer, size_t size, bool privileged_mode)
+{
+	return _memory_read_page(data, address, buffer, size, TLB_FETCH);
+}
+
+static bool _memory_write(void * data, arm_state_t * cpu, uint64_t address, const void * buffer, size_t size, bool privileged_mode)
+{
+	memory_t * memory = data;
+	_memory_mark_dirty(memory, address, size);
 
 	while(size > 0)
 	{
-		uint8_t * page = *_get_page(address);
+		uint8_t * page = _lookup_page(memory, address, TLB_WRITE);
 		size_t count = PAGE_SIZE - (address & PAGE_MASK);
 		if(size < count)
 		{
@@ -184,104 +716,509 @@ static bool _memory_write(arm_state_t * cpu, uint64_t address, const void * buff
 			address += count;
 		}
 	}
-	return true;
+	return true;
+}
+
+static void * _memory_map(void * data, arm_state_t * cpu, uint64_t address, bool write)
+{
+	memory_t * memory = data;
+	if(write && memory->dirty_subscribers != 0)
+		return NULL;
+	uint8_t * page = _lookup_page(memory, address, write ? TLB_WRITE : TLB_READ);
+	// the zero page is replaced on the first write, so it must not be cached
+	if(page == memory_zero_page)
+		return NULL;
+	return &page[address & PAGE_MASK];
+}
+
+static void * _memory_map_atomic(void * data, arm_state_t * cpu, uint64_t address, size_t size)
+{
+	memory_t * memory = data;
+	_memory_mark_dirty(memory, address, size);
+	return &(*_get_page(memory, address, true))[address & PAGE_MASK];
+}
+
+memory_t * memory_init(void)
+{
+	return _memory_new();
+}
+
+void memory_free(memory_t * memory)
+{
+	for(size_t index = 0; index < memory->arena_count; index++)
+		free(memory->arenas[index]);
+	free(memory->arenas);
+	free(memory->page_map);
+	free(memory->dirty_chunks);
+	free(memory);
+}
+
+static void * _acquire_block(memory_t * memory, uint64_t address, size_t size)
+{
+	if(((address + size - 1) & ~PAGE_MASK) == (address & ~PAGE_MASK))
+	{
+		return &(*_get_page(memory, address, true))[address & PAGE_MASK];
+	}
+	else
+	{
+		void * buffer = malloc(size);
+		_memory_read(memory, NULL, address, buffer, size, false);
+		return buffer;
+	}
+}
+
+static void _synchronize_block(memory_t * memory, uint64_t address, size_t size, void * buffer)
+{
+	if(((address + size - 1) & ~PAGE_MASK) != (address & ~PAGE_MASK))
+	{
+		_memory_write(memory, NULL, address, buffer, size, false);
+	}
+	else
+	{
+		_memory_mark_dirty(memory, address, size);
+	}
+}
+
+void memory_release_block(memory_t * memory, uint64_t address, size_t size, void * buffer)
+{
+	if(((address + size - 1) & ~PAGE_MASK) != (address & ~PAGE_MASK))
+	{
+		free(buffer);
+	}
+}
+
+void memory_for_each_block(memory_t * memory, void (* callback)(uint64_t address, size_t size, void * data), void * data)
+{
+	for(size_t index = 0; index < memory->page_map_size; index++)
+	{
+		if(memory->page_map[index].page != NULL)
+			callback(memory->page_map[index].number * PAGE_SIZE, PAGE_SIZE, data);
+	}
+}
+
+static int _acquire_iovec(memory_t * memory, uint64_t address, size_t size, bool write, struct iovec * iov, int max)
+{
+	// each page is a separate fragment, none of them get allocated unless all of them fit
+	if(size != 0 && (address + size - 1) / PAGE_SIZE - address / PAGE_SIZE >= (uint64_t)max)
+		return 0;
+
+	int count = 0;
+	while(size > 0)
+	{
+		size_t length = PAGE_SIZE - (address & PAGE_MASK);
+		if(length > size)
+			length = size;
+		// reading from memory that was never written can use the zero page
+		iov[count].iov_base = &(*_get_page(memory, address, write))[address & PAGE_MASK];
+		iov[count].iov_len = length;
+		count ++;
+		address += length;
+		size -= length;
+	}
+	return count;
+}
+#endif
+
+/* Shared memory
+ * The public functions and the callbacks of the interface take the lock, the backends themselves are not thread safe
+ * Host addresses, once returned by the map callback, stay valid, so the CPUs can access them without the lock
+ */
+
+static inline void _memory_lock(memory_t * memory)
+{
+	if(memory->shared)
+		pthread_mutex_lock(&memory->lock);
+}
+
+static inline void _memory_unlock(memory_t * memory)
+{
+	if(memory->shared)
+		pthread_mutex_unlock(&memory->lock);
+}
+
+static bool _locked_read(void * data, arm_state_t * cpu, uint64_t address, void * buffer, size_t size, bool privileged_mode)
+{
+	_memory_lock(data);
+	bool result = _memory_read(data, cpu, address, buffer, size, privileged_mode);
+	_memory_unlock(data);
+	return result;
+}
+
+static bool _locked_write(void * data, arm_state_t * cpu, uint64_t address, const void * buffer, size_t size, bool privileged_mode)
+{
+	_memory_lock(data);
+	bool result = _memory_write(data, cpu, address, buffer, size, privileged_mode);
+	_memory_unlock(data);
+	return result;
+}
+
+#if !MEMORY_SINGLE_BLOCK && !MEMORY_FLAT
+static bool _locked_fetch(void * data, arm_state_t * cpu, uint64_t address, void * buffer, size_t size, bool privileged_mode)
+{
+	_memory_lock(data);
+	bool result = _memory_fetch(data, cpu, address, buffer, size, privileged_mode);
+	_memory_unlock(data);
+	return result;
+}
+#endif
+
+static void * _locked_map(void * data, arm_state_t * cpu, uint64_t address, bool write)
+{
+	_memory_lock(data);
+	void * result = _memory_map(data, cpu, address, write);
+	_memory_unlock(data);
+	return result;
+}
+
+static void * _locked_map_atomic(void * data, arm_state_t * cpu, uint64_t address, size_t size)
+{
+	_memory_lock(data);
+	void * result = _memory_map_atomic(data, cpu, address, size);
+	_memory_unlock(data);
+	return result;
+}
+
+static memory_t * _memory_new(void)
+{
+	memory_t * memory = calloc(1, sizeof(memory_t));
+	pthread_mutex_init(&memory->lock, NULL);
+	memory->interface.data = memory;
+	memory->interface.read = _locked_read;
+	memory->interface.write = _locked_write;
+#if !MEMORY_SINGLE_BLOCK && !MEMORY_FLAT
+	memory->interface.fetch = _locked_fetch;
+#endif
+	memory->interface.map = _locked_map;
+	memory->interface.map_atomic = _locked_map_atomic;
+	memory->changed_lowest = -1;
+	memory->changed_highest = 0;
+	return memory;
+}
+
+void memory_set_shared(memory_t * memory)
+{
+	memory->shared = true;
+}
+
+void * memory_acquire_block(memory_t * memory, uint64_t address, size_t size)
+{
+	_memory_lock(memory);
+	void * block = _acquire_block(memory, address, size);
+	_memory_unlock(memory);
+	return block;
+}
+
+void memory_synchronize_block(memory_t * memory, uint64_t address, size_t size, void * buffer)
+{
+	_memory_lock(memory);
+	_synchronize_block(memory, address, size, buffer);
+	_memory_unlock(memory);
+}
+
+int memory_acquire_iovec(memory_t * memory, uint64_t address, size_t size, bool write, struct iovec * iov, int max)
+{
+	_memory_lock(memory);
+	int count = _acquire_iovec(memory, address, size, write, iov, max);
+	_memory_unlock(memory);
+	return count;
+}
+
+const memory_interface_t * memory_get_interface(memory_t * memory)
+{
+	return &memory->interface;
+}
+
+void memory_synchronize_iovec(memory_t * memory, uint64_t address, size_t size)
+{
+	_memory_lock(memory);
+	_memory_mark_dirty(memory, address, size);
+	_memory_unlock(memory);
+}
+
+/* Snapshots
+ * A snapshot holds the architectural state of the CPU and a copy of every page of guest memory that is not all zeros
+ * Taking a snapshot starts dirty tracking, so restoring it only needs to copy back the pages written since then
+ */
+
+typedef struct snapshot_page_t
+{
+	uint64_t address;
+	uint8_t * contents; // MEMORY_DIRTY_PAGE_SIZE bytes
+} snapshot_page_t;
+
+struct arm_snapshot_t
+{
+	uint8_t state[ARM_STATE_SNAPSHOT_SIZE];
+	memory_t * memory;
+	size_t page_count;
+	size_t page_capacity;
+	snapshot_page_t * pages;
+};
+
+static const uint8_t _zero_chunk[MEMORY_DIRTY_PAGE_SIZE];
+
+typedef struct snapshot_save_t
+{
+	arm_snapshot_t * snapshot;
+	memory_t * memory;
+} snapshot_save_t;
+
+static void _snapshot_save_block(uint64_t address, size_t size, void * data)
+{
+	arm_snapshot_t * snapshot = ((snapshot_save_t *)data)->snapshot;
+	memory_t * memory = ((snapshot_save_t *)data)->memory;
+	for(uint64_t page = address; page < address + size; page += MEMORY_DIRTY_PAGE_SIZE)
+	{
+		uint8_t * block = memory_acquire_block(memory, page, MEMORY_DIRTY_PAGE_SIZE);
+		if(memcmp(block, _zero_chunk, MEMORY_DIRTY_PAGE_SIZE) != 0)
+		{
+			if(snapshot->page_count == snapshot->page_capacity)
+			{
+				snapshot->page_capacity = snapshot->page_capacity == 0 ? 0x40 : snapshot->page_capacity * 2;
+				snapshot->pages = realloc(snapshot->pages, snapshot->page_capacity * sizeof(snapshot_page_t));
+			}
+			snapshot->pages[snapshot->page_count].address = page;
+			snapshot->pages[snapshot->page_count].contents = malloc(MEMORY_DIRTY_PAGE_SIZE);
+			memcpy(snapshot->pages[snapshot->page_count].contents, block, MEMORY_DIRTY_PAGE_SIZE);
+			snapshot->page_count ++;
+		}
+		memory_release_block(memory, page, MEMORY_DIRTY_PAGE_SIZE, block);
+	}
 }
 
-void memory_init(void)
+static int _snapshot_compare_pages(const void * a, const void * b)
 {
+	uint64_t address1 = ((const snapshot_page_t *)a)->address;
+	uint64_t address2 = ((const snapshot_page_t *)b)->address;
+	return address1 < address2 ? -1 : address1 > address2 ? 1 : 0;
 }
 
-void * memory_acquire_block(uint64_t address, size_t size)
+arm_snapshot_t * arm_snapshot_take(arm_state_t * cpu)
 {
-	if(((address + size) & ~PAGE_MASK) == (address & ~PAGE_MASK))
+	if(cpu->global_monitor != NULL)
 	{
-		return &(*_get_page(address))[address & PAGE_MASK];
+		// the other processors keep writable mappings that bypass dirty tracking, so restoring would miss their writes
+		pthread_mutex_lock(&cpu->global_monitor->cpu_lock);
+		size_t cpu_count = cpu->global_monitor->cpu_count;
+		pthread_mutex_unlock(&cpu->global_monitor->cpu_lock);
+		if(cpu_count > 1)
+			return NULL;
 	}
-	else
+
+	memory_t * memory = cpu->memory->data;
+	arm_evaluate_flags(cpu);
+
+	arm_snapshot_t * snapshot = calloc(1, sizeof(arm_snapshot_t));
+	snapshot->memory = memory;
+	memcpy(snapshot->state, cpu, ARM_STATE_SNAPSHOT_SIZE);
+	memory_for_each_block(memory, _snapshot_save_block, &(snapshot_save_t) { .snapshot = snapshot, .memory = memory });
+	qsort(snapshot->pages, snapshot->page_count, sizeof(snapshot_page_t), _snapshot_compare_pages);
+
+	if(memory->snapshot_current == NULL)
 	{
-		void * buffer = malloc(size);
-		_memory_read(NULL, address, buffer, size, false);
-		return buffer;
+		memory_dirty_subscribe(memory);
+		arm_memory_map_flush(cpu);
 	}
+	memory->snapshot_current = snapshot;
+	memory_dirty_clear(memory);
+	return snapshot;
 }
 
-void memory_synchronize_block(uint64_t address, size_t size, void * buffer)
+typedef struct snapshot_restore_t
 {
-	if(((address + size) & ~PAGE_MASK) != (address & ~PAGE_MASK))
-	{
-		_memory_write(NULL, address, buffer, size, false);
-	}
+	arm_snapshot_t * snapshot;
+	arm_state_t * cpu;
+} snapshot_restore_t;
+
+static void _snapshot_restore_page(uint64_t address, void * data)
+{
+	snapshot_restore_t * restore = data;
+	snapshot_page_t key = { .address = address };
+	snapshot_page_t * saved = bsearch(&key, restore->snapshot->pages, restore->snapshot->page_count, sizeof(snapshot_page_t), _snapshot_compare_pages);
+
+	memory_t * memory = restore->snapshot->memory;
+	uint8_t * block = memory_acquire_block(memory, address, MEMORY_DIRTY_PAGE_SIZE);
+	memcpy(block, saved != NULL ? saved->contents : _zero_chunk, MEMORY_DIRTY_PAGE_SIZE);
+	memory_synchronize_block(memory, address, MEMORY_DIRTY_PAGE_SIZE, block);
+	memory_release_block(memory, address, MEMORY_DIRTY_PAGE_SIZE, block);
+
+	arm_decode_cache_invalidate(restore->cpu, address, MEMORY_DIRTY_PAGE_SIZE);
 }
 
-void memory_release_block(uint64_t address, size_t size, void * buffer)
+void arm_snapshot_restore(arm_snapshot_t * snapshot, arm_state_t * cpu)
 {
-	if(((address + size) & ~PAGE_MASK) != (address & ~PAGE_MASK))
+	assert(snapshot == snapshot->memory->snapshot_current);
+
+	memcpy(cpu, snapshot->state, ARM_STATE_SNAPSHOT_SIZE);
+	memory_dirty_for_each(snapshot->memory, _snapshot_restore_page, &(snapshot_restore_t) { .snapshot = snapshot, .cpu = cpu });
+	memory_dirty_clear(snapshot->memory);
+}
+
+void arm_snapshot_free(arm_snapshot_t * snapshot)
+{
+	if(snapshot == snapshot->memory->snapshot_current)
 	{
-		free(buffer);
+		snapshot->memory->snapshot_current = NULL;
+		memory_dirty_unsubscribe(snapshot->memory);
 	}
+
+	for(size_t index = 0; index < snapshot->page_count; index++)
+		free(snapshot->pages[index].contents);
+	free(snapshot->pages);
+	free(snapshot);
 }
+
+/* BE32 memory is stored word invariant, so byte order sensitive data (such as system call buffers) must be converted
+ * These copy between a buffer in guest byte order and the storage of the words that contain it, starting at the word containing address
+ * Whole words are converted four at a time with a single vector shuffle where the compiler supports it, the rest with a byte reversal each
+ */
+#if defined __clang__
+typedef uint8_t _word_vector_t __attribute__((vector_size(16)));
+# define REVERSE_WORDS(vector) __builtin_shufflevector(vector, vector, 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12)
+#elif defined __GNUC__
+typedef uint8_t _word_vector_t __attribute__((vector_size(16)));
+# define REVERSE_WORDS(vector) __builtin_shuffle(vector, (_word_vector_t) { 3, 2, 1, 0, 7, 6, 5, 4, 11, 10, 9, 8, 15, 14, 13, 12 })
 #endif
 
-void * memory_acquire_block_reversed(uint64_t address, size_t size)
+static void _swap_words(uint8_t * block, uint8_t * buffer, uint64_t address, size_t count, bool store)
 {
-	void * buffer = malloc(size);
+	uint64_t base = address & ~(uint64_t)3;
 	size_t offset = 0;
-
-	if((address & 3) != 0)
+	for(; offset < count && ((address + offset) & 3) != 0; offset++)
 	{
-		for(int i = address & 3; i < 4; i++)
-			_memory_read(NULL, (address + i) ^ 3, (uint8_t *)buffer + i, 1, false);
-		offset = ~address & 3;
+		if(store)
+			block[((address + offset) ^ 3) - base] = buffer[offset];
+		else
+			buffer[offset] = block[((address + offset) ^ 3) - base];
 	}
-
-	for(; offset < size; offset += 4)
+#ifdef REVERSE_WORDS
+	for(; offset + 16 <= count; offset += 16)
+	{
+		_word_vector_t value;
+		if(store)
+		{
+			memcpy(&value, &buffer[offset], 16);
+			value = REVERSE_WORDS(value);
+			memcpy(&block[address + offset - base], &value, 16);
+		}
+		else
+		{
+			memcpy(&value, &block[address + offset - base], 16);
+			value = REVERSE_WORDS(value);
+			memcpy(&buffer[offset], &value, 16);
+		}
+	}
+#endif
+	for(; offset + 4 <= count; offset += 4)
 	{
 		uint32_t value;
-		_memory_read(NULL, address + offset, &value, 4, false);
-		value = bswap_32(value);
-		memcpy((uint8_t *)buffer + offset, &value, 4);
+		if(store)
+		{
+			memcpy(&value, &buffer[offset], 4);
+			value = bswap_32(value);
+			memcpy(&block[address + offset - base], &value, 4);
+		}
+		else
+		{
+			memcpy(&value, &block[address + offset - base], 4);
+			value = bswap_32(value);
+			memcpy(&buffer[offset], &value, 4);
+		}
 	}
-
-	if(offset != size)
+	for(; offset < count; offset++)
 	{
-		offset -= 4;
-		for(offset -= 4; offset < size; offset++)
-			_memory_read(NULL, (address + offset) ^ 3, (uint8_t *)buffer + offset, 1, false);
+		if(store)
+			block[((address + offset) ^ 3) - base] = buffer[offset];
+		else
+			buffer[offset] = block[((address + offset) ^ 3) - base];
 	}
+}
+
+static inline size_t _swapped_block_size(uint64_t address, size_t size)
+{
+	return ((address + size + 3) & ~(uint64_t)3) - (address & ~(uint64_t)3);
+}
 
+void * memory_acquire_block_reversed(memory_t * memory, uint64_t address, size_t size)
+{
+	void * buffer = malloc(size);
+	void * block = memory_acquire_block(memory, address & ~(uint64_t)3, _swapped_block_size(address, size));
+	_swap_words(block, buffer, address, size, false);
+	memory_release_block(memory, address & ~(uint64_t)3, _swapped_block_size(address, size), block);
 	return buffer;
 }
 
-void memory_synchronize_block_reversed(uint64_t address, size_t size, void * buffer)
+void memory_synchronize_block_reversed(memory_t * memory, uint64_t address, size_t size, void * buffer)
 {
-	size_t offset = 0;
+	void * block = memory_acquire_block(memory, address & ~(uint64_t)3, _swapped_block_size(address, size));
+	_swap_words(block, buffer, address, size, true);
+	memory_synchronize_block(memory, address & ~(uint64_t)3, _swapped_block_size(address, size), block);
+	memory_release_block(memory, address & ~(uint64_t)3, _swapped_block_size(address, size), block);
+}
 
-	if((address & 3) != 0)
-	{
-		for(int i = address & 3; i < 4; i++)
-			_memory_write(NULL, (address + i) ^ 3, (uint8_t *)buffer + i, 1, false);
-		offset = ~address & 3;
-	}
+void memory_release_block_reversed(memory_t * memory, uint64_t address, size_t size, void * buffer)
+{
+	free(buffer);
+}
 
-	for(; offset < size; offset += 4)
-	{
-		uint32_t value;
-		_memory_write(NULL, address + offset, &value, 4, false);
-		value = bswap_32(value);
-		memcpy((uint8_t *)buffer + offset, &value, 4);
-	}
+/* Bulk loading
+ * Stores data in guest memory as if it had been written one byte at a time, but a chunk at a time, each chunk staying within a page
+ * In BE32 memory, the bytes of each word are reversed in a single pass over the chunk
+ */
+
+#define LOAD_CHUNK_SIZE 0x1000 // must be a power of 2, at most the page size of any memory backend
+
+// reads count bytes from the file (or zeros if file is NULL) into guest memory, stopping at the end of the file, returns the number of bytes stored
+uint64_t memory_load_file(memory_t * memory, FILE * file, uint64_t address, uint64_t count, bool swapped)
+{
+	uint8_t buffer[LOAD_CHUNK_SIZE];
+	uint64_t loaded = 0;
+
+	if(file == NULL)
+		memset(buffer, 0, sizeof buffer);
 
-	if(offset != size)
+	while(loaded < count)
 	{
-		offset -= 4;
-		for(offset -= 4; offset < size; offset++)
-			_memory_write(NULL, (address + offset) ^ 3, (uint8_t *)buffer + offset, 1, false);
+		uint64_t start = address + loaded;
+		size_t size = LOAD_CHUNK_SIZE - (start & (LOAD_CHUNK_SIZE - 1));
+		if(size > count - loaded)
+			size = count - loaded;
+
+		if(file != NULL)
+		{
+			size = fread(buffer, 1, size, file);
+			if(size == 0)
+				break;
+		}
+		else
+		{
+			// memory that was never written already reads as zeros, storing them would allocate its pages
+			struct iovec iov[2];
+			int iov_count = memory_acquire_iovec(memory, start, size, false, iov, 2);
+			bool is_zero = iov_count != 0;
+			for(int i = 0; i < iov_count && is_zero; i++)
+				is_zero = memcmp(iov[i].iov_base, buffer, iov[i].iov_len) == 0;
+			if(is_zero)
+			{
+				loaded += size;
+				continue;
+			}
+		}
+
+		uint64_t base = swapped ? start & ~(uint64_t)3 : start;
+		size_t block_size = swapped ? _swapped_block_size(start, size) : size;
+		uint8_t * block = memory_acquire_block(memory, base, block_size);
+		if(swapped)
+			_swap_words(block, buffer, start, size, true);
+		else
+			memcpy(block, buffer, size);
+		memory_synchronize_block(memory, base, block_size, block);
+		memory_release_block(memory, base, block_size, block);
+
+		loaded += size;
 	}
-}
 
-void memory_release_block_reversed(uint64_t address, size_t size, void * buffer)
-{
-	free(buffer);
+	return loaded;
 }
 
 // feature sets
@@ -366,6 +1303,8 @@ static const struct
 // TODO: R82 implements AArch64
 	{ "8-r64", ARMV8, ARM_PART_CORTEX_R52,  ARMV8_ISAS,    (ARMV8_DEFAULT_FEATURES64 | ARM_PROFILE_R) & ~(1 << FEATURE_ARM32) },
 	{ "8-m",   ARMV8, ARM_PART_CORTEX_M33,  ARMV7_ISAS,     ARMV8_DEFAULT_FEATURES32 | ARM_PROFILE_M },
+	{ "8.1",   ARMV81, ARM_PART_CORTEX_A32, ARMV8_ISAS,     ARMV8_DEFAULT_FEATURES64 | ARM_PROFILE_A },
+	{ "8.1-a", ARMV81, ARM_PART_CORTEX_A32, ARMV8_ISAS,     ARMV8_DEFAULT_FEATURES64 | ARM_PROFILE_A },
 
 // very rough approximation of specific chips
 	{ "arm1",        ARMV1, ARM_PART_ARM1,        ARMV1_ISAS,     ARMV1_DEFAULT_FEATURES },
@@ -465,12 +1404,6 @@ static const struct
 	{ "javaext", 0, 0, .min_java = ARM_JAVA_EXTENSION },
 };
 
-static const memory_interface_t _memory_interface =
-{
-	.read = _memory_read,
-	.write = _memory_write,
-};
-
 void init_isa(arm_configuration_t * cfg, arm_instruction_set_t * isa, arm_syntax_t * syntax, thumb2_support_t thumb2, bool force32bit)
 {
 	if(*isa == ISA_UNKNOWN)
@@ -651,103 +1584,530 @@ void init_isa(arm_configuration_t * cfg, arm_instruction_set_t * isa, arm_syntax
 				fprintf(stderr, "No SIMD support for selected architecture\n");
 				cfg->features &= ~(1 << FEATURE_SIMD);
 			}
-			if(need_fp)
+			if(need_fp)
+			{
+				// only FPA support
+				cfg->features &= ~(1 << FEATURE_VFP);
+				cfg->features |= (1 << FEATURE_FPA);
+			}
+			break;
+		case ARMV5:
+		case ARMV6:
+			if(need_simd)
+			{
+				fprintf(stderr, "No SIMD support for selected architecture\n");
+				cfg->features &= ~(1 << FEATURE_SIMD);
+			}
+			if(need_fp)
+			{
+				cfg->fp_version = ARM_VFPV2;
+			}
+			break;
+		case ARMV7:
+			// TODO: M-profile has MVE, not AdvSIMD
+			if((cfg->features & FEATURE_PROFILE_MASK) == ARM_PROFILE_M)
+				cfg->fp_version = ARM_VFPV5;
+			else if(!(cfg->features & (1 << FEATURE_VIRTUALIZATION)))
+				cfg->fp_version = ARM_VFPV3;
+			else
+				cfg->fp_version = ARM_VFPV4;
+			break;
+		case ARMV8:
+		case ARMV81:
+		case ARMV82:
+		case ARMV83:
+		case ARMV9:
+			cfg->fp_version = ARM_V8FP;
+			break;
+		}
+	}
+}
+
+void isa_display(arm_configuration_t config, arm_instruction_set_t isa, arm_syntax_t syntax, bool disasm, arm_endianness_t endian)
+{
+	printf("Instruction set: ");
+	switch(isa)
+	{
+	default:
+		printf("%s", arm_instruction_set_names[isa]);
+		break;
+	case ISA_THUMB32:
+		if(!(config.features & (1 << FEATURE_THUMB2)))
+			printf("Thumb");
+		else
+			printf("Thumb-2");
+		break;
+	}
+	if(isa != ISA_JAZELLE)
+	{
+		printf(", version: %s", arm_version_names[config.version]);
+		if((config.features & (1 << FEATURE_FPA)) != 0)
+			printf(", FPA");
+		else if((config.features & (1 << FEATURE_VFP)) != 0)
+			printf(", %s", arm_fp_version_names[config.fp_version]);
+
+		if((config.features & (1 << FEATURE_SIMD)) != 0)
+			printf(", Advanced SIMD (Neon)");
+		else if((config.features & (1 << FEATURE_MVE)) != 0)
+			printf(", MVE (Helium)");
+
+		if(disasm && (isa == ISA_AARCH32 || isa == ISA_THUMB32 || isa == ISA_THUMBEE))
+		{
+			printf(", syntax: ");
+			switch(syntax)
+			{
+			case SYNTAX_UNKNOWN:
+				assert(false);
+			case SYNTAX_DIVIDED:
+				printf("divided (pre-UAL)");
+				break;
+			case SYNTAX_UNIFIED:
+				printf("unified (UAL)");
+				break;
+			}
+		}
+
+		switch(endian)
+		{
+		case ARM_ENDIAN_LITTLE:
+			printf(", little endian (LE)");
+			break;
+		case ARM_ENDIAN_BIG:
+			printf(", big endian, byte invariant (BE-8)");
+			break;
+		case ARM_ENDIAN_SWAPPED:
+			printf(", big endian, word invariant (BE-32)");
+			break;
+		}
+	}
+	printf("\n");
+}
+
+void setup_cpu(arm_state_t * cpu, environment_t * env, arm_part_number_t part_number, bool system_calls)
+{
+#if MEMORY_FLAT
+	// the flat memory truncates addresses to 32 bits, refuse guests that could use addresses beyond that
+	if(env->isa == ISA_AARCH64 || env->elf_class == ELFCLASS64 || env->entry > MEMORY_FLAT_MASK || env->stack > MEMORY_FLAT_MASK)
+	{
+		fprintf(env->message_file, "Fatal error: flat memory only supports 32-bit guests, leaving\n");
+		exit_emulation(env, 1);
+	}
+#endif
+
+	arm_emu_init(cpu, env->config, env->supported_isas, env->memory_interface);
+	arm_set_isa(cpu, env->isa);
+	cpu->part_number = part_number;
+	cpu->vendor = ARM_VENDOR_ARM;
+
+	switch(env->endian)
+	{
+	case ARM_ENDIAN_LITTLE:
+		break;
+	case ARM_ENDIAN_BIG:
+		// v6+
+		cpu->pstate.e = 1;
+		break;
+	case ARM_ENDIAN_SWAPPED:
+		// until v7
+		cpu->sctlr_el1 |= SCTLR_B;
+		break;
+	}
+
+	if(system_calls)
+	{
+		// array layout:
+		/*
+		struct
+		{
+			uint32_t size_in_dwords;
+		actual start of array:
+			uint32_t elements[1];
+		};
+		*/
+		cpu->joscr = JOSCR_FLAT_ARRAY;
+		cpu->jaolr = JAOLR_LENGTH_SUB | (4 << JAOLR_LENGTH_OFF_SHIFT) | (0 << JAOLR_ELEMENT_OFF_SHIFT) | (2 << JAOLR_LENSHIFT_SHIFT);
+	}
+	else
+	{
+		// array layout:
+		/*
+		struct
+		{
+			uint32_t size_in_dwords;
+			uint64_t * elements;
+		};
+		*/
+		cpu->joscr = 0;
+		cpu->jaolr = (0 << JAOLR_LENGTH_OFF_SHIFT) | (9 << JAOLR_ELEMENT_OFF_SHIFT) | (3 << JAOLR_LENSHIFT_SHIFT);
+	}
+}
+
+static void print_statistics(environment_t * env)
+{
+	arm_state_t * cpu = env->report_cpu;
+	fprintf(stderr, "Instructions executed: %"PRIu64"\n", cpu->instruction_count);
+	fprintf(stderr, "Decoders: %s\n", cpu->decoder_profile != NULL ? cpu->decoder_profile : "generic");
+	fprintf(stderr, "Decode cache: %"PRIu64" hits, %"PRIu64" misses\n", cpu->decode_cache_hits, cpu->decode_cache_misses);
+	fprintf(stderr, "Block cache: %"PRIu64" hits, %"PRIu64" misses\n", cpu->block_cache_hits, cpu->block_cache_misses);
+
+	static const char * const tlb_names[TLB_COUNT] = { [TLB_READ] = "Read", [TLB_WRITE] = "Write", [TLB_FETCH] = "Fetch" };
+	uint64_t tlb_hits[TLB_COUNT], tlb_misses[TLB_COUNT];
+	memory_get_tlb_statistics(env->memory, tlb_hits, tlb_misses);
+	for(int access = 0; access < TLB_COUNT; access++)
+		fprintf(stderr, "%s TLB: %"PRIu64" hits, %"PRIu64" misses\n", tlb_names[access], tlb_hits[access], tlb_misses[access]);
+	fprintf(stderr, "Memory overhead: %zu bytes\n", memory_get_overhead(env->memory));
+}
+
+// a program run by the batch runner returns to its worker thread instead
+void exit_emulation(environment_t * env, int status)
+{
+	if(env->report_cpu != NULL && env->report_statistics)
+		print_statistics(env);
+	if(env->report_cpu != NULL && env->report_registers)
+		debug(stderr, env->report_cpu, NULL);
+	if(env->exit_point != NULL)
+	{
+		env->exit_status = status;
+		longjmp(*env->exit_point, 1);
+	}
+	exit(status);
+}
+
+/* Handles the reason the CPU stopped, emulating system calls and reporting exceptions
+ * Every other result ends the program
+ */
+void handle_result(arm_state_t * cpu, environment_t * env, arm_emu_result_t result)
+{
+	switch(result)
+	{
+	case ARM_EMU_OK:
+		break;
+	case ARM_EMU_RESET:
+		fprintf(env->message_file, "RESET\n");
+		exit_emulation(env, 0);
+	case ARM_EMU_SVC:
+		switch(arm_get_current_instruction_set(cpu))
+		{
+		case ISA_JAZELLE:
+			if(!j32_linux_syscall(cpu, env, -1))
+			{
+				fprintf(env->message_file, "%s\n", env->syntax == SYNTAX_DIVIDED ? "SWI" : "SVC");
+				fprintf(env->message_file, "Unknown Jazelle system call: %d\n", j32_peek_word(cpu, 0));
+				exit_emulation(env, 0);
+			}
+			break;
+		case ISA_AARCH32:
+		case ISA_THUMB32:
+		case ISA_THUMBEE:
+		default:
+			{
+				uint32_t swi_number;
+				switch(arm_get_current_instruction_set(cpu))
+				{
+				case ISA_THUMB32:
+				case ISA_THUMBEE:
+					swi_number = arm_fetch16(cpu, cpu->r[PC] - 2) & 0x00FF;
+					if(swi_number != 0 && swi_number != 1)
+					{
+						// only EABI allowed
+						fprintf(env->message_file, "%s #0x%04X\n", env->syntax == SYNTAX_DIVIDED ? "SWI" : "SVC", swi_number);
+						exit_emulation(env, 0);
+					}
+					break;
+				default:
+					swi_number = arm_fetch32(cpu, cpu->r[PC] - 4) & 0x00FFFFFF;
+					break;
+				}
+
+				if(swi_number == 1 && arm_get_current_instruction_set(cpu) != ISA_THUMBEE)
+				{
+					// extension: switch modes between 26/32/64-bit modes
+					uint32_t lr = cpu->r[PC];
+					uint32_t pc = cpu->r[A32_LR];
+					regnum_t lrnum = A32_LR;
+					if(arm_get_current_instruction_set(cpu) == ISA_AARCH26)
+					{
+						// 00: A32, 01/11: T32, 10: A64
+
+						lr &= ~3;
+
+						if((pc & 1))
+						{
+							arm_set_isa(cpu, ISA_THUMB32);
+							pc &= ~1;
+						}
+						else if((pc & 2))
+						{
+							arm_set_isa(cpu, ISA_AARCH64);
+							pc &= ~3;
+							lrnum = A64_LR;
+						}
+						else
+						{
+							arm_set_isa(cpu, ISA_AARCH32);
+							pc &= ~3;
+						}
+					}
+					else
+					{
+						// 00/01: A26, 10/11: A64
+
+						if(arm_get_current_instruction_set(cpu) == ISA_AARCH32)
+							lr &= ~3;
+						else
+							lr |= 1;
+
+						if((pc & 2))
+						{
+							arm_set_isa(cpu, ISA_AARCH64);
+							lrnum = A64_LR;
+						}
+						else
+						{
+							arm_set_isa(cpu, ISA_AARCH26);
+						}
+
+						pc = cpu->r[A32_LR] & ~3;
+					}
+					cpu->r[PC] = pc;
+					cpu->r[lrnum] = lr;
+				}
+				else if(swi_number == 0)
+				{
+					// EABI
+					if(!a32_linux_eabi_syscall(cpu, env))
+					{
+						fprintf(env->message_file, "%s #0x%06X\n", env->syntax == SYNTAX_DIVIDED ? "SWI" : "SVC", swi_number);
+						fprintf(env->message_file, "Unknown EABI system call: %d\n", (uint32_t)cpu->r[7]);
+						exit_emulation(env, 0);
+					}
+				}
+				else
+				{
+					// OABI
+					if(!a32_linux_oabi_syscall(cpu, env, swi_number))
+					{
+						fprintf(env->message_file, "%s #0x%06X\n", env->syntax == SYNTAX_DIVIDED ? "SWI" : "SVC", swi_number);
+						if(swi_number >= A32_OABI_SYS_BASE)
+							fprintf(env->message_file, "Unknown OABI system call: %d\n", swi_number - A32_OABI_SYS_BASE);
+						exit_emulation(env, 0);
+					}
+				}
+			}
+			break;
+		case ISA_AARCH64:
 			{
-				// only FPA support
-				cfg->features &= ~(1 << FEATURE_VFP);
-				cfg->features |= (1 << FEATURE_FPA);
+				uint16_t swi_number = (arm_fetch32(cpu, cpu->r[PC] - 4) >> 5) & 0xFFFF;
+
+				if(swi_number == 1)
+				{
+					// extension: switch modes between 26/32/64-bit modes
+					// 00: A32, 01/11: T32, 10: A26
+					uint32_t lr = cpu->r[PC];
+					uint32_t pc = cpu->r[A64_LR];
+
+					lr &= ~3;
+
+					if((pc & 1))
+					{
+						arm_set_isa(cpu, ISA_THUMB32);
+						pc &= ~1;
+					}
+					else if((pc & 2))
+					{
+						arm_set_isa(cpu, ISA_AARCH26);
+						pc &= ~3;
+					}
+					else
+					{
+						arm_set_isa(cpu, ISA_AARCH32);
+						pc &= ~3;
+					}
+
+					cpu->r[PC] = pc;
+					cpu->r[A32_LR] = lr;
+				}
+				else if(swi_number != 0)
+				{
+					fprintf(env->message_file, "SVC #0x%04X\n", swi_number);
+					exit_emulation(env, 0);
+				}
+				else if(!a64_linux_syscall(cpu, env))
+				{
+					fprintf(env->message_file, "SVC #0\n");
+					fprintf(env->message_file, "Unknown 64-bit system call: %"PRId64"\n", cpu->r[8]);
+					exit_emulation(env, 0);
+				}
 			}
 			break;
-		case ARMV5:
-		case ARMV6:
-			if(need_simd)
+		}
+		break;
+	case ARM_EMU_UNDEFINED:
+		switch(arm_get_current_instruction_set(cpu))
+		{
+		case ISA_JAZELLE:
+			// this should never happen, Jazelle undefined instructions go through a handler table
+			assert(false);
+		case ISA_THUMB32:
+		case ISA_THUMBEE:
 			{
-				fprintf(stderr, "No SIMD support for selected architecture\n");
-				cfg->features &= ~(1 << FEATURE_SIMD);
+				uint16_t opcode = arm_fetch16(cpu, cpu->r[PC] - 2);
+				fprintf(env->message_file, "UNDEFINED 0x%04X\n", opcode);
 			}
-			if(need_fp)
+			break;
+		case ISA_AARCH26:
+		case ISA_AARCH32:
+		case ISA_AARCH64:
 			{
-				cfg->fp_version = ARM_VFPV2;
+				uint32_t opcode = arm_fetch32(cpu, cpu->r[PC] - 4);
+				fprintf(env->message_file, "UNDEFINED 0x%08X\n", opcode);
 			}
 			break;
-		case ARMV7:
-			// TODO: M-profile has MVE, not AdvSIMD
-			if((cfg->features & FEATURE_PROFILE_MASK) == ARM_PROFILE_M)
-				cfg->fp_version = ARM_VFPV5;
-			else if(!(cfg->features & (1 << FEATURE_VIRTUALIZATION)))
-				cfg->fp_version = ARM_VFPV3;
-			else
-				cfg->fp_version = ARM_VFPV4;
-			break;
-		case ARMV8:
-		case ARMV81:
-		case ARMV82:
-		case ARMV83:
-		case ARMV9:
-			cfg->fp_version = ARM_V8FP;
-			break;
 		}
+		exit_emulation(env, 0);
+	case ARM_EMU_PREFETCH_ABORT:
+		fprintf(env->message_file, "PREFETCH ABORT\n");
+		exit_emulation(env, 0);
+	case ARM_EMU_DATA_ABORT:
+		fprintf(env->message_file, "DATA ABORT\n");
+		exit_emulation(env, 0);
+	case ARM_EMU_ADDRESS26:
+		fprintf(env->message_file, "ADDRESS (in 26-bit mode)\n");
+		exit_emulation(env, 0);
+	case ARM_EMU_IRQ:
+		fprintf(env->message_file, "IRQ\n");
+		exit_emulation(env, 0);
+	case ARM_EMU_FIQ:
+		fprintf(env->message_file, "FIQ\n");
+		exit_emulation(env, 0);
+	case ARM_EMU_BREAKPOINT:
+		fprintf(env->message_file, "BREAKPOINT\n");
+		exit_emulation(env, 0);
+	case ARM_EMU_UNALIGNED:
+		fprintf(env->message_file, "UNALIGNED\n");
+		exit_emulation(env, 0);
+	case ARM_EMU_UNALIGNED_PC:
+		fprintf(env->message_file, "UNALIGNED PC\n");
+		exit_emulation(env, 0);
+	case ARM_EMU_UNALIGNED_SP:
+		fprintf(env->message_file, "UNALIGNED SP\n");
+		exit_emulation(env, 0);
+	case ARM_EMU_SERROR:
+		fprintf(env->message_file, "SERROR\n");
+		exit_emulation(env, 0);
+	case ARM_EMU_SMC:
+		fprintf(env->message_file, "SMC\n");
+		exit_emulation(env, 0);
+	case ARM_EMU_HVC:
+		fprintf(env->message_file, "HVC\n");
+		exit_emulation(env, 0);
+	case ARM_EMU_SOFTWARE_STEP:
+		fprintf(env->message_file, "SOFTWARE STEP\n");
+		exit_emulation(env, 0);
+
+	case ARM_EMU_JAZELLE_UNDEFINED:
+		if(!j32_simulate_instruction(cpu, env))
+		{
+			uint8_t opcode = arm_fetch8(cpu, cpu->r[PC] - 1);
+			fprintf(env->message_file, "UNDEFINED (Jazelle) %02X\n", opcode);
+			exit_emulation(env, 0);
+		}
+		break;
+	case ARM_EMU_JAZELLE_NULLPTR:
+		fprintf(env->message_file, "NULL POINTER (Jazelle)\n");
+		exit_emulation(env, 0);
+	case ARM_EMU_JAZELLE_OUT_OF_BOUNDS:
+		fprintf(env->message_file, "OUT OF BOUNDS (Jazelle)\n");
+		exit_emulation(env, 0);
+	case ARM_EMU_JAZELLE_DISABLED:
+		fprintf(env->message_file, "JAZELLE DISABLED\n");
+		exit_emulation(env, 0);
+	case ARM_EMU_JAZELLE_INVALID:
+		fprintf(env->message_file, "JAZELLE INVALID\n");
+		exit_emulation(env, 0);
+	case ARM_EMU_JAZELLE_PREFETCH_ABORT:
+		fprintf(env->message_file, "PREFETCH ABORT (Jazelle)\n");
+		exit_emulation(env, 0);
+
+	case ARM_EMU_THUMBEE_OUT_OF_BOUNDS:
+		fprintf(env->message_file, "OUT OF BOUNDS (ThumbEE)\n");
+		exit_emulation(env, 0);
+	case ARM_EMU_THUMBEE_NULLPTR:
+		fprintf(env->message_file, "NULL POINTER (ThumbEE)\n");
+		exit_emulation(env, 0);
 	}
 }
 
-void isa_display(arm_configuration_t config, arm_instruction_set_t isa, arm_syntax_t syntax, bool disasm, arm_endianness_t endian)
+/* Multiprocessor support
+ * Every CPU runs on its own host thread, secondary processors and guest threads are copies of the CPU that started them
+ * An exit from any of them terminates the entire emulator, unless the emulated system call only ends the thread
+ */
+
+typedef struct cpu_thread_t
 {
-	printf("Instruction set: ");
-	switch(isa)
+	arm_state_t * cpu;
+	environment_t * env;
+	void (* init)(arm_state_t * cpu, void * data);
+	void * data;
+} cpu_thread_t;
+
+static void * run_cpu_thread(void * data)
+{
+	cpu_thread_t thread = *(cpu_thread_t *)data;
+	free(data);
+	if(thread.init != NULL)
+		thread.init(thread.cpu, thread.data);
+	for(;;)
 	{
-	default:
-		printf("%s", arm_instruction_set_names[isa]);
-		break;
-	case ISA_THUMB32:
-		if(!(config.features & (1 << FEATURE_THUMB2)))
-			printf("Thumb");
-		else
-			printf("Thumb-2");
-		break;
+		handle_result(thread.cpu, thread.env, arm_run(thread.cpu, UINT64_MAX, NULL));
 	}
-	if(isa != ISA_JAZELLE)
-	{
-		printf(", version: %s", arm_version_names[config.version]);
-		if((config.features & (1 << FEATURE_FPA)) != 0)
-			printf(", FPA");
-		else if((config.features & (1 << FEATURE_VFP)) != 0)
-			printf(", %s", arm_fp_version_names[config.fp_version]);
+	return NULL;
+}
 
-		if((config.features & (1 << FEATURE_SIMD)) != 0)
-			printf(", Advanced SIMD (Neon)");
-		else if((config.features & (1 << FEATURE_MVE)) != 0)
-			printf(", MVE (Helium)");
+void setup_multiprocessor(arm_state_t * cpu, environment_t * env)
+{
+	if(cpu->global_monitor != NULL)
+		return;
 
-		if(disasm && (isa == ISA_AARCH32 || isa == ISA_THUMB32 || isa == ISA_THUMBEE))
-		{
-			printf(", syntax: ");
-			switch(syntax)
-			{
-			case SYNTAX_UNKNOWN:
-				assert(false);
-			case SYNTAX_DIVIDED:
-				printf("divided (pre-UAL)");
-				break;
-			case SYNTAX_UNIFIED:
-				printf("unified (UAL)");
-				break;
-			}
-		}
+	arm_global_monitor_t * monitor = malloc(sizeof(arm_global_monitor_t));
+	arm_global_monitor_init(monitor);
+	memory_set_shared(env->memory);
+	arm_global_monitor_attach(monitor, cpu);
+}
 
-		switch(endian)
+bool start_cpu_thread(arm_state_t * cpu, environment_t * env, void (* init)(arm_state_t * cpu, void * data), void * data)
+{
+	cpu_thread_t * thread = malloc(sizeof(cpu_thread_t));
+	thread->cpu = cpu;
+	thread->env = env;
+	thread->init = init;
+	thread->data = data;
+
+	pthread_t handle;
+	if(pthread_create(&handle, NULL, run_cpu_thread, thread) != 0)
+	{
+		free(thread);
+		return false;
+	}
+	pthread_detach(handle);
+	return true;
+}
+
+static void start_secondary_cpus(arm_state_t * cpu, environment_t * env, unsigned cpu_count)
+{
+	setup_multiprocessor(cpu, env);
+
+	for(unsigned cpu_number = 1; cpu_number < cpu_count; cpu_number++)
+	{
+		arm_state_t * secondary = malloc(sizeof(arm_state_t));
+		arm_emu_clone(secondary, cpu);
+		secondary->processor_id = cpu_number;
+		if(!start_cpu_thread(secondary, env, NULL, NULL))
 		{
-		case ARM_ENDIAN_LITTLE:
-			printf(", little endian (LE)");
-			break;
-		case ARM_ENDIAN_BIG:
-			printf(", big endian, byte invariant (BE-8)");
-			break;
-		case ARM_ENDIAN_SWAPPED:
-			printf(", big endian, word invariant (BE-32)");
-			break;
+			fprintf(stderr, "Fatal error: unable to start processor %u, leaving\n", cpu_number);
+			exit(1);
 		}
 	}
-	printf("\n");
 }
 
 int main(int argc, char * argv[], char * envp[])
@@ -757,12 +2117,14 @@ int main(int argc, char * argv[], char * envp[])
 	memset(env, 0, sizeof(environment_t));
 	env->config.jazelle_implementation = ARM_JAVA_DEFAULT; // TODO
 
-	env->memory_interface = &_memory_interface;
-
 	env->isa = ISA_UNKNOWN;
 	env->syntax = SYNTAX_UNKNOWN;
 	env->endian = ARM_ENDIAN_DEFAULT;
 	env->thumb2 = THUMB2_PERMITTED;
+	env->std_fds[0] = STDIN_FILENO;
+	env->std_fds[1] = STDOUT_FILENO;
+	env->std_fds[2] = STDERR_FILENO;
+	env->message_file = stdout;
 
 	arm_part_number_t part_number = 0;
 
@@ -771,6 +2133,13 @@ int main(int argc, char * argv[], char * envp[])
 	env->entry = 0;
 	bool run = false;
 	bool disasm = false;
+	bool jit = false;
+	uint16_t jit_threshold = ARM_JIT_THRESHOLD;
+	unsigned cpu_count = 1;
+	const char * batch_manifest = NULL;
+	unsigned job_thread_count = 0;
+	uint64_t job_instruction_limit = 0;
+	unsigned job_repeat_count = 1;
 	int argi = 1;
 	enum
 	{
@@ -799,6 +2168,61 @@ int main(int argc, char * argv[], char * envp[])
 			{
 				start_offset = strtoll(&argv[argi][3], NULL, 0);
 			}
+			else if(strcasecmp(argv[argi], "-jit") == 0)
+			{
+				jit = true;
+			}
+			else if(strncasecmp(argv[argi], "-jit=", 5) == 0)
+			{
+				jit = true;
+				long threshold = strtol(&argv[argi][5], NULL, 0);
+				if(threshold < 0 || threshold > UINT16_MAX)
+				{
+					fprintf(stderr, "JIT threshold must be between 1 and 65535\n");
+					exit(1);
+				}
+				jit_threshold = threshold == 0 ? 1 : threshold;
+			}
+			else if(strcasecmp(argv[argi], "-stats") == 0)
+			{
+				env->report_statistics = true;
+			}
+			else if(strcasecmp(argv[argi], "-showregs") == 0)
+			{
+				env->report_registers = true;
+			}
+			else if(strncasecmp(argv[argi], "-smp=", 5) == 0)
+			{
+				cpu_count = strtol(&argv[argi][5], NULL, 0);
+				if(cpu_count < 1 || cpu_count > 256)
+				{
+					fprintf(stderr, "Number of processors must be between 1 and 256\n");
+					exit(1);
+				}
+			}
+			else if(strncasecmp(argv[argi], "-batch=", 7) == 0)
+			{
+				batch_manifest = &argv[argi][7];
+			}
+			else if(strncasecmp(argv[argi], "-jobs=", 6) == 0)
+			{
+				job_thread_count = strtol(&argv[argi][6], NULL, 0);
+				if(job_thread_count < 1 || job_thread_count > 1024)
+				{
+					fprintf(stderr, "Number of jobs must be between 1 and 1024\n");
+					exit(1);
+				}
+			}
+			else if(strncasecmp(argv[argi], "-limit=", 7) == 0)
+			{
+				job_instruction_limit = strtoull(&argv[argi][7], NULL, 0);
+			}
+			else if(strncasecmp(argv[argi], "-times=", 7) == 0)
+			{
+				job_repeat_count = strtol(&argv[argi][7], NULL, 0);
+				if(job_repeat_count == 0)
+					job_repeat_count = 1;
+			}
 			else if(strcasecmp(argv[argi], "-u") == 0)
 			{
 				run_mode = RUN_MODE_MINIMAL;
@@ -937,6 +2361,16 @@ int main(int argc, char * argv[], char * envp[])
 
 	env->supported_isas |= 1 << env->isa;
 
+	if(batch_manifest != NULL)
+	{
+		if(job_thread_count == 0)
+		{
+			long processor_count = sysconf(_SC_NPROCESSORS_ONLN);
+			job_thread_count = processor_count < 1 ? 1 : processor_count > 1024 ? 1024 : processor_count;
+		}
+		return run_batch(batch_manifest, job_thread_count, env, part_number, jit, job_instruction_limit, job_repeat_count, envp);
+	}
+
 	env->stack = 0;
 	// Java specific
 	env->cp_start = 0;
@@ -968,7 +2402,10 @@ int main(int argc, char * argv[], char * envp[])
 		}
 
 		if(run)
-			memory_init();
+		{
+			env->memory = memory_init();
+			env->memory_interface = memory_get_interface(env->memory);
+		}
 
 		env->purpose = run ? PURPOSE_LOAD : PURPOSE_PARSE;
 
@@ -987,7 +2424,10 @@ int main(int argc, char * argv[], char * envp[])
 		}
 
 		if(run)
-			memory_init();
+		{
+			env->memory = memory_init();
+			env->memory_interface = memory_get_interface(env->memory);
+		}
 
 		env->purpose = run ? PURPOSE_LOAD : PURPOSE_PARSE;
 
@@ -1004,7 +2444,10 @@ int main(int argc, char * argv[], char * envp[])
 		}
 
 		if(run)
-			memory_init();
+		{
+			env->memory = memory_init();
+			env->memory_interface = memory_get_interface(env->memory);
+		}
 
 		if(load_address == (uint64_t)-1)
 			load_address = 0x8000; // imitate a RISC OS Absolute (&FF8) binary
@@ -1042,14 +2485,7 @@ int main(int argc, char * argv[], char * envp[])
 
 		if(run)
 		{
-			for(uint64_t offset = 0; ; offset++)
-			{
-				int c = fgetc(input_file);
-				if(c == -1)
-					break;
-				uint64_t address = load_address + offset;
-				arm_memory_write8(env->memory_interface, address, c, env->endian == ARM_ENDIAN_SWAPPED ? ARM_ENDIAN_SWAPPED : ARM_ENDIAN_LITTLE);
-			}
+			memory_load_file(env->memory, input_file, load_address, UINT64_MAX, env->endian == ARM_ENDIAN_SWAPPED);
 		}
 		else
 		{
@@ -1061,58 +2497,20 @@ int main(int argc, char * argv[], char * envp[])
 
 	fclose(input_file);
 
+	if(run && cpu_count > 1 && run_mode != RUN_MODE_BARE_CPU)
+	{
+		// every processor would run the program from its entry point, including its system calls, guest threads use clone instead
+		fprintf(stderr, "Fatal error: multiple processors are only supported for raw binaries without system call emulation, leaving\n");
+		exit(1);
+	}
+
 	if(run)
 	{
 		arm_state_t cpu[1];
-		arm_emu_init(cpu, env->config, env->supported_isas, &_memory_interface);
-		arm_set_isa(cpu, env->isa);
-		cpu->part_number = part_number;
-		cpu->vendor = ARM_VENDOR_ARM;
+		setup_cpu(cpu, env, part_number, run_mode != RUN_MODE_BARE_CPU);
 
 		isa_display(cpu->config, arm_get_current_instruction_set(cpu), env->syntax, disasm, env->endian);
 
-		switch(env->endian)
-		{
-		case ARM_ENDIAN_LITTLE:
-			break;
-		case ARM_ENDIAN_BIG:
-			// v6+
-			cpu->pstate.e = 1;
-			break;
-		case ARM_ENDIAN_SWAPPED:
-			// until v7
-			cpu->sctlr_el1 |= SCTLR_B;
-			break;
-		}
-
-		if(run_mode != RUN_MODE_BARE_CPU)
-		{
-			// array layout:
-			/*
-			struct
-			{
-				uint32_t size_in_dwords;
-			actual start of array:
-				uint32_t elements[1];
-			};
-			*/
-			cpu->joscr = JOSCR_FLAT_ARRAY;
-			cpu->jaolr = JAOLR_LENGTH_SUB | (4 << JAOLR_LENGTH_OFF_SHIFT) | (0 << JAOLR_ELEMENT_OFF_SHIFT) | (2 << JAOLR_LENSHIFT_SHIFT);
-		}
-		else
-		{
-			// array layout:
-			/*
-			struct
-			{
-				uint32_t size_in_dwords;
-				uint64_t * elements;
-			};
-			*/
-			cpu->joscr = 0;
-			cpu->jaolr = (0 << JAOLR_LENGTH_OFF_SHIFT) | (9 << JAOLR_ELEMENT_OFF_SHIFT) | (3 << JAOLR_LENSHIFT_SHIFT);
-		}
-
 		switch(run_mode)
 		{
 		case RUN_MODE_BARE_CPU:
@@ -1146,10 +2544,36 @@ int main(int argc, char * argv[], char * envp[])
 
 		cpu->capture_breaks = run_mode != RUN_MODE_BARE_CPU;
 
+		env->report_cpu = cpu;
+
+		if(jit)
+		{
+			if(arm_jit_enable(cpu))
+				cpu->jit.threshold = jit_threshold;
+			else
+				fprintf(stderr, "Warning: native code generation is not supported, falling back to the interpreter\n");
+		}
+
+		if(cpu_count > 1)
+		{
+			if(disasm)
+			{
+				fprintf(stderr, "Warning: debug mode only runs the first processor\n");
+			}
+			else
+			{
+				start_secondary_cpus(cpu, env, cpu_count);
+			}
+		}
+
 		arm_debug_state_t debug_state[1];
 		arm_get_debug_state(debug_state, cpu);
-		memory_changed_lowest = -1;
-		memory_changed_highest = 0;
+		if(disasm)
+		{
+			memory_dirty_subscribe(env->memory);
+			arm_memory_map_flush(cpu);
+		}
+		memory_dirty_clear(env->memory);
 
 		uint64_t loop_address = 0;
 		for(;;)
@@ -1158,14 +2582,10 @@ int main(int argc, char * argv[], char * envp[])
 			{
 				loop_address = 0;
 
-				debug_state->memory_changed_lowest = memory_changed_lowest;
-				debug_state->memory_changed_highest = memory_changed_highest;
+				memory_take_changed_range(env->memory, &debug_state->memory_changed_lowest, &debug_state->memory_changed_highest);
 
 				debug(stdout, cpu, debug_state);
 
-				memory_changed_lowest = -1;
-				memory_changed_highest = 0;
-
 				uint64_t current_pc = cpu->r[PC];
 
 				parse(dis);
@@ -1190,265 +2610,8 @@ int main(int argc, char * argv[], char * envp[])
 					break;
 				}
 			}
-			step(cpu);
-			switch(cpu->result)
-			{
-			case ARM_EMU_OK:
-				break;
-			case ARM_EMU_RESET:
-				printf("RESET\n");
-				exit(0);
-			case ARM_EMU_SVC:
-				switch(arm_get_current_instruction_set(cpu))
-				{
-				case ISA_JAZELLE:
-					if(!j32_linux_syscall(cpu, -1))
-					{
-						printf("%s\n", env->syntax == SYNTAX_DIVIDED ? "SWI" : "SVC");
-						printf("Unknown Jazelle system call: %d\n", j32_peek_word(cpu, 0));
-						exit(0);
-					}
-					break;
-				case ISA_AARCH32:
-				case ISA_THUMB32:
-				case ISA_THUMBEE:
-				default:
-					{
-						uint32_t swi_number;
-						switch(arm_get_current_instruction_set(cpu))
-						{
-						case ISA_THUMB32:
-						case ISA_THUMBEE:
-							swi_number = arm_fetch16(cpu, cpu->r[PC] - 2) & 0x00FF;
-							if(swi_number != 0 && swi_number != 1)
-							{
-								// only EABI allowed
-								printf("%s #0x%04X\n", env->syntax == SYNTAX_DIVIDED ? "SWI" : "SVC", swi_number);
-								exit(0);
-							}
-							break;
-						default:
-							swi_number = arm_fetch32(cpu, cpu->r[PC] - 4) & 0x00FFFFFF;
-							break;
-						}
-
-						if(swi_number == 1 && arm_get_current_instruction_set(cpu) != ISA_THUMBEE)
-						{
-							// extension: switch modes between 26/32/64-bit modes
-							uint32_t lr = cpu->r[PC];
-							uint32_t pc = cpu->r[A32_LR];
-							regnum_t lrnum = A32_LR;
-							if(arm_get_current_instruction_set(cpu) == ISA_AARCH26)
-							{
-								// 00: A32, 01/11: T32, 10: A64
-
-								lr &= ~3;
-
-								if((pc & 1))
-								{
-									arm_set_isa(cpu, ISA_THUMB32);
-									pc &= ~1;
-								}
-								else if((pc & 2))
-								{
-									arm_set_isa(cpu, ISA_AARCH64);
-									pc &= ~3;
-									lrnum = A64_LR;
-								}
-								else
-								{
-									arm_set_isa(cpu, ISA_AARCH32);
-									pc &= ~3;
-								}
-							}
-							else
-							{
-								// 00/01: A26, 10/11: A64
-
-								if(arm_get_current_instruction_set(cpu) == ISA_AARCH32)
-									lr &= ~3;
-								else
-									lr |= 1;
-
-								if((pc & 2))
-								{
-									arm_set_isa(cpu, ISA_AARCH64);
-									lrnum = A64_LR;
-								}
-								else
-								{
-									arm_set_isa(cpu, ISA_AARCH26);
-								}
-
-								pc = cpu->r[A32_LR] & ~3;
-							}
-							cpu->r[PC] = pc;
-							cpu->r[lrnum] = lr;
-						}
-						else if(swi_number == 0)
-						{
-							// EABI
-							if(!a32_linux_eabi_syscall(cpu))
-							{
-								printf("%s #0x%06X\n", env->syntax == SYNTAX_DIVIDED ? "SWI" : "SVC", swi_number);
-								printf("Unknown EABI system call: %d\n", (uint32_t)cpu->r[7]);
-								exit(0);
-							}
-						}
-						else
-						{
-							// OABI
-							if(!a32_linux_oabi_syscall(cpu, swi_number))
-							{
-								printf("%s #0x%06X\n", env->syntax == SYNTAX_DIVIDED ? "SWI" : "SVC", swi_number);
-								if(swi_number >= A32_OABI_SYS_BASE)
-									printf("Unknown OABI system call: %d\n", swi_number - A32_OABI_SYS_BASE);
-								exit(0);
-							}
-						}
-					}
-					break;
-				case ISA_AARCH64:
-					{
-						uint16_t swi_number = (arm_fetch32(cpu, cpu->r[PC] - 4) >> 5) & 0xFFFF;
-
-						if(swi_number == 1)
-						{
-							// extension: switch modes between 26/32/64-bit modes
-							// 00: A32, 01/11: T32, 10: A26
-							uint32_t lr = cpu->r[PC];
-							uint32_t pc = cpu->r[A64_LR];
-
-							lr &= ~3;
-
-							if((pc & 1))
-							{
-								arm_set_isa(cpu, ISA_THUMB32);
-								pc &= ~1;
-							}
-							else if((pc & 2))
-							{
-								arm_set_isa(cpu, ISA_AARCH26);
-								pc &= ~3;
-							}
-							else
-							{
-								arm_set_isa(cpu, ISA_AARCH32);
-								pc &= ~3;
-							}
-
-							cpu->r[PC] = pc;
-							cpu->r[A32_LR] = lr;
-						}
-						else if(swi_number != 0)
-						{
-							printf("SVC #0x%04X\n", swi_number);
-							exit(0);
-						}
-						else if(!a64_linux_syscall(cpu))
-						{
-							printf("SVC #0\n");
-							printf("Unknown 64-bit system call: %"PRId64"\n", cpu->r[8]);
-							exit(0);
-						}
-					}
-					break;
-				}
-				break;
-			case ARM_EMU_UNDEFINED:
-				switch(arm_get_current_instruction_set(cpu))
-				{
-				case ISA_JAZELLE:
-					// this should never happen, Jazelle undefined instructions go through a handler table
-					assert(false);
-				case ISA_THUMB32:
-				case ISA_THUMBEE:
-					{
-						uint16_t opcode = arm_fetch16(cpu, cpu->r[PC] - 2);
-						printf("UNDEFINED 0x%04X\n", opcode);
-					}
-					break;
-				case ISA_AARCH26:
-				case ISA_AARCH32:
-				case ISA_AARCH64:
-					{
-						uint32_t opcode = arm_fetch32(cpu, cpu->r[PC] - 4);
-						printf("UNDEFINED 0x%08X\n", opcode);
-					}
-					break;
-				}
-				exit(0);
-			case ARM_EMU_PREFETCH_ABORT:
-				printf("PREFETCH ABORT\n");
-				exit(0);
-			case ARM_EMU_DATA_ABORT:
-				printf("DATA ABORT\n");
-				exit(0);
-			case ARM_EMU_ADDRESS26:
-				printf("ADDRESS (in 26-bit mode)\n");
-				exit(0);
-			case ARM_EMU_IRQ:
-				printf("IRQ\n");
-				exit(0);
-			case ARM_EMU_FIQ:
-				printf("FIQ\n");
-				exit(0);
-			case ARM_EMU_BREAKPOINT:
-				printf("BREAKPOINT\n");
-				exit(0);
-			case ARM_EMU_UNALIGNED:
-				printf("UNALIGNED\n");
-				exit(0);
-			case ARM_EMU_UNALIGNED_PC:
-				printf("UNALIGNED PC\n");
-				exit(0);
-			case ARM_EMU_UNALIGNED_SP:
-				printf("UNALIGNED SP\n");
-				exit(0);
-			case ARM_EMU_SERROR:
-				printf("SERROR\n");
-				exit(0);
-			case ARM_EMU_SMC:
-				printf("SMC\n");
-				exit(0);
-			case ARM_EMU_HVC:
-				printf("HVC\n");
-				exit(0);
-			case ARM_EMU_SOFTWARE_STEP:
-				printf("SOFTWARE STEP\n");
-				exit(0);
-
-			case ARM_EMU_JAZELLE_UNDEFINED:
-				if(!j32_simulate_instruction(cpu, env->heap_start))
-				{
-					uint8_t opcode = arm_fetch8(cpu, cpu->r[PC] - 1);
-					printf("UNDEFINED (Jazelle) %02X\n", opcode);
-					exit(0);
-				}
-				break;
-			case ARM_EMU_JAZELLE_NULLPTR:
-				printf("NULL POINTER (Jazelle)\n");
-				exit(0);
-			case ARM_EMU_JAZELLE_OUT_OF_BOUNDS:
-				printf("OUT OF BOUNDS (Jazelle)\n");
-				exit(0);
-			case ARM_EMU_JAZELLE_DISABLED:
-				printf("JAZELLE DISABLED\n");
-				exit(0);
-			case ARM_EMU_JAZELLE_INVALID:
-				printf("JAZELLE INVALID\n");
-				exit(0);
-			case ARM_EMU_JAZELLE_PREFETCH_ABORT:
-				printf("PREFETCH ABORT (Jazelle)\n");
-				exit(0);
-
-			case ARM_EMU_THUMBEE_OUT_OF_BOUNDS:
-				printf("OUT OF BOUNDS (ThumbEE)\n");
-				exit(0);
-			case ARM_EMU_THUMBEE_NULLPTR:
-				printf("NULL POINTER (ThumbEE)\n");
-				exit(0);
-			}
+			// the debugger needs to stop after every instruction
+			handle_result(cpu, env, arm_run(cpu, disasm ? 1 : UINT64_MAX, NULL));
 		}
 	}
 	return 0;
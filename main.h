@@ -3,9 +3,12 @@
 
 /* Common functionality required for the emulator/disassembler */
 
+#include <setjmp.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/uio.h>
 #include "arm.h"
+#include "emu.h"
 
 typedef enum read_purpose_t
 {
@@ -20,10 +23,15 @@ typedef enum thumb2_support_t
 	THUMB2_EXPECTED = 1,
 } thumb2_support_t;
 
+// guest memory of a single emulator instance
+typedef struct memory_t memory_t;
+
 typedef struct environment_t
 {
 	// input parameters
 	read_purpose_t purpose;
+	// only set if purpose is PURPOSE_LOAD
+	memory_t * memory;
 	const memory_interface_t * memory_interface;
 	thumb2_support_t thumb2;
 
@@ -38,29 +46,115 @@ typedef struct environment_t
 	uint64_t entry;
 	uint64_t stack;
 
+	// output parameters (ELF only)
+	uint8_t elf_class;
+	uint8_t elf_data;
+
 	// output parameters (Jazelle only)
 	uint32_t cp_start;
 	uint32_t loc_count;
 	uint32_t clinit_entry;
 	uint32_t clinit_loc_count;
 	uint32_t heap_start;
+	struct jvm_constant_t * constant_pool;
+	uint16_t constant_pool_count;
+
+	// runtime state of the emulated Linux process
+	unsigned thread_count; // number of running threads besides the last one to exit, the process ends when that one exits
+	int std_fds[3]; // host file descriptors standing in for the standard input, output and error of the program
+	FILE * message_file; // where the emulator reports why the program stopped, usually stdout
+
+	// if set, the end of the program returns here with exit_status set instead of terminating the emulator
+	jmp_buf * exit_point;
+	int exit_status;
+
+	// the first processor, reported on to stderr when the emulation ends as requested by -stats and -showregs
+	arm_state_t * report_cpu;
+	bool report_statistics;
+	bool report_registers;
 } environment_t;
 
 #define ARM_ENDIAN_DEFAULT ((arm_endianness_t)-1)
 #define ARM_ENDIAN_BE_VERSION_SPECIFIC ((arm_endianness_t)-2)
 
-extern uint16_t fread16(FILE * file);
-extern uint32_t fread32(FILE * file);
-extern uint64_t fread64(FILE * file);
-extern uint64_t freadword(FILE * file);
+// read from an ELF file according to the class and byte order in env
+extern uint16_t fread16(const environment_t * env, FILE * file);
+extern uint32_t fread32(const environment_t * env, FILE * file);
+extern uint64_t fread64(const environment_t * env, FILE * file);
+extern uint64_t freadword(const environment_t * env, FILE * file);
+
+// software TLB of the paged memory, with separate entries for each kind of access
+enum
+{
+	TLB_READ,
+	TLB_WRITE,
+	TLB_FETCH,
+	TLB_COUNT,
+};
+
+extern memory_t * memory_init(void);
+extern void memory_free(memory_t * memory);
+// must be called before the memory is accessed from more than one thread
+extern void memory_set_shared(memory_t * memory);
+// the interface to pass to arm_emu_init, its data field points to the memory
+extern const memory_interface_t * memory_get_interface(memory_t * memory);
+
+// must be called when a page is unmapped or moved
+extern void memory_tlb_flush(memory_t * memory);
+extern void memory_get_tlb_statistics(memory_t * memory, uint64_t hits[TLB_COUNT], uint64_t misses[TLB_COUNT]);
+// number of bytes used to keep track of the guest memory, excluding the contents
+extern size_t memory_get_overhead(memory_t * memory);
+
+// dirty page tracking, writes are only recorded while there is at least one subscriber
+#define MEMORY_DIRTY_PAGE_SIZE 0x1000
+// the host pointer caches of all CPUs must be flushed (arm_memory_map_flush) after subscribing, so that writes cannot bypass the tracking
+extern void memory_dirty_subscribe(memory_t * memory);
+extern void memory_dirty_unsubscribe(memory_t * memory);
+// whether the page containing the address was written since the last memory_dirty_clear
+extern bool memory_dirty_test(memory_t * memory, uint64_t address);
+// calls the callback for the address of every dirty page
+extern void memory_dirty_for_each(memory_t * memory, void (* callback)(uint64_t address, void * data), void * data);
+extern void memory_dirty_clear(memory_t * memory);
+// returns the range of changed bytes since the last call or memory_dirty_clear (lowest > highest if none) and starts a new one
+extern void memory_take_changed_range(memory_t * memory, uint64_t * lowest, uint64_t * highest);
+
+extern void * memory_acquire_block(memory_t * memory, uint64_t address, size_t size);
+extern void memory_synchronize_block(memory_t * memory, uint64_t address, size_t size, void * buffer);
+extern void memory_release_block(memory_t * memory, uint64_t address, size_t size, void * buffer);
+
+// fills iov with the host memory fragments covering the block, write must be set if the memory will be modified
+// returns the number of fragments, or 0 if the block cannot be accessed in place (memory_acquire_block must be used instead)
+extern int memory_acquire_iovec(memory_t * memory, uint64_t address, size_t size, bool write, struct iovec * iov, int max);
+// must be called after the fragments have been modified
+extern void memory_synchronize_iovec(memory_t * memory, uint64_t address, size_t size);
+
+// calls the callback for every block of memory that might hold data that is not all zeros
+extern void memory_for_each_block(memory_t * memory, void (* callback)(uint64_t address, size_t size, void * data), void * data);
+
+extern void * memory_acquire_block_reversed(memory_t * memory, uint64_t address, size_t size);
+extern void memory_synchronize_block_reversed(memory_t * memory, uint64_t address, size_t size, void * buffer);
+extern void memory_release_block_reversed(memory_t * memory, uint64_t address, size_t size, void * buffer);
+
+extern uint64_t memory_load_file(memory_t * memory, FILE * file, uint64_t address, uint64_t count, bool swapped);
+
+// a copy of the CPU state and its guest memory, only the latest snapshot taken of a memory can be restored (any number of times)
+// no snapshot can be taken while other processors share the memory, NULL is returned instead
+typedef struct arm_snapshot_t arm_snapshot_t;
+extern arm_snapshot_t * arm_snapshot_take(arm_state_t * cpu);
+extern void arm_snapshot_restore(arm_snapshot_t * snapshot, arm_state_t * cpu);
+extern void arm_snapshot_free(arm_snapshot_t * snapshot);
 
-extern void * memory_acquire_block(uint64_t address, size_t size);
-extern void memory_synchronize_block(uint64_t address, size_t size, void * buffer);
-extern void memory_release_block(uint64_t address, size_t size, void * buffer);
+// attaches the CPU to a new global monitor and marks the memory as shared, unless it already belongs to a multiprocessor system
+extern void setup_multiprocessor(arm_state_t * cpu, environment_t * env);
+// runs the CPU on a new host thread until the emulation ends, init (if not NULL) is called on that thread before the CPU starts
+extern bool start_cpu_thread(arm_state_t * cpu, environment_t * env, void (* init)(arm_state_t * cpu, void * data), void * data);
 
-extern void * memory_acquire_block_reversed(uint64_t address, size_t size);
-extern void memory_synchronize_block_reversed(uint64_t address, size_t size, void * buffer);
-extern void memory_release_block_reversed(uint64_t address, size_t size, void * buffer);
+// ends the program, either terminating the emulator or returning to env->exit_point
+extern _Noreturn void exit_emulation(environment_t * env, int status);
+// initializes the CPU with the configuration of env, system_calls selects the layout for emulated system calls
+extern void setup_cpu(arm_state_t * cpu, environment_t * env, arm_part_number_t part_number, bool system_calls);
+// handles the reason arm_run stopped, emulating system calls, only returns if the program can continue
+extern void handle_result(arm_state_t * cpu, environment_t * env, arm_emu_result_t result);
 
 extern void init_isa(arm_configuration_t * cfg, arm_instruction_set_t * isa, arm_syntax_t * syntax, thumb2_support_t thumb2, bool force32bit);
 extern void isa_display(arm_configuration_t config, arm_instruction_set_t isa, arm_syntax_t syntax, bool disasm, arm_endianness_t endian);
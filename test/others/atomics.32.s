@@ -0,0 +1,116 @@
+@ Test swap and exclusive instructions, prints ok if every result is as expected
+
+	.text
+	.global	_start
+	.syntax	unified
+
+	.equ	SYS_WRITE, 4
+	.equ	SYS_EXIT_GROUP, 248
+
+	.macro	expect register, value
+	ldr	r12, =\value
+	cmp	\register, r12
+	bne	fail
+	.endm
+
+	.macro	expect_memory address, value
+	ldr	r11, [\address]
+	expect	r11, \value
+	.endm
+
+_start:
+	ldr	r4, =word
+
+	@ swaps return the previous value, the byte form only replaces the addressed byte
+	ldr	r1, =0x89abcdef
+	swp	r0, r1, [r4]
+	expect	r0, 0x01234567
+	expect_memory	r4, 0x89abcdef
+	mov	r1, #0x10
+	swpb	r0, r1, [r4]
+	expect	r0, 0xef
+	expect_memory	r4, 0x89abcd10
+	@ the same register may be both stored and loaded
+	swp	r1, r1, [r4]
+	expect	r1, 0x89abcd10
+	expect_memory	r4, 0x10
+
+	@ a store exclusive succeeds if the value loaded exclusively is still in memory
+	ldrex	r0, [r4]
+	expect	r0, 0x10
+	add	r0, r0, #1
+	strex	r1, r0, [r4]
+	cmp	r1, #0
+	bne	fail
+	expect_memory	r4, 0x11
+
+	@ it fails after clrex
+	ldrex	r0, [r4]
+	clrex
+	strex	r1, r0, [r4]
+	cmp	r1, #1
+	bne	fail
+
+	@ it fails if another value was stored in between, and leaves memory unchanged
+	ldrex	r0, [r4]
+	mov	r2, #5
+	str	r2, [r4]
+	strex	r1, r0, [r4]
+	cmp	r1, #1
+	bne	fail
+	expect_memory	r4, 5
+
+	@ halfwords, bytes and doublewords
+	ldrexh	r0, [r4]
+	expect	r0, 5
+	ldr	r0, =0xabcd
+	strexh	r1, r0, [r4]
+	cmp	r1, #0
+	bne	fail
+	ldrexb	r0, [r4]
+	expect	r0, 0xcd
+	mov	r0, #0xef
+	strexb	r1, r0, [r4]
+	cmp	r1, #0
+	bne	fail
+	expect_memory	r4, 0xabef
+
+	ldrexd	r0, r1, [r4]
+	expect	r0, 0xabef
+	expect	r1, 0x76543210
+	mov	r8, r1
+	mov	r9, r0
+	strexd	r2, r8, r9, [r4]
+	cmp	r2, #0
+	bne	fail
+	expect_memory	r4, 0x76543210
+	ldr	r11, [r4, #4]
+	expect	r11, 0xabef
+	ldrexd	r0, r1, [r4]
+	str	r0, [r4, #4]
+	strexd	r2, r0, r1, [r4]
+	cmp	r2, #1
+	bne	fail
+
+	mov	r0, #1
+	ldr	r1, =message
+	mov	r2, #3
+	mov	r7, #SYS_WRITE
+	swi	0
+	mov	r0, #0
+	mov	r7, #SYS_EXIT_GROUP
+	swi	0
+
+fail:
+	mov	r0, #1
+	mov	r7, #SYS_EXIT_GROUP
+	swi	0
+
+	.data
+
+message:
+	.ascii	"ok\n"
+
+	.align	3
+word:
+	.word	0x01234567, 0x76543210
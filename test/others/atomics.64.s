@@ -0,0 +1,207 @@
+// Test exclusive, acquire/release and ARMv8.1 atomic instructions, prints ok if every result is as expected
+// Needs the -v8.1 option
+
+	.text
+	.global	_start
+
+	.equ	SYS_WRITE, 64
+	.equ	SYS_EXIT_GROUP, 94
+
+	.macro	expect register, value
+	ldr	x9, =\value
+	cmp	\register, x9
+	b.ne	fail
+	.endm
+
+	.macro	expect_memory address, value
+	ldr	x10, [\address]
+	expect	x10, \value
+	.endm
+
+	// sets the doubleword at address, runs the atomic operation with operand, then checks the value returned and the value left in memory
+	.macro	atomic operation, register, address, initial, operand, returned, stored
+	ldr	x9, =\initial
+	str	x9, [\address]
+	ldr	x11, =\operand
+	\operation	\register\()11, \register\()12, [\address]
+	expect	x12, \returned
+	expect_memory	\address, \stored
+	.endm
+
+_start:
+	ldr	x19, =word
+	ldr	x20, =pair
+
+	// a store exclusive succeeds if the value loaded exclusively is still in memory
+	ldxr	x0, [x19]
+	expect	x0, 0x1122334455667788
+	add	x0, x0, #1
+	stxr	w1, x0, [x19]
+	cbnz	w1, fail
+	expect_memory	x19, 0x1122334455667789
+
+	// it fails after clrex
+	ldxr	x0, [x19]
+	clrex
+	stxr	w1, x0, [x19]
+	cbz	w1, fail
+
+	// it fails if another value was stored in between, and leaves memory unchanged
+	ldxr	x0, [x19]
+	mov	x2, #5
+	str	x2, [x19]
+	stxr	w1, x0, [x19]
+	cbz	w1, fail
+	expect_memory	x19, 5
+
+	// a store exclusive without a preceding load exclusive fails
+	stxr	w1, x0, [x19]
+	cbz	w1, fail
+	expect_memory	x19, 5
+
+	// acquire and release forms, words, halfwords and bytes
+	ldaxr	w0, [x19]
+	expect	x0, 5
+	ldr	w0, =0x12345678
+	stlxr	w1, w0, [x19]
+	cbnz	w1, fail
+	ldaxrh	w0, [x19]
+	expect	x0, 0x5678
+	mov	w0, #0xabcd
+	stlxrh	w1, w0, [x19]
+	cbnz	w1, fail
+	ldxrb	w0, [x19]
+	expect	x0, 0xcd
+	mov	w0, #0xef
+	stxrb	w1, w0, [x19]
+	cbnz	w1, fail
+	expect_memory	x19, 0x1234abef
+
+	// pairs swap their doublewords
+	ldxp	x0, x1, [x20]
+	expect	x0, 0x0123456789abcdef
+	expect	x1, 0xfedcba9876543210
+	stxp	w2, x1, x0, [x20]
+	cbnz	w2, fail
+	expect_memory	x20, 0xfedcba9876543210
+	ldaxp	x0, x1, [x20]
+	expect	x0, 0xfedcba9876543210
+	expect	x1, 0x0123456789abcdef
+	stlxp	w2, x1, x0, [x20]
+	cbnz	w2, fail
+	expect_memory	x20, 0x0123456789abcdef
+	ldxp	w0, w1, [x20]
+	expect	x0, 0x89abcdef
+	expect	x1, 0x01234567
+	stxp	w2, w1, w0, [x20]
+	cbnz	w2, fail
+	expect_memory	x20, 0x89abcdef01234567
+
+	// a pair store exclusive fails after clrex and if either doubleword changed
+	ldxp	x0, x1, [x20]
+	clrex
+	stxp	w2, x0, x1, [x20]
+	cbz	w2, fail
+	ldxp	x0, x1, [x20]
+	str	xzr, [x20, #8]
+	stxp	w2, x0, x1, [x20]
+	cbz	w2, fail
+	expect_memory	x20, 0x89abcdef01234567
+
+	// load-acquire and store-release
+	ldr	x0, =0x0f1e2d3c4b5a6978
+	stlr	x0, [x19]
+	ldar	x1, [x19]
+	expect	x1, 0x0f1e2d3c4b5a6978
+	stlrb	wzr, [x19]
+	ldarh	w1, [x19]
+	expect	x1, 0x6900
+	ldar	w1, [x19]
+	expect	x1, 0x4b5a6900
+
+	// compare and swap returns the value found in memory and only stores if it was the expected value
+	mov	x0, #5
+	str	x0, [x19]
+	mov	x1, #9
+	cas	x0, x1, [x19]
+	expect	x0, 5
+	expect_memory	x19, 9
+	mov	x0, #5
+	mov	x1, #7
+	casal	x0, x1, [x19]
+	expect	x0, 9
+	expect_memory	x19, 9
+	mov	w0, #9
+	mov	w1, #0x180
+	casb	w0, w1, [x19]
+	expect	x0, 9
+	expect_memory	x19, 0x80
+	mov	w0, #0x80
+	mov	w1, #0xffff
+	casah	w0, w1, [x19]
+	expect	x0, 0x80
+	expect_memory	x19, 0xffff
+
+	ldr	x0, =0x0123456789abcdef
+	ldr	x1, =0xfedcba9876543210
+	ldr	x2, =0x1111111111111111
+	ldr	x3, =0x2222222222222222
+	stp	x0, x1, [x20]
+	casp	x0, x1, x2, x3, [x20]
+	expect	x0, 0x0123456789abcdef
+	expect	x1, 0xfedcba9876543210
+	expect_memory	x20, 0x1111111111111111
+	ldr	x10, [x20, #8]
+	expect	x10, 0x2222222222222222
+	caspal	x0, x1, x2, x3, [x20]
+	expect	x0, 0x1111111111111111
+	expect	x1, 0x2222222222222222
+	mov	w2, #0
+	mov	w3, #0
+	casp	w0, w1, w2, w3, [x20]
+	expect	x0, 0x11111111
+	expect	x1, 0x11111111
+	expect_memory	x20, 0x1111111111111111
+
+	// atomic operations return the previous value
+	atomic	ldadd, x, x19, 0x00000000ffffffff, 1, 0x00000000ffffffff, 0x0000000100000000
+	atomic	ldaddal, w, x19, 0x00000000ffffffff, 1, 0x00000000ffffffff, 0x0000000000000000
+	atomic	ldclr, x, x19, 0xff00ff00ff00ff00, 0x0ff00ff00ff00ff0, 0xff00ff00ff00ff00, 0xf000f000f000f000
+	atomic	ldeor, x, x19, 0xff00ff00ff00ff00, 0x0ff00ff00ff00ff0, 0xff00ff00ff00ff00, 0xf0f0f0f0f0f0f0f0
+	atomic	ldset, x, x19, 0xff00ff00ff00ff00, 0x0ff00ff00ff00ff0, 0xff00ff00ff00ff00, 0xfff0fff0fff0fff0
+	atomic	ldsetlh, w, x19, 0x1234567800000000, 0x00010001, 0x0000000000000000, 0x1234567800000001
+	atomic	ldsmax, x, x19, 0x8000000000000000, 1, 0x8000000000000000, 1
+	atomic	ldsmin, x, x19, 0x8000000000000000, 1, 0x8000000000000000, 0x8000000000000000
+	atomic	ldumax, x, x19, 0x8000000000000000, 1, 0x8000000000000000, 0x8000000000000000
+	atomic	ldumin, x, x19, 0x8000000000000000, 1, 0x8000000000000000, 1
+	atomic	ldsmaxb, w, x19, 0x0000000000000080, 1, 0x80, 0x0000000000000001
+	atomic	ldsminab, w, x19, 0x0000000000000001, 0xff, 0x01, 0x00000000000000ff
+	atomic	ldumaxh, w, x19, 0x0000000000008000, 1, 0x8000, 0x0000000000008000
+	atomic	lduminl, w, x19, 0xffffffff80000000, 1, 0x80000000, 0xffffffff00000001
+	atomic	swp, x, x19, 0x0123456789abcdef, 0xfedcba9876543210, 0x0123456789abcdef, 0xfedcba9876543210
+	atomic	swpalb, w, x19, 0x0123456789abcdef, 0x10, 0xef, 0x0123456789abcd10
+
+	mov	x0, #1
+	ldr	x1, =message
+	mov	x2, #3
+	mov	x8, #SYS_WRITE
+	svc	0
+	mov	x0, #0
+	mov	x8, #SYS_EXIT_GROUP
+	svc	0
+
+fail:
+	mov	x0, #1
+	mov	x8, #SYS_EXIT_GROUP
+	svc	0
+
+	.data
+
+message:
+	.ascii	"ok\n"
+
+	.align	4
+pair:
+	.quad	0x0123456789abcdef, 0xfedcba9876543210
+word:
+	.quad	0x1122334455667788
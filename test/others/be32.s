@@ -0,0 +1,46 @@
+@ Test system call buffers in BE32 memory: reads the standard input into an unaligned buffer and writes it back with the bytes around it, a short read must leave the rest unchanged
+
+	.text
+	.global	_start
+
+	.equ	SYS_READ, 3
+	.equ	SYS_WRITE, 4
+	.equ	SYS_EXIT_GROUP, 248
+
+	.equ	BUFFER_SIZE, 60
+
+_start:
+	mov	r0, #0
+	ldr	r1, =buffer
+	mov	r2, #BUFFER_SIZE
+	mov	r7, #SYS_READ
+	swi	0
+	cmp	r0, #1
+	blt	fail
+
+	mov	r0, #1
+	ldr	r1, =before
+	mov	r2, #BUFFER_SIZE + 3
+	mov	r7, #SYS_WRITE
+	swi	0
+	cmp	r0, #BUFFER_SIZE + 3
+	bne	fail
+
+	mov	r0, #0
+	mov	r7, #SYS_EXIT_GROUP
+	swi	0
+
+fail:
+	mov	r0, #1
+	mov	r7, #SYS_EXIT_GROUP
+	swi	0
+
+	.data
+
+	.align	2
+before:
+	.ascii	"<"
+buffer:
+	.ascii	"------------------------------------------------------------"
+after:
+	.ascii	">\n"
@@ -0,0 +1,26 @@
+
+@ Test restoring snapshots: increments a counter in memory and prints it, every run restarted from a snapshot must print 1
+
+	.text
+	.global	_start
+
+_start:
+	ldr	r4, =counter
+	ldr	r0, [r4]
+	add	r0, r0, #1
+	str	r0, [r4]
+	add	r0, r0, #'0'
+	strb	r0, [r4, #4]
+	mov	r0, #1
+	add	r1, r4, #4
+	mov	r2, #2
+	swi	0x900000 + 4
+	mov	r0, #0
+	swi	0x900000 + 1
+
+	.data
+
+counter:
+	.word	0
+	.byte	0, '\n'
+
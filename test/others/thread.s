@@ -0,0 +1,200 @@
+@ Test threads: starts a thread with clone and joins it through the futex cleared when it exits,
+@ then exits the main thread while a second thread waits for it and ends the program with exit_group
+
+	.text
+	.global	_start
+	.syntax	unified
+
+	.equ	SYS_EXIT, 1
+	.equ	SYS_WRITE, 4
+	.equ	SYS_CLONE, 120
+	.equ	SYS_GETTID, 224
+	.equ	SYS_FUTEX, 240
+	.equ	SYS_EXIT_GROUP, 248
+	.equ	SYS_SET_TID_ADDRESS, 256
+
+	.equ	FUTEX_WAIT, 0
+	.equ	FUTEX_WAKE, 1
+	.equ	FUTEX_REQUEUE, 3
+	.equ	FUTEX_CMP_REQUEUE, 4
+	.equ	FUTEX_WAKE_OP, 5
+	.equ	FUTEX_PRIVATE_FLAG, 128
+
+	@ FUTEX_OP(FUTEX_OP_ADD, 5, FUTEX_OP_CMP_EQ, 7)
+	.equ	WAKE_OP_ADD_5_IF_7, (1 << 28) | (0 << 24) | (5 << 12) | 7
+
+	@ CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD | CLONE_SYSVSEM | CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID
+	.equ	CLONE_FLAGS, 0x00000100 | 0x00000200 | 0x00000400 | 0x00000800 | 0x00010000 | 0x00040000 | 0x00100000 | 0x00200000
+
+_start:
+	@ set_tid_address returns the thread ID, the same as gettid
+	ldr	r0, =main_tid
+	mov	r7, #SYS_SET_TID_ADDRESS
+	swi	0
+	mov	r4, r0
+	mov	r7, #SYS_GETTID
+	swi	0
+	cmp	r0, r4
+	bne	fail
+	ldr	r1, =main_tid
+	str	r0, [r1]
+
+	@ waiting on a word that holds another value fails immediately
+	ldr	r0, =word
+	mov	r1, #FUTEX_WAIT | FUTEX_PRIVATE_FLAG
+	mov	r2, #1
+	mov	r3, #0
+	mov	r7, #SYS_FUTEX
+	swi	0
+	cmn	r0, #11 @ EAGAIN
+	bne	fail
+
+	@ requeueing and waking without waiters wakes no thread, the compared value must match
+	ldr	r0, =word
+	mov	r1, #FUTEX_REQUEUE | FUTEX_PRIVATE_FLAG
+	mov	r2, #1
+	mov	r3, #1
+	ldr	r4, =word2
+	mov	r7, #SYS_FUTEX
+	swi	0
+	cmp	r0, #0
+	bne	fail
+
+	ldr	r0, =word
+	mov	r1, #FUTEX_CMP_REQUEUE | FUTEX_PRIVATE_FLAG
+	mov	r2, #1
+	mov	r3, #1
+	ldr	r4, =word2
+	mov	r5, #1
+	swi	0
+	cmn	r0, #11 @ EAGAIN
+	bne	fail
+
+	ldr	r0, =word
+	mov	r5, #0
+	swi	0
+	cmp	r0, #0
+	bne	fail
+
+	@ wake_op modifies the second word even if no thread waits on it
+	ldr	r0, =word
+	mov	r1, #FUTEX_WAKE_OP | FUTEX_PRIVATE_FLAG
+	mov	r2, #1
+	mov	r3, #1
+	ldr	r4, =word2
+	ldr	r5, =WAKE_OP_ADD_5_IF_7
+	swi	0
+	cmp	r0, #0
+	bne	fail
+	ldr	r0, [r4]
+	cmp	r0, #12
+	bne	fail
+
+	@ the first thread stores its thread ID and exits
+	ldr	r0, =CLONE_FLAGS
+	ldr	r1, =thread1_stack_top
+	ldr	r2, =thread1_tid
+	mov	r3, #0
+	ldr	r4, =thread1_tid
+	mov	r7, #SYS_CLONE
+	swi	0
+	cmp	r0, #0
+	beq	thread1
+	blt	fail
+	mov	r6, r0
+
+	@ the thread ID stays in thread1_tid until the thread exits
+join:
+	ldr	r0, =thread1_tid
+	ldr	r2, [r0]
+	cmp	r2, #0
+	beq	joined
+	mov	r1, #FUTEX_WAIT
+	mov	r3, #0
+	mov	r7, #SYS_FUTEX
+	swi	0
+	b	join
+
+joined:
+	ldr	r0, =thread1_result
+	ldr	r0, [r0]
+	cmp	r0, r6
+	bne	fail
+
+	@ the second thread outlives the main thread
+	ldr	r0, =CLONE_FLAGS
+	ldr	r1, =thread2_stack_top
+	ldr	r2, =thread2_tid
+	mov	r3, #0
+	ldr	r4, =thread2_tid
+	mov	r7, #SYS_CLONE
+	swi	0
+	cmp	r0, #0
+	beq	thread2
+	blt	fail
+
+	mov	r0, #1
+	mov	r7, #SYS_EXIT
+	swi	0
+
+thread1:
+	mov	r7, #SYS_GETTID
+	swi	0
+	ldr	r1, =thread1_result
+	str	r0, [r1]
+	mov	r0, #0
+	mov	r7, #SYS_EXIT
+	swi	0
+
+thread2:
+	@ waits until the exit of the main thread clears its thread ID
+	ldr	r0, =main_tid
+	ldr	r2, [r0]
+	cmp	r2, #0
+	beq	done
+	mov	r1, #FUTEX_WAIT
+	mov	r3, #0
+	mov	r7, #SYS_FUTEX
+	swi	0
+	b	thread2
+
+done:
+	mov	r0, #1
+	ldr	r1, =message
+	mov	r2, #3
+	mov	r7, #SYS_WRITE
+	swi	0
+	mov	r0, #0
+	mov	r7, #SYS_EXIT_GROUP
+	swi	0
+
+fail:
+	mov	r0, #1
+	mov	r7, #SYS_EXIT_GROUP
+	swi	0
+
+	.data
+
+message:
+	.ascii	"ok\n"
+
+	.align	2
+main_tid:
+	.word	0
+word:
+	.word	0
+word2:
+	.word	7
+thread1_tid:
+	.word	0
+thread1_result:
+	.word	0
+thread2_tid:
+	.word	0
+
+	.bss
+
+	.skip	0x100
+thread1_stack_top:
+	.skip	0x100
+thread2_stack_top: